@@ -0,0 +1,243 @@
+/**
+ * @file bench.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-08
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "bench.h"
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static double Now() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/* Core cycles of this thread in user mode from perf_event, which follow
+ * frequency scaling, or else TSC ticks, which are close while the core runs
+ * at its nominal frequency.
+ */
+class CycleCounter {
+ public:
+  CycleCounter() : fd_(-1), source_("none") {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+                                   PERF_FLAG_FD_CLOEXEC));
+    if (fd_ != -1) {
+      source_ = "perf";
+    } else {
+#if defined(__x86_64__) || defined(__i386__)
+      source_ = "tsc";
+#endif
+    }
+  }
+  ~CycleCounter() {
+    if (fd_ != -1) close(fd_);
+  }
+
+  CycleCounter(const CycleCounter&) = delete;
+  CycleCounter& operator=(const CycleCounter&) = delete;
+
+  const char* source() const { return source_; }
+  bool available() const { return strcmp(source_, "none") != 0; }
+
+  uint64_t Read() const {
+    if (fd_ != -1) {
+      uint64_t value = 0;
+      if (read(fd_, &value, sizeof(value)) != sizeof(value)) return 0;
+      return value;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+ private:
+  int fd_;
+  const char* source_;
+};
+
+// Runs fn for at least `seconds` and returns the number of calls made.
+static size_t RunFor(const std::function<void()>& fn, double seconds,
+                     const CycleCounter& counter, double* elapsed,
+                     uint64_t* cycles) {
+  size_t calls = 0;
+  size_t batch = 1;
+  uint64_t start_cycles = counter.Read();
+  double start = Now();
+  double now = start;
+  while (now - start < seconds) {
+    for (size_t i = 0; i < batch; ++i) {
+      fn();
+    }
+    calls += batch;
+    batch = std::min<size_t>(batch * 2, 1 << 16);
+    now = Now();
+  }
+  *cycles = counter.Read() - start_cycles;
+  *elapsed = now - start;
+  return calls;
+}
+
+struct BenchResult {
+  const BenchCase* c;
+  // medians and extremes over the repetitions
+  double ns;
+  double min_ns;
+  double max_ns;
+  double cycles;
+};
+
+static double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+static std::string JsonString(const std::string& s) {
+  std::string out = "\"";
+  for (char ch : s) {
+    if (ch == '"' || ch == '\\') {
+      out.push_back('\\');
+      out.push_back(ch);
+    } else if (static_cast<unsigned char>(ch) >= 0x20) {
+      out.push_back(ch);
+    }
+  }
+  out.push_back('"');
+  return out;
+}
+
+static std::string CpuModel() {
+  FILE* fp = fopen("/proc/cpuinfo", "r");
+  if (fp == nullptr) return "";
+  char line[256];
+  std::string model;
+  while (fgets(line, sizeof(line), fp) != nullptr) {
+    const char* colon = strchr(line, ':');
+    if (strncmp(line, "model name", 10) == 0 && colon != nullptr) {
+      model = colon + 1;
+      model.erase(0, model.find_first_not_of(" \t"));
+      model.erase(model.find_last_not_of(" \t\n") + 1);
+      break;
+    }
+  }
+  fclose(fp);
+  return model;
+}
+
+static void PrintJson(const std::vector<BenchResult>& results,
+                      const BenchOptions& options,
+                      const CycleCounter& counter) {
+  fprintf(stdout,
+          "{\n  \"context\": {\n    \"cpu\": %s,\n    \"compiler\": %s,\n"
+          "    \"build\": \"%s\",\n    \"cycle_counter\": \"%s\",\n"
+          "    \"warmup_seconds\": %g,\n    \"rep_seconds\": %g,\n"
+          "    \"reps\": %d\n  },\n  \"benchmarks\": [",
+          JsonString(CpuModel()).c_str(), JsonString(__VERSION__).c_str(),
+#ifdef NDEBUG
+          "release",
+#else
+          "debug",
+#endif
+          counter.source(), options.warmup_seconds, options.rep_seconds,
+          options.reps);
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchResult& r = results[i];
+    double bytes_per_item = static_cast<double>(r.c->bytes) / r.c->items;
+    fprintf(stdout,
+            "%s\n    {\"name\": %s, \"items\": %zu, \"bytes\": %zu, "
+            "\"ns_per_item\": %.3f, \"min_ns_per_item\": %.3f, "
+            "\"max_ns_per_item\": %.3f, \"items_per_second\": %.0f, "
+            "\"mb_per_second\": %.1f",
+            i == 0 ? "" : ",", JsonString(r.c->name).c_str(), r.c->items,
+            r.c->bytes, r.ns, r.min_ns, r.max_ns, 1e9 / r.ns,
+            bytes_per_item * 1e3 / r.ns);
+    if (counter.available()) {
+      fprintf(stdout, ", \"cycles_per_item\": %.2f, \"cycles_per_byte\": %.3f",
+              r.cycles, bytes_per_item > 0 ? r.cycles / bytes_per_item : 0.0);
+    }
+    fprintf(stdout, "}");
+  }
+  fprintf(stdout, "\n  ]\n}\n");
+}
+
+int RunBenches(const std::vector<BenchCase>& cases,
+               const BenchOptions& options) {
+  CycleCounter counter;
+  if (!options.json) {
+    fprintf(stdout, "%-40s %12s %16s %10s %10s\n", "benchmark", "ns/item",
+            "items/s", "MB/s", "cycles/B");
+  }
+
+  std::vector<BenchResult> results;
+  for (const BenchCase& c : cases) {
+    if (options.filter != nullptr &&
+        strstr(c.name.c_str(), options.filter) == nullptr) {
+      continue;
+    }
+
+    double elapsed;
+    uint64_t cycles;
+    RunFor(c.fn, options.warmup_seconds, counter, &elapsed, &cycles);
+
+    std::vector<double> ns_per_item;
+    std::vector<double> cycles_per_item;
+    for (int i = 0; i < options.reps; ++i) {
+      size_t calls = RunFor(c.fn, options.rep_seconds, counter, &elapsed,
+                            &cycles);
+      ns_per_item.push_back(elapsed * 1e9 / (calls * c.items));
+      cycles_per_item.push_back(static_cast<double>(cycles) /
+                                (calls * c.items));
+    }
+
+    BenchResult r;
+    r.c = &c;
+    r.ns = Median(ns_per_item);
+    r.min_ns = *std::min_element(ns_per_item.begin(), ns_per_item.end());
+    r.max_ns = *std::max_element(ns_per_item.begin(), ns_per_item.end());
+    r.cycles = Median(cycles_per_item);
+    results.push_back(r);
+
+    if (!options.json) {
+      double bytes_per_item = static_cast<double>(c.bytes) / c.items;
+      char cycles_per_byte[16] = "-";
+      if (counter.available() && bytes_per_item > 0) {
+        snprintf(cycles_per_byte, sizeof(cycles_per_byte), "%.3f",
+                 r.cycles / bytes_per_item);
+      }
+      fprintf(stdout, "%-40s %12.2f %16.0f %10.1f %10s\n", c.name.c_str(),
+              r.ns, 1e9 / r.ns, bytes_per_item * 1e3 / r.ns, cycles_per_byte);
+    }
+  }
+
+  if (options.json) {
+    PrintJson(results, options, counter);
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file bench.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-08
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+struct BenchCase {
+  std::string name;
+  // 每次调用处理 items 个对象，共 bytes 字节
+  std::function<void()> fn;
+  size_t items;
+  size_t bytes;
+};
+
+struct BenchOptions {
+  // 只执行名称包含该子串的用例，nullptr 表示全部
+  const char* filter;
+  double warmup_seconds;
+  // 每次重复至少运行的时间
+  double rep_seconds;
+  int reps;
+  // 输出 JSON 而不是表格，便于比较不同构建
+  bool json;
+
+  BenchOptions()
+      : filter(nullptr),
+        warmup_seconds(0.1),
+        rep_seconds(0.2),
+        reps(5),
+        json(false) {}
+};
+
+/**
+ * @brief 依次执行选中的用例，每个用例先预热再重复计时，输出各次重复的中位数
+ *
+ * 周期数优先读取 perf_event 的 CPU cycles，不可用时在 x86 上退回 TSC。
+ *
+ * @return int 0 表示成功
+ */
+int RunBenches(const std::vector<BenchCase>& cases,
+               const BenchOptions& options);
+
+void RegisterDecodeBenches(std::vector<BenchCase>* cases);
+void RegisterEncodeBenches(std::vector<BenchCase>* cases);
+void RegisterCrc32cBenches(std::vector<BenchCase>* cases);
+void RegisterInetAddressBenches(std::vector<BenchCase>* cases);
+void RegisterPrefixSetBenches(std::vector<BenchCase>* cases);
+void RegisterRateLimiterBenches(std::vector<BenchCase>* cases);
+
+// keeps the compiler from discarding a value computed only for timing
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
@@ -0,0 +1,55 @@
+/**
+ * @file bench_crc32c.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-12
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "crc32c.h"
+
+void RegisterCrc32cBenches(std::vector<BenchCase>* cases) {
+  // "123456789" is the standard check input of CRC32C
+  if (Crc32c(0, "123456789", 9) != 0xE3069283 ||
+      Crc32cPortable(0, "123456789", 9) != 0xE3069283) {
+    fprintf(stderr, "crc32c check value mismatch\n");
+    abort();
+  }
+
+  // typical v2 header sizes: bare IPv4, IPv6 with TLVs, large TLV blocks
+  static const size_t kSizes[] = {28, 256, 4096};
+  for (size_t size : kSizes) {
+    std::shared_ptr<std::vector<uint8_t>> data(new std::vector<uint8_t>(size));
+    for (size_t i = 0; i < size; ++i) {
+      (*data)[i] = static_cast<uint8_t>(i * 131 + 7);
+    }
+
+    BenchCase c;
+    c.items = 1;
+    c.bytes = size;
+
+    c.name = std::string("crc32c/") +
+             (Crc32cHardware() ? "sse4.2/" : "portable/") +
+             std::to_string(size);
+    c.fn = [data]() { DoNotOptimize(Crc32c(0, data->data(), data->size())); };
+    cases->push_back(c);
+
+    c.name = "crc32c/slicing-by-8/" + std::to_string(size);
+    c.fn = [data]() {
+      DoNotOptimize(Crc32cPortable(0, data->data(), data->size()));
+    };
+    cases->push_back(c);
+  }
+}
@@ -0,0 +1,317 @@
+/**
+ * @file bench_decode.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-08
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "proxyproto.h"
+
+static const size_t kCorpusSize = 256;
+
+static const char kV2Sig[12] = {0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D,
+                                0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A};
+
+static unsigned int Rand(std::mt19937* rng, unsigned int mask) {
+  return static_cast<unsigned int>((*rng)()) & mask;
+}
+
+static std::string MakeV1Tcp4(std::mt19937* rng) {
+  char buf[108];
+  snprintf(buf, sizeof(buf), "PROXY TCP4 %u.%u.%u.%u %u.%u.%u.%u %u %u\r\n",
+           Rand(rng, 0xFF), Rand(rng, 0xFF), Rand(rng, 0xFF), Rand(rng, 0xFF),
+           Rand(rng, 0xFF), Rand(rng, 0xFF), Rand(rng, 0xFF), Rand(rng, 0xFF),
+           Rand(rng, 0xFFFF), Rand(rng, 0xFFFF));
+  return buf;
+}
+
+static std::string MakeV1Tcp6(std::mt19937* rng) {
+  char buf[108];
+  snprintf(buf, sizeof(buf), "PROXY TCP6 2001:db8::%x:%x fd00::%x %u %u\r\n",
+           Rand(rng, 0xFFFF), Rand(rng, 0xFFFF), Rand(rng, 0xFFFF),
+           Rand(rng, 0xFFFF), Rand(rng, 0xFFFF));
+  return buf;
+}
+
+static std::string MakeV2(std::mt19937* rng, bool ipv6) {
+  std::string hdr(kV2Sig, sizeof(kV2Sig));
+  hdr.push_back(0x21);
+  hdr.push_back(ipv6 ? 0x21 : 0x11);
+  uint16_t len = htons(ipv6 ? 36 : 12);
+  hdr.append(reinterpret_cast<const char*>(&len), 2);
+  for (int i = 0; i < (ipv6 ? 36 : 12); ++i) {
+    hdr.push_back(static_cast<char>((*rng)()));
+  }
+  return hdr;
+}
+
+static InetAddress RandomAddr(std::mt19937* rng, bool ipv6) {
+  InetAddress addr;
+  if (ipv6) {
+    struct sockaddr_in6 addr6;
+    memset(&addr6, 0, sizeof(addr6));
+    addr6.sin6_family = AF_INET6;
+    for (int i = 0; i < 16; ++i) {
+      addr6.sin6_addr.s6_addr[i] = static_cast<uint8_t>((*rng)());
+    }
+    addr6.sin6_port = static_cast<uint16_t>((*rng)());
+    addr.set_addr6(addr6);
+  } else {
+    struct sockaddr_in addr4;
+    memset(&addr4, 0, sizeof(addr4));
+    addr4.sin_family = AF_INET;
+    addr4.sin_addr.s_addr = static_cast<uint32_t>((*rng)());
+    addr4.sin_port = static_cast<uint16_t>((*rng)());
+    addr.set_addr4(addr4);
+  }
+  return addr;
+}
+
+// what load balancers attach: ALPN, SNI, a request id and a checksum
+static std::string MakeV2Tlv(std::mt19937* rng, bool ipv6) {
+  static const char* const kAlpns[] = {"h2", "http/1.1"};
+  const char* alpn = kAlpns[Rand(rng, 1)];
+  char authority[32];
+  snprintf(authority, sizeof(authority), "svc%u.example.com",
+           Rand(rng, 0xFFFF));
+  uint8_t unique_id[32];
+  for (size_t i = 0; i < sizeof(unique_id); ++i) {
+    unique_id[i] = static_cast<uint8_t>((*rng)());
+  }
+  ProxyProtoTlv tlvs[] = {
+      {PP2_TYPE_ALPN, static_cast<uint16_t>(strlen(alpn)),
+       reinterpret_cast<const uint8_t*>(alpn)},
+      {PP2_TYPE_AUTHORITY, static_cast<uint16_t>(strlen(authority)),
+       reinterpret_cast<const uint8_t*>(authority)},
+      {PP2_TYPE_UNIQUE_ID, sizeof(unique_id), unique_id},
+  };
+
+  char buf[256];
+  int n = EncodeProxyProtoV2(RandomAddr(rng, ipv6), RandomAddr(rng, ipv6),
+                             PROXYPROTO_CMD_PROXY, PROXYPROTO_TRANSPORT_STREAM,
+                             tlvs, 3, PROXYPROTO_ENCODE_CRC32C, buf,
+                             sizeof(buf));
+  return std::string(buf, n > 0 ? n : 0);
+}
+
+static std::string MakeValid(std::mt19937* rng, size_t i) {
+  switch (i % 5) {
+    case 0:
+      return MakeV1Tcp4(rng);
+    case 1:
+      return MakeV2(rng, false);
+    case 2:
+      return MakeV1Tcp6(rng);
+    case 3:
+      return MakeV2(rng, true);
+    default:
+      return MakeV2Tlv(rng, i % 2 != 0);
+  }
+}
+
+// a prefix of a valid header, as left by a short read
+static std::string MakeTruncated(std::mt19937* rng, size_t i) {
+  std::string hdr = MakeValid(rng, i);
+  hdr.resize(1 + (*rng)() % (hdr.size() - 1));
+  return hdr;
+}
+
+// one defect per header, each rejected by a different check
+static std::string MakeMalformed(std::mt19937* rng, size_t i) {
+  char buf[160];
+  std::string hdr;
+  switch (i % 8) {
+    case 0:
+      hdr = MakeV1Tcp4(rng);
+      hdr[9] = '5';  // TCP5
+      return hdr;
+    case 1:
+      snprintf(buf, sizeof(buf), "PROXY TCP4 10.%u.0.1 10.0.0.%u 80 443\r\n",
+               256 + Rand(rng, 0xFF), Rand(rng, 0xFF));
+      return buf;
+    case 2:
+      snprintf(buf, sizeof(buf), "PROXY TCP4 10.0.0.1 10.0.0.2 %u 443\r\n",
+               65536 + Rand(rng, 0xFFFF));
+      return buf;
+    case 3:
+      // longer than any v1 line without reaching CRLF
+      hdr = "PROXY TCP6 ";
+      while (hdr.size() < 120) {
+        snprintf(buf, sizeof(buf), "%x:", Rand(rng, 0xFFFF));
+        hdr += buf;
+      }
+      return hdr;
+    case 4:
+      hdr = MakeV2(rng, false);
+      hdr[12] = 0x11;  // version 1 in the binary format
+      return hdr;
+    case 5:
+      hdr = MakeV2(rng, true);
+      hdr[12] = 0x2F;  // unknown command
+      return hdr;
+    case 6:
+      hdr = MakeV2(rng, false);
+      hdr[13] = 0x21;  // IPv6 in a block sized for IPv4
+      return hdr;
+    default:
+      snprintf(buf, sizeof(buf),
+               "GET /%u HTTP/1.1\r\nHost: example.com\r\n\r\n",
+               Rand(rng, 0xFFFF));
+      return buf;
+  }
+}
+
+enum Expect {
+  kExpectDecoded,
+  kExpectNeedMore,
+  kExpectError,
+};
+
+struct Corpus {
+  std::vector<std::string> headers;
+  std::vector<ProxyProtoSpan> spans;
+  std::vector<ProxyProtoResult> results;
+  size_t bytes;
+};
+
+// fields other than ret are unspecified when decoding fails
+static bool SameResult(const ProxyProtoResult& a, const ProxyProtoResult& b) {
+  if (a.ret != b.ret) return false;
+  if (a.ret <= 0) return true;
+  return a.version == b.version && a.command == b.command &&
+         a.transport == b.transport && a.src == b.src && a.dst == b.dst;
+}
+
+/* Corpora are fixed, the generator is seeded the same way on every run, and
+ * each header is checked to decode as expected before it is timed. The batch
+ * decoder has to agree with the scalar one on every header, with and without
+ * checksum verification.
+ */
+static std::shared_ptr<Corpus> MakeCorpus(
+    const char* name, std::string (*make)(std::mt19937*, size_t),
+    Expect expect) {
+  std::shared_ptr<Corpus> corpus(new Corpus);
+  std::mt19937 rng(1);
+  corpus->bytes = 0;
+  for (size_t i = 0; i < kCorpusSize; ++i) {
+    corpus->headers.push_back(make(&rng, i));
+    corpus->bytes += corpus->headers.back().size();
+  }
+  for (const std::string& hdr : corpus->headers) {
+    ProxyProtoSpan span = {hdr.data(), hdr.size()};
+    corpus->spans.push_back(span);
+
+    ProxyProtoResult res;
+    int ret = DecodeProxyProto(hdr.data(), hdr.size(), &res,
+                               PROXYPROTO_VERIFY_CRC32C);
+    bool ok = expect == kExpectDecoded    ? ret == static_cast<int>(hdr.size())
+              : expect == kExpectNeedMore ? ret == 0
+                                          : ret < 0;
+    if (!ok) {
+      fprintf(stderr, "decode corpus %s: unexpected result %d\n", name, ret);
+      abort();
+    }
+  }
+  corpus->results.resize(kCorpusSize);
+
+  const int kFlags[] = {0, PROXYPROTO_VERIFY_CRC32C};
+  for (int flags : kFlags) {
+    DecodeProxyProtoBatch(corpus->spans.data(), corpus->spans.size(),
+                          corpus->results.data(), flags);
+    for (size_t i = 0; i < kCorpusSize; ++i) {
+      ProxyProtoResult res;
+      DecodeProxyProto(corpus->spans[i].data, corpus->spans[i].size, &res,
+                       flags);
+      if (!SameResult(res, corpus->results[i])) {
+        fprintf(stderr,
+                "decode corpus %s: batch differs from scalar at %zu, "
+                "flags %d, ret %d vs %d\n",
+                name, i, flags, corpus->results[i].ret, res.ret);
+        abort();
+      }
+    }
+  }
+  return corpus;
+}
+
+static void AddCorpus(std::vector<BenchCase>* cases, const char* name,
+                      std::shared_ptr<Corpus> corpus, int flags = 0) {
+  BenchCase scalar;
+  scalar.name = std::string("decode/") + name + "/scalar";
+  scalar.fn = [corpus, flags]() {
+    for (size_t i = 0; i < corpus->spans.size(); ++i) {
+      ProxyProtoResult& res = corpus->results[i];
+      DecodeProxyProto(corpus->spans[i].data, corpus->spans[i].size, &res,
+                       flags);
+    }
+    DoNotOptimize(corpus->results[0]);
+  };
+  scalar.items = corpus->spans.size();
+  scalar.bytes = corpus->bytes;
+  cases->push_back(scalar);
+
+  BenchCase batch = scalar;
+  batch.name = std::string("decode/") + name + "/batch";
+  batch.fn = [corpus, flags]() {
+    DecodeProxyProtoBatch(corpus->spans.data(), corpus->spans.size(),
+                          corpus->results.data(), flags);
+    DoNotOptimize(corpus->results[0]);
+  };
+  cases->push_back(batch);
+}
+
+void RegisterDecodeBenches(std::vector<BenchCase>* cases) {
+  AddCorpus(cases, "v1-tcp4",
+            MakeCorpus("v1-tcp4",
+                       [](std::mt19937* rng, size_t) {
+                         return MakeV1Tcp4(rng);
+                       },
+                       kExpectDecoded));
+  AddCorpus(cases, "v1-tcp6",
+            MakeCorpus("v1-tcp6",
+                       [](std::mt19937* rng, size_t) {
+                         return MakeV1Tcp6(rng);
+                       },
+                       kExpectDecoded));
+  AddCorpus(cases, "v2-ipv4",
+            MakeCorpus("v2-ipv4",
+                       [](std::mt19937* rng, size_t) {
+                         return MakeV2(rng, false);
+                       },
+                       kExpectDecoded));
+  AddCorpus(cases, "v2-ipv6",
+            MakeCorpus("v2-ipv6",
+                       [](std::mt19937* rng, size_t) {
+                         return MakeV2(rng, true);
+                       },
+                       kExpectDecoded));
+  std::shared_ptr<Corpus> tlv =
+      MakeCorpus("v2-tlv",
+                 [](std::mt19937* rng, size_t i) {
+                   return MakeV2Tlv(rng, i % 2 != 0);
+                 },
+                 kExpectDecoded);
+  AddCorpus(cases, "v2-tlv", tlv);
+  AddCorpus(cases, "v2-tlv-crc32c", tlv, PROXYPROTO_VERIFY_CRC32C);
+  AddCorpus(cases, "mixed", MakeCorpus("mixed", MakeValid, kExpectDecoded));
+  AddCorpus(cases, "truncated",
+            MakeCorpus("truncated", MakeTruncated, kExpectNeedMore));
+  AddCorpus(cases, "malformed",
+            MakeCorpus("malformed", MakeMalformed, kExpectError));
+}
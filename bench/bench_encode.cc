@@ -0,0 +1,213 @@
+/**
+ * @file bench_encode.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-14
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "proxyproto.h"
+
+static const size_t kCorpusSize = 256;
+
+static const char kAlpn[] = "h2";
+static const char kAuthority[] = "www.example.com";
+
+struct AddrPair {
+  InetAddress src;
+  InetAddress dst;
+};
+
+struct EncodeCorpus {
+  std::vector<AddrPair> pairs;
+  // encoded v1 headers of pairs, input of the re-encoding case
+  std::vector<std::string> v1;
+  std::vector<char> out;
+};
+
+static AddrPair MakePair(std::mt19937* rng, bool ipv6) {
+  AddrPair pair;
+  if (ipv6) {
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    for (int i = 0; i < 16; ++i) {
+      addr.sin6_addr.s6_addr[i] = static_cast<uint8_t>((*rng)());
+    }
+    addr.sin6_port = static_cast<uint16_t>((*rng)());
+    pair.src.set_addr6(addr);
+    for (int i = 0; i < 16; ++i) {
+      addr.sin6_addr.s6_addr[i] = static_cast<uint8_t>((*rng)());
+    }
+    addr.sin6_port = static_cast<uint16_t>((*rng)());
+    pair.dst.set_addr6(addr);
+  } else {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = static_cast<uint32_t>((*rng)());
+    addr.sin_port = static_cast<uint16_t>((*rng)());
+    pair.src.set_addr4(addr);
+    addr.sin_addr.s_addr = static_cast<uint32_t>((*rng)());
+    addr.sin_port = static_cast<uint16_t>((*rng)());
+    pair.dst.set_addr4(addr);
+  }
+  return pair;
+}
+
+static bool SameTlv(const ProxyProtoTlvs& tlvs, uint8_t type,
+                    const char* value) {
+  ProxyProtoTlv tlv;
+  return tlvs.Find(type, &tlv) && tlv.length == strlen(value) &&
+         memcmp(tlv.value, value, tlv.length) == 0;
+}
+
+/* Encodes every pair as v1, as v2 with TLVs and a checksum, and re-encodes
+ * the decoded v1 header as v2, each result has to decode to the same pair.
+ */
+static bool CheckRoundTrip(const EncodeCorpus& corpus,
+                           const ProxyProtoTlv* tlvs, size_t num_tlvs) {
+  char buf[512];
+  for (const AddrPair& pair : corpus.pairs) {
+    ProxyProtoResult res;
+    int n = EncodeProxyProtoV1(pair.src, pair.dst, buf, sizeof(buf));
+    if (n <= 0 || DecodeProxyProto(buf, n, &res) != n || res.version != 1 ||
+        res.src != pair.src || res.dst != pair.dst) {
+      return false;
+    }
+    // too small for the line, nothing is written past cap
+    if (EncodeProxyProtoV1(pair.src, pair.dst, buf, n - 1) >= 0) {
+      return false;
+    }
+
+    n = EncodeProxyProtoV2(res, tlvs, num_tlvs, PROXYPROTO_ENCODE_CRC32C, buf,
+                           sizeof(buf));
+    ProxyProtoResult res2;
+    ProxyProtoTlvs view;
+    if (n <= 0 ||
+        DecodeProxyProto(buf, n, &res2, PROXYPROTO_VERIFY_CRC32C) != n ||
+        res2.version != 2 || res2.command != PROXYPROTO_CMD_PROXY ||
+        res2.transport != PROXYPROTO_TRANSPORT_STREAM ||
+        res2.src != pair.src || res2.dst != pair.dst ||
+        view.Init(buf, n) != 0 || !SameTlv(view, PP2_TYPE_ALPN, kAlpn) ||
+        !SameTlv(view, PP2_TYPE_AUTHORITY, kAuthority)) {
+      return false;
+    }
+    buf[16] ^= 1;
+    if (DecodeProxyProto(buf, n, &res2, PROXYPROTO_VERIFY_CRC32C) >= 0) {
+      return false;
+    }
+  }
+
+  ProxyProtoResult res;
+  InetAddress unspec;
+  unspec.set_unspec();
+  int n = EncodeProxyProtoV1(unspec, unspec, buf, sizeof(buf));
+  if (n != 15 || DecodeProxyProto(buf, n, &res) != n ||
+      res.transport != PROXYPROTO_TRANSPORT_UNSPEC) {
+    return false;
+  }
+  n = EncodeProxyProtoV2(unspec, unspec, PROXYPROTO_CMD_LOCAL,
+                         PROXYPROTO_TRANSPORT_UNSPEC, nullptr, 0, 0, buf,
+                         sizeof(buf));
+  return n == 16 && DecodeProxyProto(buf, n, &res) == n &&
+         res.command == PROXYPROTO_CMD_LOCAL;
+}
+
+void RegisterEncodeBenches(std::vector<BenchCase>* cases) {
+  std::shared_ptr<EncodeCorpus> corpus(new EncodeCorpus);
+  std::mt19937 rng(1);
+  for (size_t i = 0; i < kCorpusSize; ++i) {
+    corpus->pairs.push_back(MakePair(&rng, i % 2 != 0));
+  }
+  char buf[108];
+  for (const AddrPair& pair : corpus->pairs) {
+    int n = EncodeProxyProtoV1(pair.src, pair.dst, buf, sizeof(buf));
+    corpus->v1.push_back(std::string(buf, n > 0 ? n : 0));
+  }
+  corpus->out.resize(kCorpusSize * 512);
+
+  std::shared_ptr<std::vector<ProxyProtoTlv>> tlvs(
+      new std::vector<ProxyProtoTlv>());
+  ProxyProtoTlv tlv = {PP2_TYPE_ALPN, static_cast<uint16_t>(strlen(kAlpn)),
+                       reinterpret_cast<const uint8_t*>(kAlpn)};
+  tlvs->push_back(tlv);
+  tlv.type = PP2_TYPE_AUTHORITY;
+  tlv.length = static_cast<uint16_t>(strlen(kAuthority));
+  tlv.value = reinterpret_cast<const uint8_t*>(kAuthority);
+  tlvs->push_back(tlv);
+
+  if (!CheckRoundTrip(*corpus, tlvs->data(), tlvs->size())) {
+    fprintf(stderr, "encode/decode round trip mismatch\n");
+    abort();
+  }
+
+  // bytes are the encoded output of one pass over the corpus
+  auto add = [cases, corpus](const char* name, std::function<int()> fn) {
+    BenchCase c;
+    c.name = name;
+    c.fn = [fn]() { DoNotOptimize(fn()); };
+    c.items = kCorpusSize;
+    c.bytes = static_cast<size_t>(fn());
+    cases->push_back(c);
+  };
+
+  add("encode/v1", [corpus]() {
+    int total = 0;
+    for (size_t i = 0; i < kCorpusSize; ++i) {
+      const AddrPair& pair = corpus->pairs[i];
+      total += EncodeProxyProtoV1(pair.src, pair.dst, &corpus->out[i * 512],
+                                  512);
+    }
+    return total;
+  });
+  add("encode/v2", [corpus]() {
+    int total = 0;
+    for (size_t i = 0; i < kCorpusSize; ++i) {
+      const AddrPair& pair = corpus->pairs[i];
+      total += EncodeProxyProtoV2(pair.src, pair.dst, PROXYPROTO_CMD_PROXY,
+                                  PROXYPROTO_TRANSPORT_STREAM, nullptr, 0, 0,
+                                  &corpus->out[i * 512], 512);
+    }
+    return total;
+  });
+  add("encode/v2/tlv+crc32c", [corpus, tlvs]() {
+    int total = 0;
+    for (size_t i = 0; i < kCorpusSize; ++i) {
+      const AddrPair& pair = corpus->pairs[i];
+      total += EncodeProxyProtoV2(
+          pair.src, pair.dst, PROXYPROTO_CMD_PROXY, PROXYPROTO_TRANSPORT_STREAM,
+          tlvs->data(), tlvs->size(), PROXYPROTO_ENCODE_CRC32C,
+          &corpus->out[i * 512], 512);
+    }
+    return total;
+  });
+  add("reencode/v1-to-v2", [corpus]() {
+    int total = 0;
+    for (size_t i = 0; i < kCorpusSize; ++i) {
+      const std::string& hdr = corpus->v1[i];
+      ProxyProtoResult res;
+      if (DecodeProxyProto(hdr.data(), hdr.size(), &res) > 0) {
+        total += EncodeProxyProtoV2(res, nullptr, 0, 0, &corpus->out[i * 512],
+                                    512);
+      }
+    }
+    return total;
+  });
+}
@@ -0,0 +1,213 @@
+/**
+ * @file bench_inet_address.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-26
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "inet_address.h"
+
+static const size_t kCorpusSize = 256;
+
+/* The text path InetAddress had before FormatTo(): inet_ntop() and snprintf()
+ * into a stack buffer, returned as a std::string.
+ */
+static std::string LegacyToAddrPort(const InetAddress& addr) {
+  char buf[128] = {0};
+  const struct sockaddr* sa = addr.GetSockAddr();
+  const void* src = sa->sa_family == AF_INET
+                        ? static_cast<const void*>(
+                              &reinterpret_cast<const struct sockaddr_in*>(sa)
+                                   ->sin_addr)
+                        : static_cast<const void*>(
+                              &reinterpret_cast<const struct sockaddr_in6*>(sa)
+                                   ->sin6_addr);
+  if (inet_ntop(sa->sa_family, src, buf, sizeof(buf)) == nullptr) return "";
+  size_t end = strlen(buf);
+  snprintf(buf + end, sizeof(buf) - end, ":%u", addr.ToPort());
+  return buf;
+}
+
+static InetAddress MakeIpv4(std::mt19937* rng) {
+  struct sockaddr_in addr4;
+  memset(&addr4, 0, sizeof(addr4));
+  addr4.sin_family = AF_INET;
+  addr4.sin_addr.s_addr = static_cast<uint32_t>((*rng)());
+  addr4.sin_port = static_cast<uint16_t>((*rng)());
+  return InetAddress(addr4);
+}
+
+/* Global unicast addresses with zero groups here and there, and every
+ * fourth one IPv4-mapped, so that "::" and the dotted tail are exercised.
+ */
+static InetAddress MakeIpv6(std::mt19937* rng, size_t i) {
+  struct sockaddr_in6 addr6;
+  memset(&addr6, 0, sizeof(addr6));
+  addr6.sin6_family = AF_INET6;
+  uint8_t* b = addr6.sin6_addr.s6_addr;
+  if (i % 4 == 3) {
+    b[10] = 0xFF;
+    b[11] = 0xFF;
+    for (int j = 12; j < 16; ++j) b[j] = static_cast<uint8_t>((*rng)());
+  } else {
+    b[0] = 0x20;
+    b[1] = 0x01;
+    for (int j = 2; j < 16; ++j) b[j] = static_cast<uint8_t>((*rng)());
+    int zero = static_cast<int>((*rng)() % 8);
+    int len = static_cast<int>((*rng)() % 4);
+    for (int j = zero; j < std::min(8, zero + len); ++j) {
+      b[2 * j] = 0;
+      b[2 * j + 1] = 0;
+    }
+  }
+  addr6.sin6_port = static_cast<uint16_t>((*rng)());
+  return InetAddress(addr6);
+}
+
+struct AddrCorpus {
+  std::vector<InetAddress> addrs;
+  // copies of addrs, compared element by element
+  std::vector<InetAddress> copies;
+  std::vector<PackedInetAddress> packed;
+  size_t text_bytes;
+};
+
+/* Each address has to format as the legacy path does, and survive packing
+ * and copying equal with the same hash.
+ */
+static std::shared_ptr<AddrCorpus> MakeCorpus(const char* name,
+                                              std::vector<InetAddress> addrs) {
+  std::shared_ptr<AddrCorpus> corpus(new AddrCorpus);
+  corpus->addrs = addrs;
+  corpus->text_bytes = 0;
+  for (const InetAddress& addr : addrs) {
+    char buf[InetAddress::kTextSize];
+    size_t n = addr.FormatTo(buf);
+    std::string legacy = LegacyToAddrPort(addr);
+    PackedInetAddress packed;
+    bool ok = legacy == std::string(buf, n) && addr.Pack(&packed);
+    InetAddress unpacked(packed);
+    if (!ok || unpacked != addr || unpacked.Hash() != addr.Hash()) {
+      fprintf(stderr, "address corpus %s: mismatch at %s, legacy %s\n", name,
+              buf, legacy.c_str());
+      abort();
+    }
+    corpus->copies.push_back(unpacked);
+    corpus->packed.push_back(packed);
+    corpus->text_bytes += n;
+  }
+  return corpus;
+}
+
+static void AddCorpus(std::vector<BenchCase>* cases, const char* name,
+                      std::shared_ptr<AddrCorpus> corpus) {
+  BenchCase c;
+  c.items = corpus->addrs.size();
+  c.bytes = corpus->text_bytes;
+
+  c.name = std::string("addr/") + name + "/format/legacy";
+  c.fn = [corpus]() {
+    for (const InetAddress& addr : corpus->addrs) {
+      std::string text = LegacyToAddrPort(addr);
+      DoNotOptimize(text);
+    }
+  };
+  cases->push_back(c);
+
+  c.name = std::string("addr/") + name + "/format/to-addr-port";
+  c.fn = [corpus]() {
+    for (const InetAddress& addr : corpus->addrs) {
+      std::string text = addr.ToAddrPort();
+      DoNotOptimize(text);
+    }
+  };
+  cases->push_back(c);
+
+  c.name = std::string("addr/") + name + "/format/format-to";
+  c.fn = [corpus]() {
+    char buf[InetAddress::kTextSize];
+    for (const InetAddress& addr : corpus->addrs) {
+      DoNotOptimize(addr.FormatTo(buf));
+    }
+  };
+  cases->push_back(c);
+
+  // the remaining cases work on the binary form only
+  c.bytes = 0;
+
+  c.name = std::string("addr/") + name + "/hash";
+  c.fn = [corpus]() {
+    for (const InetAddress& addr : corpus->addrs) {
+      DoNotOptimize(addr.Hash());
+    }
+  };
+  cases->push_back(c);
+
+  c.name = std::string("addr/") + name + "/equal";
+  c.fn = [corpus]() {
+    for (size_t i = 0; i < corpus->addrs.size(); ++i) {
+      DoNotOptimize(corpus->addrs[i] == corpus->copies[i]);
+    }
+  };
+  cases->push_back(c);
+
+  c.name = std::string("addr/") + name + "/pack";
+  c.fn = [corpus]() {
+    for (size_t i = 0; i < corpus->addrs.size(); ++i) {
+      corpus->addrs[i].Pack(&corpus->packed[i]);
+    }
+    DoNotOptimize(corpus->packed[0]);
+  };
+  cases->push_back(c);
+
+  c.name = std::string("addr/") + name + "/unpack";
+  c.fn = [corpus]() {
+    for (size_t i = 0; i < corpus->addrs.size(); ++i) {
+      corpus->copies[i] = InetAddress(corpus->packed[i]);
+    }
+    DoNotOptimize(corpus->copies[0]);
+  };
+  cases->push_back(c);
+}
+
+void RegisterInetAddressBenches(std::vector<BenchCase>* cases) {
+  std::mt19937 rng(1);
+  std::vector<InetAddress> ipv4;
+  std::vector<InetAddress> ipv6;
+  for (size_t i = 0; i < kCorpusSize; ++i) {
+    ipv4.push_back(MakeIpv4(&rng));
+    ipv6.push_back(MakeIpv6(&rng, i));
+  }
+
+  // the edges of the "::" and dotted tail rules
+  static const char* const kEdges[] = {
+      "::", "::1", "::ffff:0.0.0.0", "::0.1.0.0", "::1:0:0:0",
+      "1::", "1:0:1::", "0:0:1::1", "fe80::1:0:0:1", "::ffff:1:0:0"};
+  for (const char* edge : kEdges) {
+    struct sockaddr_in6 addr6;
+    memset(&addr6, 0, sizeof(addr6));
+    addr6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, edge, &addr6.sin6_addr);
+    MakeCorpus("ipv6-edges", std::vector<InetAddress>(1, InetAddress(addr6)));
+  }
+
+  AddCorpus(cases, "ipv4", MakeCorpus("ipv4", ipv4));
+  AddCorpus(cases, "ipv6", MakeCorpus("ipv6", ipv6));
+}
@@ -0,0 +1,73 @@
+/**
+ * @file bench_main.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-08
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "bench.h"
+
+int main(int argc, char** argv) {
+  BenchOptions options;
+  bool check = false;
+  for (int i = 1; i < argc; ++i) {
+    bool ok = true;
+    if (strncmp(argv[i], "--filter=", 9) == 0) {
+      options.filter = argv[i] + 9;
+    } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+      options.warmup_seconds = atof(argv[i] + 9);
+      ok = options.warmup_seconds >= 0;
+    } else if (strncmp(argv[i], "--rep-time=", 11) == 0) {
+      options.rep_seconds = atof(argv[i] + 11);
+      ok = options.rep_seconds > 0;
+    } else if (strncmp(argv[i], "--reps=", 7) == 0) {
+      options.reps = atoi(argv[i] + 7);
+      ok = options.reps > 0;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      options.json = true;
+    } else if (strcmp(argv[i], "--check") == 0) {
+      check = true;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stdout,
+              "Usage: %s [--filter=SUBSTR] [--warmup=SEC] [--rep-time=SEC] "
+              "[--reps=N] [--json] [--check]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<BenchCase> cases;
+  RegisterDecodeBenches(&cases);
+  RegisterEncodeBenches(&cases);
+  RegisterCrc32cBenches(&cases);
+  RegisterInetAddressBenches(&cases);
+  RegisterPrefixSetBenches(&cases);
+  RegisterRateLimiterBenches(&cases);
+  if (check) {
+    // the self-checks ran while registering, each case runs once untimed
+    size_t n = 0;
+    for (const BenchCase& c : cases) {
+      if (options.filter != nullptr &&
+          strstr(c.name.c_str(), options.filter) == nullptr) {
+        continue;
+      }
+      c.fn();
+      ++n;
+    }
+    fprintf(stdout, "%zu cases checked\n", n);
+    return 0;
+  }
+  return RunBenches(cases, options);
+}
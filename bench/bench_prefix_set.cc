@@ -0,0 +1,221 @@
+/**
+ * @file bench_prefix_set.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-27
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "prefix_set.h"
+
+// prefixes per family, the size of a large cloud provider range list
+static const size_t kNumPrefixes = 20000;
+static const size_t kNumLookups = 4096;
+// distinct addresses of the hot cases
+static const size_t kNumHot = 16;
+
+struct Prefix {
+  uint8_t addr[16];
+  int len;
+  bool exclude;
+};
+
+static bool Covers(const Prefix& p, const uint8_t* addr) {
+  int full = p.len / 8;
+  if (memcmp(p.addr, addr, full) != 0) return false;
+  int rest = p.len % 8;
+  if (rest == 0) return true;
+  uint8_t mask = static_cast<uint8_t>(0xFF << (8 - rest));
+  return (p.addr[full] & mask) == (addr[full] & mask);
+}
+
+// the reference: the longest covering prefix, the later one on a tie
+static bool NaiveContains(const std::vector<Prefix>& prefixes,
+                          const uint8_t* addr) {
+  int best = -1;
+  bool include = false;
+  for (const Prefix& p : prefixes) {
+    if (p.len >= best && Covers(p, addr)) {
+      best = p.len;
+      include = !p.exclude;
+    }
+  }
+  return include;
+}
+
+/* IPv4 prefixes mostly /24 with /16 to /32 around them, IPv6 ones /32 to /64
+ * under a few /12, one in sixteen excluding a part of what it falls into.
+ */
+static std::vector<Prefix> MakePrefixes(std::mt19937* rng, bool ipv6) {
+  std::vector<Prefix> prefixes;
+  for (size_t i = 0; i < kNumPrefixes; ++i) {
+    Prefix p;
+    memset(&p, 0, sizeof(p));
+    for (int j = 0; j < (ipv6 ? 16 : 4); ++j) {
+      p.addr[j] = static_cast<uint8_t>((*rng)());
+    }
+    if (ipv6) {
+      p.addr[0] = 0x20;
+      p.addr[1] = static_cast<uint8_t>(p.addr[1] & 0x03);
+      p.len = 32 + static_cast<int>((*rng)() % 33);
+    } else {
+      static const int kLens[] = {16, 20, 22, 24, 24, 24, 24, 28, 32};
+      p.len = kLens[(*rng)() % (sizeof(kLens) / sizeof(kLens[0]))];
+    }
+    p.exclude = (*rng)() % 16 == 0;
+    if (p.exclude && !prefixes.empty()) {
+      // carve out of an earlier prefix
+      const Prefix& outer = prefixes[(*rng)() % prefixes.size()];
+      int len = p.len;
+      int full = outer.len / 8;
+      memcpy(p.addr, outer.addr, full + 1);
+      p.len = std::max(len, outer.len + 1);
+      if (p.len > (ipv6 ? 128 : 32)) continue;
+    }
+    prefixes.push_back(p);
+  }
+  return prefixes;
+}
+
+static std::string PrefixText(const Prefix& p, bool ipv6) {
+  char buf[INET6_ADDRSTRLEN];
+  inet_ntop(ipv6 ? AF_INET6 : AF_INET, p.addr, buf, sizeof(buf));
+  return std::string(p.exclude ? "!" : "") + buf + "/" + std::to_string(p.len);
+}
+
+struct LookupCorpus {
+  PrefixSet set;
+  std::vector<struct in_addr> ipv4;
+  std::vector<struct in6_addr> ipv6;
+};
+
+/* Half the addresses fall into a prefix, the rest anywhere. Every lookup is
+ * checked against the linear scan before timing.
+ */
+static std::shared_ptr<LookupCorpus> MakeCorpus() {
+  std::shared_ptr<LookupCorpus> corpus(new LookupCorpus);
+  std::mt19937 rng(1);
+  std::vector<Prefix> prefixes[2] = {MakePrefixes(&rng, false),
+                                     MakePrefixes(&rng, true)};
+  for (int family = 0; family < 2; ++family) {
+    for (const Prefix& p : prefixes[family]) {
+      if (corpus->set.Add(PrefixText(p, family == 1).c_str()) != 0) {
+        fprintf(stderr, "prefix set: bad prefix %s\n",
+                PrefixText(p, family == 1).c_str());
+        abort();
+      }
+    }
+  }
+  corpus->set.Build();
+
+  for (int family = 0; family < 2; ++family) {
+    size_t size = family == 1 ? 16 : 4;
+    for (size_t i = 0; i < kNumLookups; ++i) {
+      uint8_t addr[16];
+      for (size_t j = 0; j < size; ++j) {
+        addr[j] = static_cast<uint8_t>(rng());
+      }
+      if (i % 2 == 0) {
+        const Prefix& p = prefixes[family][rng() % prefixes[family].size()];
+        memcpy(addr, p.addr, p.len / 8);
+      }
+
+      bool got;
+      if (family == 1) {
+        struct in6_addr in6;
+        memcpy(&in6, addr, 16);
+        corpus->ipv6.push_back(in6);
+        got = corpus->set.ContainsIpv6(in6);
+      } else {
+        struct in_addr in;
+        memcpy(&in, addr, 4);
+        corpus->ipv4.push_back(in);
+        got = corpus->set.ContainsIpv4(in);
+      }
+      if (got != NaiveContains(prefixes[family], addr)) {
+        fprintf(stderr, "prefix set: lookup %zu of family %d mismatch\n", i,
+                family);
+        abort();
+      }
+    }
+  }
+  return corpus;
+}
+
+void RegisterPrefixSetBenches(std::vector<BenchCase>* cases) {
+  std::shared_ptr<LookupCorpus> corpus = MakeCorpus();
+
+  BenchCase c;
+  c.items = kNumLookups;
+  c.bytes = 0;
+
+  c.name = "prefix-set/ipv4/lookup";
+  c.fn = [corpus]() {
+    size_t hits = 0;
+    for (const struct in_addr& addr : corpus->ipv4) {
+      hits += corpus->set.ContainsIpv4(addr);
+    }
+    DoNotOptimize(hits);
+  };
+  cases->push_back(c);
+
+  // an accept path sees the same few load balancers over and over
+  c.name = "prefix-set/ipv4/lookup-hot";
+  c.fn = [corpus]() {
+    size_t hits = 0;
+    for (size_t i = 0; i < kNumLookups; ++i) {
+      hits += corpus->set.ContainsIpv4(corpus->ipv4[i % kNumHot]);
+    }
+    DoNotOptimize(hits);
+  };
+  cases->push_back(c);
+
+  c.name = "prefix-set/ipv6/lookup";
+  c.fn = [corpus]() {
+    size_t hits = 0;
+    for (const struct in6_addr& addr : corpus->ipv6) {
+      hits += corpus->set.ContainsIpv6(addr);
+    }
+    DoNotOptimize(hits);
+  };
+  cases->push_back(c);
+
+  c.name = "prefix-set/ipv6/lookup-hot";
+  c.fn = [corpus]() {
+    size_t hits = 0;
+    for (size_t i = 0; i < kNumLookups; ++i) {
+      hits += corpus->set.ContainsIpv6(corpus->ipv6[i % kNumHot]);
+    }
+    DoNotOptimize(hits);
+  };
+  cases->push_back(c);
+
+  c.name = "prefix-set/build";
+  c.items = 1;
+  c.fn = []() {
+    std::mt19937 rng(2);
+    PrefixSet set;
+    for (const Prefix& p : MakePrefixes(&rng, false)) {
+      set.Add(PrefixText(p, false).c_str());
+    }
+    set.Build();
+    DoNotOptimize(set.memory());
+  };
+  cases->push_back(c);
+}
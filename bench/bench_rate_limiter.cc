@@ -0,0 +1,206 @@
+/**
+ * @file bench_rate_limiter.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-28
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "bench.h"
+#include "rate_limiter.h"
+
+static const size_t kNumAcquires = 4096;
+// load balancers and busy clients seen over and over
+static const size_t kNumHot = 256;
+// far more addresses than the table holds, every miss evicts
+static const size_t kNumChurn = 1 << 20;
+static const size_t kMaxEntries = 16384;
+
+static RateKey MakeKey(std::mt19937_64* rng) {
+  RateKey key = {0, 0xFFFF00000000ULL | ((*rng)() & 0xFFFFFFFF)};
+  return key;
+}
+
+static void Expect(bool ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "rate limiter: %s\n", what);
+    abort();
+  }
+}
+
+/* The token bucket, the concurrent connection limit, a table full of held
+ * addresses, and that held addresses stay findable while others churn
+ * through the table and get evicted around them.
+ */
+static void CheckLimits() {
+  std::mt19937_64 rng(1);
+  bool held;
+  RateLimiter rate;
+  rate.Init(5, 0, kMaxEntries, 1);
+  RateKey key = MakeKey(&rng);
+  for (int i = 0; i < 5; ++i) {
+    Expect(rate.Acquire(key, 1000, &held) == RATE_LIMIT_ADMITTED && !held,
+           "burst rejected");
+  }
+  Expect(rate.Acquire(key, 1000, &held) == RATE_LIMIT_RATE, "burst exceeded");
+  Expect(rate.Acquire(key, 1199, &held) == RATE_LIMIT_RATE, "early refill");
+  Expect(rate.Acquire(key, 1200, &held) == RATE_LIMIT_ADMITTED, "no refill");
+
+  RateLimiter conns;
+  conns.Init(0, 2, kMaxEntries, 1);
+  Expect(conns.Acquire(key, 0, &held) == RATE_LIMIT_ADMITTED && held &&
+             conns.Acquire(key, 0, &held) == RATE_LIMIT_ADMITTED,
+         "conns rejected");
+  Expect(conns.Acquire(key, 0, &held) == RATE_LIMIT_CONNS && !held,
+         "conns exceeded");
+  conns.Release(key);
+  Expect(conns.Acquire(key, 0, &held) == RATE_LIMIT_ADMITTED, "release");
+
+  RateLimiter full;
+  full.Init(0, 1, 4, 1);
+  std::vector<RateKey> keys;
+  for (int i = 0; i < 5; ++i) {
+    keys.push_back(MakeKey(&rng));
+  }
+  for (int i = 0; i < 4; ++i) {
+    full.Acquire(keys[i], 0, &held);
+  }
+  Expect(full.Acquire(keys[4], 0, &held) == RATE_LIMIT_UNTRACKED && !held,
+         "full table");
+  full.Release(keys[0]);
+  Expect(full.Acquire(keys[4], 0, &held) == RATE_LIMIT_ADMITTED &&
+             full.size() == 4,
+         "eviction");
+
+  RateLimiter churn;
+  churn.Init(0, 1, 1024, 1);
+  keys.clear();
+  for (int i = 0; i < 1000; ++i) {
+    keys.push_back(MakeKey(&rng));
+    churn.Acquire(keys.back(), 0, &held);
+  }
+  for (int i = 0; i < 100000; ++i) {
+    RateKey other = MakeKey(&rng);
+    if (churn.Acquire(other, 0, &held) == RATE_LIMIT_ADMITTED && held) {
+      churn.Release(other);
+    }
+  }
+  for (const RateKey& k : keys) {
+    Expect(churn.Acquire(k, 0, &held) == RATE_LIMIT_CONNS, "held key lost");
+  }
+}
+
+struct LimiterCorpus {
+  RateLimiter limiter;
+  std::vector<RateKey> keys;
+  uint64_t now_ms;
+  size_t next;
+};
+
+void RegisterRateLimiterBenches(std::vector<BenchCase>* cases) {
+  CheckLimits();
+
+  std::mt19937_64 rng(2);
+  std::shared_ptr<LimiterCorpus> hot(new LimiterCorpus);
+  hot->limiter.Init(1000000, 1000000, kMaxEntries, 1);
+  for (size_t i = 0; i < kNumHot; ++i) {
+    hot->keys.push_back(MakeKey(&rng));
+  }
+  hot->now_ms = 0;
+
+  std::shared_ptr<LimiterCorpus> churn(new LimiterCorpus);
+  churn->limiter.Init(10, 0, kMaxEntries, 1);
+  for (size_t i = 0; i < kNumChurn; ++i) {
+    churn->keys.push_back(MakeKey(&rng));
+  }
+  churn->now_ms = 0;
+  churn->next = 0;
+
+  // every tracked address holds a connection, as when max_conns is at
+  // least limit_entries, no new address can evict one
+  std::shared_ptr<LimiterCorpus> held(new LimiterCorpus);
+  held->limiter.Init(0, 1, kMaxEntries, 1);
+  for (size_t i = 0; i < kMaxEntries; ++i) {
+    bool h;
+    held->limiter.Acquire(MakeKey(&rng), 0, &h);
+  }
+  for (size_t i = 0; i < kNumChurn; ++i) {
+    held->keys.push_back(MakeKey(&rng));
+  }
+  held->next = 0;
+
+  std::shared_ptr<LimiterCorpus> flood(new LimiterCorpus);
+  flood->limiter.Init(1, 0, kMaxEntries, 1);
+  flood->keys.push_back(MakeKey(&rng));
+
+  BenchCase c;
+  c.items = kNumAcquires;
+  c.bytes = 0;
+
+  // a connection of a known address, admitted and closed again
+  c.name = "rate-limit/acquire-release/hot";
+  c.fn = [hot]() {
+    // one millisecond a pass keeps the buckets topped up
+    ++hot->now_ms;
+    for (size_t i = 0; i < kNumAcquires; ++i) {
+      const RateKey& key = hot->keys[i % kNumHot];
+      bool held;
+      if (hot->limiter.Acquire(key, hot->now_ms, &held) ==
+              RATE_LIMIT_ADMITTED &&
+          held) {
+        hot->limiter.Release(key);
+      }
+    }
+  };
+  cases->push_back(c);
+
+  c.name = "rate-limit/acquire/churn";
+  c.fn = [churn]() {
+    ++churn->now_ms;
+    int admitted = 0;
+    for (size_t i = 0; i < kNumAcquires; ++i) {
+      bool held;
+      const RateKey& key = churn->keys[churn->next++ % kNumChurn];
+      admitted += churn->limiter.Acquire(key, churn->now_ms, &held) ==
+                  RATE_LIMIT_ADMITTED;
+    }
+    DoNotOptimize(admitted);
+  };
+  cases->push_back(c);
+
+  c.name = "rate-limit/acquire/full-held";
+  c.fn = [held]() {
+    int untracked = 0;
+    for (size_t i = 0; i < kNumAcquires; ++i) {
+      bool h;
+      const RateKey& key = held->keys[held->next++ % kNumChurn];
+      untracked += held->limiter.Acquire(key, 0, &h) == RATE_LIMIT_UNTRACKED;
+    }
+    DoNotOptimize(untracked);
+  };
+  cases->push_back(c);
+
+  // one address far over its rate, every acquire is a reject
+  c.name = "rate-limit/reject";
+  c.fn = [flood]() {
+    int rejected = 0;
+    for (size_t i = 0; i < kNumAcquires; ++i) {
+      bool held;
+      rejected += flood->limiter.Acquire(flood->keys[0], 0, &held) ==
+                  RATE_LIMIT_RATE;
+    }
+    DoNotOptimize(rejected);
+  };
+  cases->push_back(c);
+}
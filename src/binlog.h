@@ -0,0 +1,48 @@
+/**
+ * @file binlog.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-18
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * 二进制日志文件格式，由 logging.cc 写入、proxyproto-logcat 解析
+ *
+ * 文件以 16 字节文件头开始，之后是按 8 字节对齐的记录，直到 size 为 0 的记录或
+ * 文件结尾。整数均为主机字节序，地址与端口保持网络字节序。
+ *
+ *   记录头   uint32 size（含记录头与填充），uint32 site，uint64 time（纳秒）
+ *   调用点   site 带 kBinLogSiteFlag，内容为 uint8 level、uint32 line，以及以
+ *            NUL 结尾的 file、func、fmt，每个调用点在其日志之前出现一次
+ *   日志     内容为参数序列，每个参数以 BinLogArgType 开头
+ */
+
+static const char kBinLogMagic[8] = {'P', 'P', 'B', 'L', 'O', 'G', '1', '\0'};
+static const uint32_t kBinLogHeaderSize = 16;
+static const uint32_t kBinLogSiteFlag = 0x80000000;
+
+struct BinLogRecord {
+  uint32_t size;
+  uint32_t site;
+  uint64_t time;
+};
+
+static_assert(sizeof(BinLogRecord) == 16, "BinLogRecord size");
+
+enum BinLogArgType {
+  BINLOG_ARG_INT = 'i',      // int64
+  BINLOG_ARG_UINT = 'u',     // uint64
+  BINLOG_ARG_DOUBLE = 'f',   // double
+  BINLOG_ARG_POINTER = 'p',  // uint64
+  BINLOG_ARG_STRING = 's',   // uint16 长度 + 内容，不含 NUL
+  BINLOG_ARG_IPV4 = '4',     // 4 字节地址 + 2 字节端口
+  BINLOG_ARG_IPV6 = '6',     // 16 字节地址 + 2 字节端口
+};
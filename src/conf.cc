@@ -15,10 +15,122 @@
 
 #include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <string>
+#include <vector>
 
-#define OPTIND_LISTEN_PORT 0x1
-#define OPTIND_LOG_LEVEL 0x2
+#include "poller.h"
+#include "trusted_proxies.h"
+
+// getopt_long() values, past the range of short options
+enum {
+  OPTIND_LISTEN_PORT = 0x100,
+  OPTIND_LOG_LEVEL,
+  OPTIND_THREADS,
+  OPTIND_EDGE_TRIGGERED,
+  OPTIND_MAX_HEADER_BYTES,
+  OPTIND_VERIFY_CRC32C,
+  OPTIND_FORWARD,
+  OPTIND_LOG_FILE,
+  OPTIND_LOG_ASYNC,
+  OPTIND_BINARY_LOG,
+  OPTIND_LOG_SAMPLE,
+  OPTIND_LOG_ERROR_RATE,
+  OPTIND_STATS_INTERVAL,
+  OPTIND_METRICS_PORT,
+  OPTIND_HEADER_TIMEOUT,
+  OPTIND_MAX_LIFETIME,
+  OPTIND_POLLER,
+  OPTIND_TRUSTED_PROXIES,
+  OPTIND_UNTRUSTED,
+  OPTIND_PEER_RATE,
+  OPTIND_PEER_CONNS,
+  OPTIND_SOURCE_RATE,
+  OPTIND_SOURCE_CONNS,
+  OPTIND_LIMIT_ENTRIES,
+  OPTIND_EXPORT_RING,
+  OPTIND_EXPORT_RING_SIZE,
+  OPTIND_RECORD_DIR,
+  OPTIND_RECORD_SEGMENT_SIZE,
+  OPTIND_RECORD_ROTATE,
+  OPTIND_CONFIG,
+  OPTIND_EVENTS,
+  OPTIND_MAX_EVENTS,
+  OPTIND_MAX_CONNS,
+  OPTIND_LISTEN_BACKLOG,
+  OPTIND_POLL_TIMEOUT,
+  OPTIND_ADAPTIVE,
+};
+
+// HOST:PORT, an IPv6 literal HOST is written in brackets as in [::1]:80
+static int ParseHostPort(const char* arg, std::string* host, int* port) {
+  const char* colon = strrchr(arg, ':');
+  if (colon == nullptr || colon == arg) return -1;
+
+  char* end = nullptr;
+  long value = strtol(colon + 1, &end, 10);
+  if (end == colon + 1 || *end != '\0' || value <= 0 || value > 65535) {
+    return -1;
+  }
+
+  if (arg[0] == '[') {
+    if (colon[-1] != ']' || colon - arg < 3) return -1;
+    host->assign(arg + 1, colon - 1);
+  } else {
+    host->assign(arg, colon);
+  }
+  *port = static_cast<int>(value);
+  return 0;
+}
+
+static char* Trim(char* p) {
+  while (*p == ' ' || *p == '\t') ++p;
+  char* end = p + strlen(p);
+  while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' ||
+                     end[-1] == '\n')) {
+    --end;
+  }
+  *end = '\0';
+  return p;
+}
+
+/* Each line is an option without its leading dashes, as "threads = 4", or
+ * a bare name for options without a value, as "edge-triggered". '#' starts a
+ * comment. Appends them to args as "--threads=4".
+ */
+static int ReadConfigFile(const char* path, std::vector<std::string>* args,
+                          int* line) {
+  FILE* fp = fopen(path, "r");
+  if (fp == nullptr) {
+    return -1;
+  }
+
+  char buf[1024];
+  int err = 0;
+  *line = 0;
+  while (fgets(buf, sizeof(buf), fp) != nullptr) {
+    ++*line;
+    char* comment = strchr(buf, '#');
+    if (comment != nullptr) *comment = '\0';
+    char* value = strchr(buf, '=');
+    if (value != nullptr) *value++ = '\0';
+    char* name = Trim(buf);
+    if (*name == '\0' && value == nullptr) continue;
+    if (*name == '\0' || *name == '-' || strpbrk(name, " \t") != nullptr) {
+      err = -2;
+      break;
+    }
+    std::string arg = std::string("--") + name;
+    if (value != nullptr) {
+      arg += '=';
+      arg += Trim(value);
+    }
+    args->push_back(arg);
+  }
+  fclose(fp);
+  return err;
+}
 
 int ShowHelp(int argc, char** argv) {
   static struct {
@@ -27,6 +139,65 @@ int ShowHelp(int argc, char** argv) {
   } info[] = {
       {"--listen-port=PORT", "set listen port"},
       {"--log-level=LEVEL", "set log level, 0-debug,1-info,2-warn,3-error"},
+      {"--threads=N", "set number of reactor threads, default 1"},
+      {"--edge-triggered",
+       "use edge-triggered epoll, drain sockets until EAGAIN"},
+      {"--max-header-bytes=N",
+       "close peers sending N bytes without a header, default 65551"},
+      {"--verify-crc32c", "reject v2 headers whose PP2_TYPE_CRC32C mismatches"},
+      {"--forward=HOST:PORT",
+       "strip the header and relay the connection to HOST:PORT"},
+      {"--log-file=PATH", "append log lines to PATH instead of stdout"},
+      {"--log-async=POLICY",
+       "log from a background thread, drop or block when full"},
+      {"--binary-log=PATH",
+       "write raw log records to PATH, read with proxyproto-logcat"},
+      {"--log-sample=N", "log 1 in N connections in full, default 1"},
+      {"--log-error-rate=N",
+       "log at most N connection errors a second, 0 for no limit"},
+      {"--stats-interval=SEC",
+       "log a summary of counters every SEC seconds, 0 for none"},
+      {"--metrics-port=PORT", "serve Prometheus metrics on PORT"},
+      {"--header-timeout=MS",
+       "close clients without a header after MS, default 10000"},
+      {"--max-lifetime=SEC", "close connections after SEC seconds, 0 for none"},
+      {"--poller=BACKEND",
+       "auto, epoll or io_uring, default auto, epoll with --edge-triggered"},
+      {"--trusted-proxies=FILE",
+       "accept headers only from the CIDRs in FILE, reloaded on SIGHUP"},
+      {"--untrusted=POLICY",
+       "reject other peers, or passthrough to --forward, default reject"},
+      {"--peer-rate=N",
+       "accept N new connections a second per peer address, 0 for no limit"},
+      {"--peer-conns=N",
+       "allow N concurrent connections per peer address, 0 for no limit"},
+      {"--source-rate=N", "as --peer-rate, per source address of the header"},
+      {"--source-conns=N",
+       "as --peer-conns, per source address of the header"},
+      {"--limit-entries=N",
+       "addresses tracked per limit and reactor, default 16384"},
+      {"--export-ring=NAME",
+       "publish decoded connections to the shared memory ring NAME"},
+      {"--export-ring-size=N", "records per reactor in the ring, default 4096"},
+      {"--record-dir=DIR",
+       "append decoded and rejected connections to segment files in DIR"},
+      {"--record-segment-size=MB", "size of each segment file, default 64"},
+      {"--record-rotate=SEC",
+       "start a new segment file after SEC seconds, default 3600"},
+      {"--config=FILE",
+       "read options from FILE first, one \"name = value\" a line"},
+      {"--events=N",
+       "events taken from the poller at a time at first, default 4"},
+      {"--max-events=N",
+       "events taken at a time at most, default 20, 1024 with --adaptive"},
+      {"--max-conns=N",
+       "connections per reactor up to 65536, default 1024, auto from "
+       "RLIMIT_NOFILE"},
+      {"--listen-backlog=N",
+       "backlog of the listen sockets, default SOMAXCONN"},
+      {"--poll-timeout=MS", "wait for events at most MS, default 1000"},
+      {"--adaptive",
+       "shrink the event array when idle, --max-conns auto unless given"},
   };
   static int size = sizeof(info) / sizeof(info[0]);
 
@@ -50,23 +221,224 @@ int LoadConf(int argc, char** argv, Conf* conf) {
   static struct option long_options[] = {
       {"listen-port", required_argument, nullptr, OPTIND_LISTEN_PORT},
       {"log-level", required_argument, nullptr, OPTIND_LOG_LEVEL},
+      {"threads", required_argument, nullptr, OPTIND_THREADS},
+      {"edge-triggered", no_argument, nullptr, OPTIND_EDGE_TRIGGERED},
+      {"max-header-bytes", required_argument, nullptr,
+       OPTIND_MAX_HEADER_BYTES},
+      {"verify-crc32c", no_argument, nullptr, OPTIND_VERIFY_CRC32C},
+      {"forward", required_argument, nullptr, OPTIND_FORWARD},
+      {"log-file", required_argument, nullptr, OPTIND_LOG_FILE},
+      {"log-async", required_argument, nullptr, OPTIND_LOG_ASYNC},
+      {"binary-log", required_argument, nullptr, OPTIND_BINARY_LOG},
+      {"log-sample", required_argument, nullptr, OPTIND_LOG_SAMPLE},
+      {"log-error-rate", required_argument, nullptr, OPTIND_LOG_ERROR_RATE},
+      {"stats-interval", required_argument, nullptr, OPTIND_STATS_INTERVAL},
+      {"metrics-port", required_argument, nullptr, OPTIND_METRICS_PORT},
+      {"header-timeout", required_argument, nullptr, OPTIND_HEADER_TIMEOUT},
+      {"max-lifetime", required_argument, nullptr, OPTIND_MAX_LIFETIME},
+      {"poller", required_argument, nullptr, OPTIND_POLLER},
+      {"trusted-proxies", required_argument, nullptr, OPTIND_TRUSTED_PROXIES},
+      {"untrusted", required_argument, nullptr, OPTIND_UNTRUSTED},
+      {"peer-rate", required_argument, nullptr, OPTIND_PEER_RATE},
+      {"peer-conns", required_argument, nullptr, OPTIND_PEER_CONNS},
+      {"source-rate", required_argument, nullptr, OPTIND_SOURCE_RATE},
+      {"source-conns", required_argument, nullptr, OPTIND_SOURCE_CONNS},
+      {"limit-entries", required_argument, nullptr, OPTIND_LIMIT_ENTRIES},
+      {"export-ring", required_argument, nullptr, OPTIND_EXPORT_RING},
+      {"export-ring-size", required_argument, nullptr,
+       OPTIND_EXPORT_RING_SIZE},
+      {"record-dir", required_argument, nullptr, OPTIND_RECORD_DIR},
+      {"record-segment-size", required_argument, nullptr,
+       OPTIND_RECORD_SEGMENT_SIZE},
+      {"record-rotate", required_argument, nullptr, OPTIND_RECORD_ROTATE},
+      {"config", required_argument, nullptr, OPTIND_CONFIG},
+      {"events", required_argument, nullptr, OPTIND_EVENTS},
+      {"max-events", required_argument, nullptr, OPTIND_MAX_EVENTS},
+      {"max-conns", required_argument, nullptr, OPTIND_MAX_CONNS},
+      {"listen-backlog", required_argument, nullptr, OPTIND_LISTEN_BACKLOG},
+      {"poll-timeout", required_argument, nullptr, OPTIND_POLL_TIMEOUT},
+      {"adaptive", no_argument, nullptr, OPTIND_ADAPTIVE},
       {0, 0, 0, 0},
   };
 
   if (conf == nullptr) return -1;
 
-  int required_mask = OPTIND_LISTEN_PORT;
+  // the options of each --config go before those of the command line, in
+  // the order given, later ones override earlier ones
+  std::vector<std::string> file_args;
+  for (int i = 1; i < argc; ++i) {
+    const char* path = nullptr;
+    if (strncmp(argv[i], "--config=", 9) == 0) {
+      path = argv[i] + 9;
+    } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    }
+    if (path == nullptr) continue;
+
+    int line = 0;
+    int err = ReadConfigFile(path, &file_args, &line);
+    if (err == -1) {
+      fprintf(stderr, "open config %s failed\n", path);
+      return -19;
+    } else if (err != 0) {
+      fprintf(stderr, "config %s:%d bad line\n", path, line);
+      return -20;
+    }
+  }
+  std::vector<char*> args;
+  args.push_back(argv[0]);
+  for (std::string& arg : file_args) {
+    args.push_back(&arg[0]);
+  }
+  args.insert(args.end(), argv + 1, argv + argc);
+  args.push_back(nullptr);
+  argc = static_cast<int>(args.size()) - 1;
+  argv = args.data();
+
+  bool has_listen_port = false;
+  bool has_max_events = false;
+  bool has_max_conns = false;
   int opt;
   while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
     switch (opt) {
       case OPTIND_LISTEN_PORT:
-        required_mask &= ~opt;
+        has_listen_port = true;
         conf->listen_port = atoi(optarg);
         break;
       case OPTIND_LOG_LEVEL:
-        required_mask &= ~opt;
         conf->log_level = atoi(optarg);
         break;
+      case OPTIND_THREADS:
+        conf->threads = atoi(optarg);
+        break;
+      case OPTIND_EDGE_TRIGGERED:
+        conf->edge_triggered = 1;
+        break;
+      case OPTIND_MAX_HEADER_BYTES:
+        conf->max_header_bytes = atoi(optarg);
+        break;
+      case OPTIND_VERIFY_CRC32C:
+        conf->verify_crc32c = 1;
+        break;
+      case OPTIND_FORWARD:
+        if (ParseHostPort(optarg, &conf->forward_host, &conf->forward_port) !=
+            0) {
+          return -8;
+        }
+        break;
+      case OPTIND_LOG_FILE:
+        conf->log_file = optarg;
+        break;
+      case OPTIND_LOG_ASYNC:
+        if (strcmp(optarg, "drop") == 0) {
+          conf->log_async = 1;
+        } else if (strcmp(optarg, "block") == 0) {
+          conf->log_async = 2;
+        } else {
+          return -9;
+        }
+        break;
+      case OPTIND_BINARY_LOG:
+        conf->binary_log = optarg;
+        break;
+      case OPTIND_LOG_SAMPLE:
+        conf->log_sample = atoi(optarg);
+        break;
+      case OPTIND_LOG_ERROR_RATE:
+        conf->log_error_rate = atoi(optarg);
+        break;
+      case OPTIND_STATS_INTERVAL:
+        conf->stats_interval = atoi(optarg);
+        break;
+      case OPTIND_METRICS_PORT:
+        conf->metrics_port = atoi(optarg);
+        break;
+      case OPTIND_HEADER_TIMEOUT:
+        conf->header_timeout = atoi(optarg);
+        break;
+      case OPTIND_MAX_LIFETIME:
+        conf->max_lifetime = atoi(optarg);
+        break;
+      case OPTIND_POLLER:
+        if (strcmp(optarg, "auto") == 0) {
+          conf->poller = POLLER_AUTO;
+        } else if (strcmp(optarg, "epoll") == 0) {
+          conf->poller = POLLER_EPOLL;
+        } else if (strcmp(optarg, "io_uring") == 0) {
+          conf->poller = POLLER_IO_URING;
+        } else {
+          return -14;
+        }
+        break;
+      case OPTIND_TRUSTED_PROXIES:
+        conf->trusted_proxies = optarg;
+        break;
+      case OPTIND_UNTRUSTED:
+        if (strcmp(optarg, "reject") == 0) {
+          conf->untrusted = UNTRUSTED_REJECT;
+        } else if (strcmp(optarg, "passthrough") == 0) {
+          conf->untrusted = UNTRUSTED_PASSTHROUGH;
+        } else {
+          return -15;
+        }
+        break;
+      case OPTIND_PEER_RATE:
+        conf->peer_rate = atoi(optarg);
+        break;
+      case OPTIND_PEER_CONNS:
+        conf->peer_conns = atoi(optarg);
+        break;
+      case OPTIND_SOURCE_RATE:
+        conf->source_rate = atoi(optarg);
+        break;
+      case OPTIND_SOURCE_CONNS:
+        conf->source_conns = atoi(optarg);
+        break;
+      case OPTIND_LIMIT_ENTRIES:
+        conf->limit_entries = atoi(optarg);
+        break;
+      case OPTIND_EXPORT_RING:
+        conf->export_ring = optarg;
+        break;
+      case OPTIND_EXPORT_RING_SIZE:
+        conf->export_ring_size = atoi(optarg);
+        break;
+      case OPTIND_RECORD_DIR:
+        conf->record_dir = optarg;
+        break;
+      case OPTIND_RECORD_SEGMENT_SIZE:
+        conf->record_segment_size = atoi(optarg);
+        break;
+      case OPTIND_RECORD_ROTATE:
+        conf->record_rotate = atoi(optarg);
+        break;
+      case OPTIND_CONFIG:
+        // read before the other options
+        break;
+      case OPTIND_EVENTS:
+        conf->events = atoi(optarg);
+        break;
+      case OPTIND_MAX_EVENTS:
+        has_max_events = true;
+        conf->max_events = atoi(optarg);
+        break;
+      case OPTIND_MAX_CONNS:
+        has_max_conns = true;
+        // 0 stands for auto, a literal 0 is as invalid as a negative number
+        conf->max_conns = strcmp(optarg, "auto") == 0 ? 0 : atoi(optarg);
+        if (conf->max_conns == 0 && strcmp(optarg, "auto") != 0) {
+          conf->max_conns = -1;
+        }
+        break;
+      case OPTIND_LISTEN_BACKLOG:
+        conf->listen_backlog = atoi(optarg);
+        break;
+      case OPTIND_POLL_TIMEOUT:
+        conf->poll_timeout = atoi(optarg);
+        break;
+      case OPTIND_ADAPTIVE:
+        conf->adaptive = 1;
+        break;
       default:
         return -2;
     }
@@ -80,5 +452,70 @@ int LoadConf(int argc, char** argv, Conf* conf) {
     return -4;
   }
 
-  return required_mask == 0 ? 0 : -5;
+  if (conf->threads <= 0) {
+    return -6;
+  }
+
+  // the largest v1 line and the largest v2 header
+  if (conf->max_header_bytes < 108 || conf->max_header_bytes > 16 + 65535) {
+    return -7;
+  }
+
+  if (conf->log_sample <= 0) {
+    return -10;
+  }
+
+  if (conf->log_error_rate < 0 || conf->stats_interval < 0) {
+    return -11;
+  }
+
+  if (conf->metrics_port < 0 || conf->metrics_port > 65535 ||
+      conf->metrics_port == conf->listen_port) {
+    return -12;
+  }
+
+  if (conf->header_timeout < 0 || conf->max_lifetime < 0) {
+    return -13;
+  }
+
+  if (conf->peer_rate < 0 || conf->peer_conns < 0 || conf->source_rate < 0 ||
+      conf->source_conns < 0 || conf->limit_entries <= 0) {
+    return -16;
+  }
+
+  // passthrough relays as is, without --forward there is nowhere to relay to
+  if (conf->untrusted == UNTRUSTED_PASSTHROUGH && conf->forward_host.empty()) {
+    return -15;
+  }
+
+  // io_uring readiness is level-triggered only, --poller=auto picks epoll
+  if (conf->edge_triggered && conf->poller == POLLER_IO_URING) {
+    return -22;
+  }
+
+  if (conf->export_ring_size <= 0 || conf->export_ring_size > (1 << 24)) {
+    return -17;
+  }
+
+  if (conf->record_segment_size <= 0 || conf->record_segment_size > 4096 ||
+      conf->record_rotate < 0) {
+    return -18;
+  }
+
+  if (conf->adaptive) {
+    if (!has_max_events) {
+      conf->max_events = std::max(conf->events, 1024);
+    }
+    if (!has_max_conns) {
+      conf->max_conns = 0;
+    }
+  }
+  if (conf->events <= 0 || conf->max_events < conf->events ||
+      conf->max_events > 65536 || conf->max_conns < 0 ||
+      conf->max_conns > kMaxConns || conf->listen_backlog <= 0 ||
+      conf->poll_timeout <= 0) {
+    return -21;
+  }
+
+  return has_listen_port ? 0 : -5;
 }
@@ -11,9 +11,81 @@
 
 #pragma once
 
+#include <string>
+
+// upper bound of Conf::max_conns, Server::Start() allocates every slot, at
+// under 1 KiB each this stays within 64 MiB a reactor
+const int kMaxConns = 65536;
+
 struct Conf {
   int listen_port;
   int log_level;
+  int threads;
+  int edge_triggered;
+  int max_header_bytes;
+  int verify_crc32c;
+  // relay target of --forward, empty host disables forwarding
+  std::string forward_host;
+  int forward_port;
+  // empty for stdout
+  std::string log_file;
+  // 0 synchronous, otherwise 1 + LogFullPolicy
+  int log_async;
+  // non-empty to write the binary log there instead of text
+  std::string binary_log;
+  // info lines for 1 in log_sample connections
+  int log_sample;
+  // per-connection warnings per second and reactor, 0 for no limit
+  int log_error_rate;
+  // seconds between summary lines, 0 disables them
+  int stats_interval;
+  // HTTP port of the Prometheus scrape endpoint, 0 disables it
+  int metrics_port;
+  // milliseconds for a client to complete the header and, in forward mode,
+  // for the backend to accept, 0 for no limit
+  int header_timeout;
+  // seconds a connection may live in total, 0 for no limit
+  int max_lifetime;
+  // PollerBackend
+  int poller;
+  // CIDR list of the peers allowed to send headers, empty trusts everyone
+  std::string trusted_proxies;
+  // UntrustedPolicy
+  int untrusted;
+  // new connections a second and concurrent connections per peer address
+  // and per source address of the header, counted by each reactor on its
+  // own, 0 for no limit
+  int peer_rate;
+  int peer_conns;
+  int source_rate;
+  int source_conns;
+  // addresses each reactor tracks per key
+  int limit_entries;
+  // shared memory object the decoded connections are published to, empty
+  // for none
+  std::string export_ring;
+  // records per reactor
+  int export_ring_size;
+  // directory the decoded and rejected connections are appended to, empty
+  // for none
+  std::string record_dir;
+  // MiB of each segment file
+  int record_segment_size;
+  // seconds a segment file spans at most, 0 for no limit
+  int record_rotate;
+  // events each reactor takes from its poller at a time, to start with and
+  // at most, the array grows while wakeups fill it
+  int events;
+  int max_events;
+  // connections per reactor, 0 until main() derives it from RLIMIT_NOFILE
+  int max_conns;
+  // backlog of the listen sockets
+  int listen_backlog;
+  // milliseconds a reactor waits for events at most, bounds how late the
+  // reactors other than the first notice shutdown
+  int poll_timeout;
+  // shrink the event array again when wakeups leave it mostly empty
+  int adaptive;
 };
 
 int LoadConf(int argc, char** argv, Conf* conf);
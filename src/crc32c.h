@@ -0,0 +1,38 @@
+/**
+ * @file crc32c.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-12
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief 计算 CRC32C（Castagnoli，PP2_TYPE_CRC32C 使用的校验和）
+ *
+ * 启动时按 CPU 特性选择 SSE4.2 crc32 指令实现，不支持时使用 slicing-by-8 查表
+ * 实现。支持分段计算：Crc32c(Crc32c(0, a, n), b, m) 等于对 a、b 拼接后的结果。
+ *
+ * @param crc 前一段的结果，首段传 0
+ * @param data 输入数据
+ * @param size 输入数据长度
+ * @return uint32_t 校验和
+ */
+uint32_t Crc32c(uint32_t crc, const void* data, size_t size);
+
+/**
+ * @brief slicing-by-8 查表实现，结果与 Crc32c() 相同
+ */
+uint32_t Crc32cPortable(uint32_t crc, const void* data, size_t size);
+
+/**
+ * @brief Crc32c() 是否使用硬件指令
+ */
+bool Crc32cHardware();
@@ -0,0 +1,143 @@
+/**
+ * @file export_ring.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-29
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "export_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <string>
+
+#include "inet_address.h"
+
+static_assert(sizeof(pp_ring_header) == PP_RING_HEAD_SIZE,
+              "pp_ring_header size");
+static_assert(sizeof(pp_ring_record) == 128, "pp_ring_record size");
+static_assert(sizeof(pp_ring_record) % 8 == 0,
+              "records are copied in 8 byte words");
+// server records are filled from InetAddress::Pack()
+static_assert(sizeof(pp_ring_addr) == sizeof(PackedInetAddress) &&
+                  offsetof(pp_ring_addr, port) ==
+                      offsetof(PackedInetAddress, port) &&
+                  offsetof(pp_ring_addr, family) ==
+                      offsetof(PackedInetAddress, family),
+              "pp_ring_addr layout");
+
+static std::string g_name;
+static void* g_mapping = nullptr;
+static size_t g_size = 0;
+
+int OpenExportRing(const char* name, int num_rings, uint32_t capacity) {
+  CloseExportRing();
+
+  uint64_t records = 2;
+  while (records < capacity) {
+    records *= 2;
+  }
+  uint64_t ring_size = PP_RING_HEAD_SIZE + records * sizeof(pp_ring_record);
+  size_t size = static_cast<size_t>(PP_RING_HEAD_SIZE + num_rings * ring_size);
+
+  std::string path = name[0] == '/' ? name : std::string("/") + name;
+  // readers of a previous run keep their mapping of the unlinked object
+  shm_unlink(path.c_str());
+  int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return -errno;
+  }
+  if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    int err = -errno;
+    close(fd);
+    shm_unlink(path.c_str());
+    return err;
+  }
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  int err = p == MAP_FAILED ? -errno : 0;
+  close(fd);
+  if (err != 0) {
+    shm_unlink(path.c_str());
+    return err;
+  }
+
+  // ftruncate() zero fills, every head and seq starts at 0
+  pp_ring_header* h = static_cast<pp_ring_header*>(p);
+  h->layout = PP_RING_LAYOUT;
+  h->record_size = sizeof(pp_ring_record);
+  h->num_rings = static_cast<uint32_t>(num_rings);
+  h->capacity = static_cast<uint32_t>(records);
+  h->ring_offset = PP_RING_HEAD_SIZE;
+  h->ring_size = ring_size;
+  h->created_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+  h->pid = static_cast<uint32_t>(getpid());
+  // readers check the magic first, it goes in last
+  __atomic_store_n(&h->magic, PP_RING_MAGIC, __ATOMIC_RELEASE);
+
+  g_name = path;
+  g_mapping = p;
+  g_size = size;
+  return 0;
+}
+
+void CloseExportRing() {
+  if (g_mapping == nullptr) return;
+
+  pp_ring_header* h = static_cast<pp_ring_header*>(g_mapping);
+  __atomic_store_n(&h->closed, 1, __ATOMIC_RELEASE);
+  munmap(g_mapping, g_size);
+  shm_unlink(g_name.c_str());
+  g_mapping = nullptr;
+  g_size = 0;
+  g_name.clear();
+}
+
+ExportRingWriter::ExportRingWriter()
+    : head_(nullptr), records_(nullptr), mask_(0), next_(0) {}
+
+bool ExportRingWriter::Attach(int id) {
+  head_ = nullptr;
+  records_ = nullptr;
+  mask_ = 0;
+  next_ = 0;
+  if (g_mapping == nullptr) return false;
+
+  const pp_ring_header* h = static_cast<const pp_ring_header*>(g_mapping);
+  if (id < 0 || static_cast<uint32_t>(id) >= h->num_rings) return false;
+
+  char* ring =
+      static_cast<char*>(g_mapping) + h->ring_offset + id * h->ring_size;
+  head_ = reinterpret_cast<uint64_t*>(ring);
+  records_ = reinterpret_cast<pp_ring_record*>(ring + PP_RING_HEAD_SIZE);
+  mask_ = h->capacity - 1;
+  next_ = __atomic_load_n(head_, __ATOMIC_RELAXED);
+  return true;
+}
+
+void ExportRingWriter::Publish(const struct pp_ring_record& record) {
+  pp_ring_record* slot = &records_[next_ & mask_];
+  // the same word-wise copy as pp_ring_read(), between a seq of 0 and the
+  // final one readers tell a torn record
+  __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  const uint64_t* src = reinterpret_cast<const uint64_t*>(&record);
+  uint64_t* dst = reinterpret_cast<uint64_t*>(slot);
+  for (size_t i = 1; i < sizeof(record) / 8; ++i) {
+    __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+  }
+  ++next_;
+  __atomic_store_n(&slot->seq, next_, __ATOMIC_RELEASE);
+  __atomic_store_n(head_, next_, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,64 @@
+/**
+ * @file export_ring.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-29
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "proxyproto_ring.h"
+
+/**
+ * @brief 创建共享内存对象并映射，每个 reactor 一个环，布局见 proxyproto_ring.h
+ *
+ * 同名对象已存在时先删除，仍映射着旧对象的读者须重新打开。
+ *
+ * @param name 对象名，如 /proxyproto，不以 '/' 开头时自动补上
+ * @param num_rings 环的个数
+ * @param capacity 每个环的记录数，向上取整为 2 的幂
+ * @return int 0 成功，负的 errno 表示失败
+ */
+int OpenExportRing(const char* name, int num_rings, uint32_t capacity);
+
+/**
+ * @brief 标记为已关闭，解除映射并删除对象，须在所有 reactor 停止后调用
+ */
+void CloseExportRing();
+
+/**
+ * @brief 单个 reactor 写入自己的环，不加锁
+ */
+class ExportRingWriter {
+ public:
+  ExportRingWriter();
+
+  /**
+   * @brief 关联第 id 个环
+   *
+   * @return bool 环不存在时返回 false，之后 enabled() 为 false
+   */
+  bool Attach(int id);
+
+  bool enabled() const { return records_ != nullptr; }
+
+  /**
+   * @brief 发布一条记录，record.seq 被忽略
+   *
+   * 读者跟不上时覆盖最旧的记录，由读者按序号发现。
+   */
+  void Publish(const struct pp_ring_record& record);
+
+ private:
+  uint64_t* head_;
+  struct pp_ring_record* records_;
+  uint64_t mask_;
+  // records published, the producer is the only writer of *head_
+  uint64_t next_;
+};
@@ -11,7 +11,7 @@
 
 #include "inet_address.h"
 
-#include <arpa/inet.h>  // inet_ntop()
+#include <arpa/inet.h>  // inet_pton()
 
 #include <cstring>
 
@@ -44,34 +44,27 @@ static const in_addr_t kInaddrLoopback = INADDR_LOOPBACK;
 
 namespace detail {
 
-static int ToAddr(const struct sockaddr* addr, char* buf, size_t size) {
-  if (addr->sa_family == AF_INET) {
-    const struct sockaddr_in* addr4 =
-        reinterpret_cast<const struct sockaddr_in*>(addr);
-    return inet_ntop(AF_INET, &addr4->sin_addr, buf,
-                     static_cast<socklen_t>(size)) == nullptr
-               ? -1
-               : 0;
-  } else if (addr->sa_family == AF_INET6) {
-    const struct sockaddr_in6* addr6 =
-        reinterpret_cast<const struct sockaddr_in6*>(addr);
-    return inet_ntop(AF_INET6, &addr6->sin6_addr, buf,
-                     static_cast<socklen_t>(size)) == nullptr
-               ? -1
-               : 0;
+// the bytes of a Unix socket path as shown by ToAddr(), without the leading
+// NUL of an abstract name
+static const char* UnixPath(const struct sockaddr_un& addr, size_t* len) {
+  const char* path = addr.sun_path;
+  size_t max = sizeof(addr.sun_path);
+  if (path[0] == '\0') {
+    ++path;
+    --max;
   }
-  return -1;
+  *len = strnlen(path, max);
+  return path;
 }
 
-static int ToAddrPort(const struct sockaddr* addr, char* buf, size_t size) {
-  if (ToAddr(addr, buf, size) != 0) {
-    return -1;
-  }
-  size_t end = strlen(buf);
-  uint16_t port =
-      htons(reinterpret_cast<const struct sockaddr_in*>(addr)->sin_port);
-  snprintf(buf + end, size - end, ":%u", port);
-  return 0;
+// splitmix64 finalizer, every input bit reaches every output bit
+static uint64_t Mix(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
 }
 
 static int FromAddrPort(const char* ip, uint16_t port,
@@ -115,14 +108,208 @@ InetAddress::InetAddress(const std::string& addr, uint16_t port,
   }
 }
 
-std::string InetAddress::ToAddr() {
-  char buf[64] = {0};
-  return detail::ToAddr(GetSockAddr(), buf, sizeof(buf)) == 0 ? buf : "";
+void InetAddress::set_unspec() {
+  memset(&addr_un_, 0, sizeof(addr_un_));
+  addr_un_.sun_family = AF_UNSPEC;
+}
+
+InetAddress::InetAddress(const PackedInetAddress& packed) {
+  if (packed.family == AF_INET) {
+    memset(&addr4_, 0, sizeof(addr4_));
+    addr4_.sin_family = AF_INET;
+    memcpy(&addr4_.sin_addr, packed.addr, 4);
+    addr4_.sin_port = packed.port;
+  } else if (packed.family == AF_INET6) {
+    memset(&addr6_, 0, sizeof(addr6_));
+    addr6_.sin6_family = AF_INET6;
+    memcpy(&addr6_.sin6_addr, packed.addr, 16);
+    addr6_.sin6_port = packed.port;
+  } else {
+    set_unspec();
+  }
+}
+
+std::string InetAddress::ToAddr() const {
+  char buf[kTextSize];
+  return std::string(buf, FormatAddrTo(buf));
 }
 
-uint16_t InetAddress::ToPort() { return ntohs(addr4_.sin_port); }
+uint16_t InetAddress::ToPort() const {
+  return family() == AF_INET || family() == AF_INET6 ? ntohs(addr4_.sin_port)
+                                                     : 0;
+}
+
+std::string InetAddress::ToAddrPort() const {
+  char buf[kTextSize];
+  return std::string(buf, FormatTo(buf));
+}
+
+size_t InetAddress::FormatAddrTo(char* buf) const {
+  char* p = buf;
+  if (family() == AF_INET) {
+    p = FormatIpv4(addr4_.sin_addr, p);
+  } else if (family() == AF_INET6) {
+    p = FormatIpv6(addr6_.sin6_addr, p, true);
+  } else if (family() == AF_UNIX) {
+    // the path may fill sun_path without a terminator, an abstract socket
+    // name starts with NUL and is shown with a leading '@'
+    if (addr_un_.sun_path[0] == '\0') *p++ = '@';
+    size_t len;
+    const char* path = detail::UnixPath(addr_un_, &len);
+    memcpy(p, path, len);
+    p += len;
+  }
+  *p = '\0';
+  return p - buf;
+}
+
+size_t InetAddress::FormatTo(char* buf) const {
+  size_t n = FormatAddrTo(buf);
+  if (family() != AF_INET && family() != AF_INET6) {
+    return n;
+  }
+  char* p = buf + n;
+  *p++ = ':';
+  p = FormatU16(ntohs(addr4_.sin_port), p);
+  *p = '\0';
+  return p - buf;
+}
+
+uint64_t InetAddress::Hash() const {
+  uint64_t head = static_cast<uint64_t>(family()) << 16 | addr4_.sin_port;
+  if (family() == AF_INET) {
+    return detail::Mix(head << 32 | addr4_.sin_addr.s_addr);
+  }
+  if (family() == AF_INET6) {
+    uint64_t words[2];
+    memcpy(words, &addr6_.sin6_addr, 16);
+    uint64_t h = detail::Mix(head << 32 | addr6_.sin6_scope_id);
+    h = detail::Mix(h ^ words[0]);
+    return detail::Mix(h ^ words[1]);
+  }
+  if (family() == AF_UNIX) {
+    // FNV-1a, paths are rare and short enough to hash bytewise
+    size_t len;
+    const char* path = detail::UnixPath(addr_un_, &len);
+    uint64_t h = 0xcbf29ce484222325ULL ^ (addr_un_.sun_path[0] == '\0');
+    for (size_t i = 0; i < len; ++i) {
+      h = (h ^ static_cast<uint8_t>(path[i])) * 0x100000001b3ULL;
+    }
+    return detail::Mix(h);
+  }
+  return detail::Mix(head);
+}
 
-std::string InetAddress::ToAddrPort() {
-  char buf[64] = {0};
-  return detail::ToAddrPort(GetSockAddr(), buf, sizeof(buf)) == 0 ? buf : "";
+bool InetAddress::operator==(const InetAddress& other) const {
+  if (family() != other.family()) {
+    return false;
+  }
+  if (family() == AF_INET) {
+    return addr4_.sin_addr.s_addr == other.addr4_.sin_addr.s_addr &&
+           addr4_.sin_port == other.addr4_.sin_port;
+  }
+  if (family() == AF_INET6) {
+    return memcmp(&addr6_.sin6_addr, &other.addr6_.sin6_addr, 16) == 0 &&
+           addr6_.sin6_port == other.addr6_.sin6_port &&
+           addr6_.sin6_scope_id == other.addr6_.sin6_scope_id;
+  }
+  if (family() == AF_UNIX) {
+    size_t len, other_len;
+    const char* path = detail::UnixPath(addr_un_, &len);
+    const char* other_path = detail::UnixPath(other.addr_un_, &other_len);
+    return (addr_un_.sun_path[0] == '\0') ==
+               (other.addr_un_.sun_path[0] == '\0') &&
+           len == other_len && memcmp(path, other_path, len) == 0;
+  }
+  return true;
+}
+
+bool InetAddress::Pack(PackedInetAddress* packed) const {
+  memset(packed, 0, sizeof(*packed));
+  if (family() == AF_INET) {
+    memcpy(packed->addr, &addr4_.sin_addr, 4);
+    packed->port = addr4_.sin_port;
+    packed->family = AF_INET;
+  } else if (family() == AF_INET6) {
+    memcpy(packed->addr, &addr6_.sin6_addr, 16);
+    packed->port = addr6_.sin6_port;
+    packed->family = AF_INET6;
+  } else if (family() == AF_UNIX) {
+    return false;
+  } else {
+    packed->family = AF_UNSPEC;
+  }
+  return true;
+}
+
+/* Writes the decimal form of v at p and returns the end, 1 to 5 digits.
+ */
+char* FormatU16(uint16_t v, char* p) {
+  char tmp[5];
+  int n = 0;
+  do {
+    tmp[n++] = static_cast<char>('0' + v % 10);
+    v /= 10;
+  } while (v != 0);
+  while (n > 0) *p++ = tmp[--n];
+  return p;
+}
+
+char* FormatIpv4(const struct in_addr& addr, char* p) {
+  const uint8_t* b = reinterpret_cast<const uint8_t*>(&addr.s_addr);
+  for (int i = 0; i < 4; ++i) {
+    if (i > 0) *p++ = '.';
+    p = FormatU16(b[i], p);
+  }
+  return p;
+}
+
+/* Lowercase hex groups without leading zeros and the longest run of two or
+ * more zero groups shortened to "::". With dotted_tail the last 32 bits of
+ * ::ffff:0:0/96 and of ::/96 with at most one nonzero group are printed
+ * dotted, which is what glibc inet_ntop() does.
+ */
+char* FormatIpv6(const struct in6_addr& addr, char* p, bool dotted_tail) {
+  static const char kHex[] = "0123456789abcdef";
+  uint16_t groups[8];
+  for (int i = 0; i < 8; ++i) {
+    groups[i] = static_cast<uint16_t>((addr.s6_addr[2 * i] << 8) |
+                                      addr.s6_addr[2 * i + 1]);
+  }
+
+  int best = -1, best_len = 1;
+  for (int i = 0; i < 8;) {
+    if (groups[i] != 0) {
+      ++i;
+      continue;
+    }
+    int j = i;
+    while (j < 8 && groups[j] == 0) ++j;
+    if (j - i > best_len) {
+      best = i;
+      best_len = j - i;
+    }
+    i = j;
+  }
+
+  for (int i = 0; i < 8; ++i) {
+    if (i == best) {
+      *p++ = ':';
+      *p++ = ':';
+      i += best_len - 1;
+      continue;
+    }
+    if (i > 0 && i != best + best_len) *p++ = ':';
+    if (dotted_tail && i == 6 && best == 0 &&
+        (best_len == 6 || (best_len == 5 && groups[5] == 0xffff))) {
+      struct in_addr tail;
+      memcpy(&tail, addr.s6_addr + 12, 4);
+      return FormatIpv4(tail, p);
+    }
+    uint16_t v = groups[i];
+    int shift = 12;
+    while (shift > 0 && (v >> shift) == 0) shift -= 4;
+    for (; shift >= 0; shift -= 4) *p++ = kHex[(v >> shift) & 0xF];
+  }
+  return p;
 }
@@ -13,9 +13,25 @@
 
 #include <netinet/in.h>
 #include <stdint.h>
+#include <sys/un.h>
 
 #include <string>
 
+/* 20 字节的紧凑形式，用于存放大量端点。不保存 IPv6 的 flowinfo 与 scope id，
+ * Unix 地址无法打包。
+ */
+struct PackedInetAddress {
+  // IPv4 地址占前 4 字节，其余为 0
+  uint8_t addr[16];
+  // 网络字节序
+  uint16_t port;
+  // AF_INET、AF_INET6 或 AF_UNSPEC
+  uint8_t family;
+  uint8_t reserved;
+};
+
+static_assert(sizeof(PackedInetAddress) == 20, "PackedInetAddress size");
+
 class InetAddress {
   enum Family { kIpv4, kIpv6 };
 
@@ -25,6 +41,11 @@ class InetAddress {
   InetAddress(const std::string& addr, uint16_t port, Family family = kIpv4);
   explicit InetAddress(const struct sockaddr_in& addr) : addr4_(addr) {}
   explicit InetAddress(const struct sockaddr_in6& addr) : addr6_(addr) {}
+  explicit InetAddress(const struct sockaddr_un& addr) : addr_un_(addr) {}
+  explicit InetAddress(const PackedInetAddress& packed);
+
+  // FormatTo() 的 buf 至少需要的字节数，最长的是 '@' 开头的抽象 Unix 地址
+  static const size_t kTextSize = 110;
 
   const struct sockaddr* GetSockAddr() const {
     return reinterpret_cast<const struct sockaddr*>(&addr6_);
@@ -34,14 +55,58 @@ class InetAddress {
 
   void set_addr4(const struct sockaddr_in& addr) { addr4_ = addr; }
   void set_addr6(const struct sockaddr_in6& addr) { addr6_ = addr; }
+  // sun_path 不要求以 NUL 结尾，首字节为 NUL 表示抽象命名空间
+  void set_addr_un(const struct sockaddr_un& addr) { addr_un_ = addr; }
+  // 未指定地址（AF_UNSPEC），如 LOCAL 命令或 UNKNOWN 协议族
+  void set_unspec();
+
+  std::string ToAddr() const;
+  uint16_t ToPort() const;
+  std::string ToAddrPort() const;
+
+  /**
+   * @brief 将地址写成文本，不分配内存，文本与 inet_ntop() 的结果相同
+   *
+   * @param buf 至少 kTextSize 字节，写入以 NUL 结尾的文本
+   * @return size_t 文本长度，不含 NUL，未指定地址时为 0
+   */
+  size_t FormatAddrTo(char* buf) const;
+  // 同 FormatAddrTo()，IP 地址后加上 ":port"
+  size_t FormatTo(char* buf) const;
 
-  std::string ToAddr();
-  uint16_t ToPort();
-  std::string ToAddrPort();
+  /**
+   * @brief 协议族、地址与端口的哈希，IPv6 还包括 scope id，与 operator== 一致
+   */
+  uint64_t Hash() const;
+
+  bool operator==(const InetAddress& other) const;
+  bool operator!=(const InetAddress& other) const { return !(*this == other); }
+
+  /**
+   * @brief 转为紧凑形式
+   *
+   * @return bool Unix 地址返回 false
+   */
+  bool Pack(PackedInetAddress* packed) const;
 
  private:
   union {
     struct sockaddr_in addr4_;
     struct sockaddr_in6 addr6_;
+    struct sockaddr_un addr_un_;
   };
 };
+
+struct InetAddressHash {
+  size_t operator()(const InetAddress& addr) const {
+    return static_cast<size_t>(addr.Hash());
+  }
+};
+
+// 以下函数在 p 处写入文本（不含 NUL），返回文本的结尾
+char* FormatU16(uint16_t v, char* p);
+char* FormatIpv4(const struct in_addr& addr, char* p);
+/* RFC 5952 形式，最长 45 字节。dotted_tail 为 true 时与 inet_ntop() 相同，
+ * IPv4 映射与兼容地址的末尾写成点分十进制。
+ */
+char* FormatIpv6(const struct in6_addr& addr, char* p, bool dotted_tail);
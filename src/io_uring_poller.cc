@@ -0,0 +1,656 @@
+/**
+ * @file io_uring_poller.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-22
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "poller.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// multishot recv is the newest feature used, the headers of older kernels
+// lack it and build the epoll backend only
+#ifdef IORING_RECV_MULTISHOT
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const unsigned kSqEntries = 256;
+const unsigned kCqEntries = 4096;
+// provided buffers of multishot recv, one holds a v1 line or a v2 header
+// with a few TLVs
+const unsigned kBufEntries = 512;
+const unsigned kBufSize = 2048;
+const uint16_t kBufGroup = 0;
+
+// the top two bits of user_data, then 30 bits of generation and the fd
+const uint64_t kOpPoll = 0;
+const uint64_t kOpAccept = 1;
+const uint64_t kOpRecv = 2;
+// cancellations and poll updates, their completions are dropped
+const uint64_t kOpInternal = 3;
+const uint32_t kGenMask = 0x3fffffff;
+
+uint64_t MakeUserData(uint64_t op, uint32_t gen, int fd) {
+  return op << 62 | static_cast<uint64_t>(gen & kGenMask) << 32 |
+         static_cast<uint32_t>(fd);
+}
+
+int SysSetup(unsigned entries, struct io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int SysEnter(int ring_fd, unsigned to_submit, unsigned min_complete,
+             unsigned flags, const void* arg, size_t argsz) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                  min_complete, flags, arg, argsz));
+}
+
+int SysRegister(int ring_fd, unsigned opcode, const void* arg,
+                unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+class UringPoller : public Poller {
+  struct FdState {
+    uint64_t data;
+    uint32_t gen;
+    int interest;
+    bool registered;
+    // requests in flight
+    bool poll_armed;
+    bool accept_armed;
+    bool recv_armed;
+    // multishot requests wanted, re-armed whenever the kernel ends them
+    bool accepting;
+    bool receiving;
+    // in rearm_
+    bool queued;
+  };
+
+  struct Cancel {
+    uint8_t opcode;
+    uint64_t target;
+  };
+
+ public:
+  UringPoller();
+  ~UringPoller() override;
+
+  int Init();
+
+  const char* name() const override { return "io_uring"; }
+
+  int Add(int fd, int events, uint64_t data) override;
+  int Modify(int fd, int events, uint64_t data) override;
+  int Remove(int fd) override;
+
+  bool SupportsMultishot() const override { return true; }
+  int AcceptMultishot(int fd, uint64_t data) override;
+  int RecvMultishot(int fd, uint64_t data) override;
+
+  int Wait(PollerEvent* events, int max, int timeout) override;
+
+ private:
+  int Probe();
+  FdState* Register(int fd, uint64_t data);
+  FdState* Find(int fd);
+  void QueueArm(int fd, FdState* st);
+  bool ArmFd(int fd, FdState* st);
+  void ArmQueued();
+  struct io_uring_sqe* GetSqe();
+  bool SubmitCancel(const Cancel& cancel);
+  void PrepCancel(uint8_t opcode, uint64_t target);
+  void RecycleBuffers();
+  bool Translate(const struct io_uring_cqe* cqe, PollerEvent* ev);
+
+  int ring_fd_;
+  void* ring_;
+  size_t ring_size_;
+  struct io_uring_sqe* sqes_;
+  size_t sqes_size_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  struct io_uring_cqe* cqes_;
+
+  struct io_uring_buf_ring* buf_ring_;
+  char* bufs_;
+  uint16_t buf_tail_;
+  // handed out by the last Wait(), back to the kernel at the next one
+  std::vector<uint16_t> used_bufs_;
+
+  // indexed by fd
+  std::vector<FdState> fds_;
+  // fds whose requests are (re)submitted at the next Wait()
+  std::vector<int> rearm_;
+  // cancels that found the submission queue full, retried at the next Wait()
+  std::vector<Cancel> cancels_;
+};
+
+UringPoller::UringPoller()
+    : ring_fd_(-1),
+      ring_(MAP_FAILED),
+      ring_size_(0),
+      sqes_(static_cast<struct io_uring_sqe*>(MAP_FAILED)),
+      sqes_size_(0),
+      sq_head_(nullptr),
+      sq_tail_(nullptr),
+      sq_mask_(0),
+      sq_entries_(0),
+      cq_head_(nullptr),
+      cq_tail_(nullptr),
+      cq_mask_(0),
+      cqes_(nullptr),
+      buf_ring_(static_cast<struct io_uring_buf_ring*>(MAP_FAILED)),
+      bufs_(static_cast<char*>(MAP_FAILED)),
+      buf_tail_(0) {}
+
+UringPoller::~UringPoller() {
+  // closing the ring cancels whatever is still in flight
+  if (ring_fd_ != -1) close(ring_fd_);
+  if (ring_ != MAP_FAILED) munmap(ring_, ring_size_);
+  if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+  if (buf_ring_ != MAP_FAILED) {
+    munmap(buf_ring_, kBufEntries * sizeof(struct io_uring_buf));
+  }
+  if (bufs_ != MAP_FAILED) munmap(bufs_, kBufEntries * kBufSize);
+}
+
+int UringPoller::Init() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                 IORING_SETUP_COOP_TASKRUN;
+  params.cq_entries = kCqEntries;
+  ring_fd_ = SysSetup(kSqEntries, &params);
+  if (ring_fd_ < 0 && errno == EINVAL) {
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = kCqEntries;
+    ring_fd_ = SysSetup(kSqEntries, &params);
+  }
+  if (ring_fd_ < 0) {
+    ring_fd_ = -1;
+    return -errno;
+  }
+
+  const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                            IORING_FEAT_EXT_ARG;
+  if ((params.features & required) != required) {
+    return -ENOTSUP;
+  }
+
+  // one mapping for both rings with IORING_FEAT_SINGLE_MMAP
+  ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > ring_size_) ring_size_ = cq_size;
+  ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (ring_ == MAP_FAILED) {
+    return -errno;
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return -errno;
+  }
+  sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+  char* base = static_cast<char*>(ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+  // slot i of the array always names sqe i, only the tail moves
+  unsigned* array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; ++i) {
+    array[i] = i;
+  }
+
+  void* ring = mmap(nullptr, kBufEntries * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    return -errno;
+  }
+  buf_ring_ = static_cast<struct io_uring_buf_ring*>(ring);
+  void* bufs = mmap(nullptr, kBufEntries * kBufSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs == MAP_FAILED) {
+    return -errno;
+  }
+  bufs_ = static_cast<char*>(bufs);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+  reg.ring_entries = kBufEntries;
+  reg.bgid = kBufGroup;
+  if (SysRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    return -errno;
+  }
+  for (unsigned i = 0; i < kBufEntries; ++i) {
+    used_bufs_.push_back(static_cast<uint16_t>(i));
+  }
+  RecycleBuffers();
+
+  return Probe();
+}
+
+/* The opcodes exist since 5.6 but their multishot flags much later, and an
+ * unsupported flag only shows up as -EINVAL in the completion. Runs one
+ * multishot accept and recv over loopback before the poller is used.
+ */
+int UringPoller::Probe() {
+  int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int cfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int afd = -1;
+  int err = -ENOTSUP;
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (lfd != -1 && cfd != -1 &&
+      bind(lfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ==
+          0 &&
+      listen(lfd, 1) == 0 &&
+      getsockname(lfd, reinterpret_cast<struct sockaddr*>(&addr), &addrlen) ==
+          0 &&
+      AcceptMultishot(lfd, 0) == 0) {
+    connect(cfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    PollerEvent events[4];
+    for (int round = 0; round < 10 && err != 0; ++round) {
+      int n = Wait(events, 4, 100);
+      for (int i = 0; i < n; ++i) {
+        if (events[i].type == POLLER_ACCEPT && events[i].res >= 0 &&
+            afd == -1) {
+          afd = events[i].res;
+          RecvMultishot(afd, 1);
+          send(cfd, "x", 1, MSG_NOSIGNAL);
+        } else if (events[i].type == POLLER_RECV && events[i].res == 1) {
+          err = 0;
+        } else if (events[i].res < 0) {
+          round = 10;
+        }
+      }
+    }
+  }
+
+  for (int fd : {afd, cfd, lfd}) {
+    if (fd != -1) {
+      Remove(fd);
+      close(fd);
+    }
+  }
+  return err;
+}
+
+UringPoller::FdState* UringPoller::Register(int fd, uint64_t data) {
+  if (fd < 0) return nullptr;
+  if (static_cast<size_t>(fd) >= fds_.size()) {
+    FdState empty;
+    memset(&empty, 0, sizeof(empty));
+    fds_.resize(fd + 1, empty);
+  }
+  FdState* st = &fds_[fd];
+  if (st->registered) return nullptr;
+  // completions of an earlier user of the fd carry the old generation
+  uint32_t gen = st->gen + 1;
+  bool queued = st->queued;
+  memset(st, 0, sizeof(*st));
+  st->gen = gen;
+  st->queued = queued;
+  st->data = data;
+  st->registered = true;
+  return st;
+}
+
+UringPoller::FdState* UringPoller::Find(int fd) {
+  if (fd < 0 || static_cast<size_t>(fd) >= fds_.size()) return nullptr;
+  FdState* st = &fds_[fd];
+  return st->registered ? st : nullptr;
+}
+
+void UringPoller::QueueArm(int fd, FdState* st) {
+  if (!st->queued) {
+    st->queued = true;
+    rearm_.push_back(fd);
+  }
+}
+
+int UringPoller::Add(int fd, int events, uint64_t data) {
+  FdState* st = Register(fd, data);
+  if (st == nullptr) return fd < 0 ? -EBADF : -EEXIST;
+  st->interest = events;
+  if (events != 0) QueueArm(fd, st);
+  return 0;
+}
+
+int UringPoller::Modify(int fd, int events, uint64_t data) {
+  FdState* st = Find(fd);
+  if (st == nullptr) return -ENOENT;
+  st->data = data;
+  if (events == st->interest) return 0;
+  st->interest = events;
+
+  if (!st->poll_armed) {
+    if (events != 0) QueueArm(fd, st);
+    return 0;
+  }
+  // the request stays in flight, its completion re-arms with the interest
+  // of that time if the update lost the race against it
+  uint64_t target = MakeUserData(kOpPoll, st->gen, fd);
+  if (events == 0) {
+    PrepCancel(IORING_OP_POLL_REMOVE, target);
+    return 0;
+  }
+  struct io_uring_sqe* sqe = GetSqe();
+  if (sqe == nullptr) return -EBUSY;
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->len = IORING_POLL_UPDATE_EVENTS;
+  sqe->poll32_events = static_cast<uint32_t>(events);
+  sqe->user_data = MakeUserData(kOpInternal, 0, 0);
+  return 0;
+}
+
+int UringPoller::Remove(int fd) {
+  FdState* st = Find(fd);
+  if (st == nullptr) return -ENOENT;
+  if (st->poll_armed) {
+    PrepCancel(IORING_OP_POLL_REMOVE, MakeUserData(kOpPoll, st->gen, fd));
+  }
+  if (st->accept_armed) {
+    PrepCancel(IORING_OP_ASYNC_CANCEL, MakeUserData(kOpAccept, st->gen, fd));
+  }
+  if (st->recv_armed) {
+    PrepCancel(IORING_OP_ASYNC_CANCEL, MakeUserData(kOpRecv, st->gen, fd));
+  }
+  st->registered = false;
+  st->interest = 0;
+  st->accepting = st->receiving = false;
+  st->poll_armed = st->accept_armed = st->recv_armed = false;
+  return 0;
+}
+
+int UringPoller::AcceptMultishot(int fd, uint64_t data) {
+  FdState* st = Find(fd);
+  if (st != nullptr && !st->accepting && !st->receiving && st->interest == 0) {
+    // a listening socket whose accept was ended by an error
+    st->data = data;
+  } else {
+    st = Register(fd, data);
+    if (st == nullptr) return fd < 0 ? -EBADF : -EEXIST;
+  }
+  st->accepting = true;
+  QueueArm(fd, st);
+  return 0;
+}
+
+int UringPoller::RecvMultishot(int fd, uint64_t data) {
+  FdState* st = Register(fd, data);
+  if (st == nullptr) return fd < 0 ? -EBADF : -EEXIST;
+  st->receiving = true;
+  QueueArm(fd, st);
+  return 0;
+}
+
+struct io_uring_sqe* UringPoller::GetSqe() {
+  unsigned tail = *sq_tail_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+    // full, hand the batch to the kernel early
+    if (SysEnter(ring_fd_, sq_entries_, 0, 0, nullptr, 0) <= 0) {
+      return nullptr;
+    }
+  }
+  struct io_uring_sqe* sqe = &sqes_[tail & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  // published right away, the kernel only reads the tail in io_uring_enter
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+bool UringPoller::SubmitCancel(const Cancel& cancel) {
+  struct io_uring_sqe* sqe = GetSqe();
+  if (sqe == nullptr) return false;
+  sqe->opcode = cancel.opcode;
+  sqe->fd = -1;
+  sqe->addr = cancel.target;
+  sqe->user_data = MakeUserData(kOpInternal, 0, 0);
+  return true;
+}
+
+void UringPoller::PrepCancel(uint8_t opcode, uint64_t target) {
+  Cancel cancel = {opcode, target};
+  // behind the ones already waiting, they were asked for first
+  if (!cancels_.empty() || !SubmitCancel(cancel)) {
+    cancels_.push_back(cancel);
+  }
+}
+
+/* Submits the requests st wants and has not in flight. Each one is marked
+ * armed as soon as it is queued, so a call cut short by a full submission
+ * queue resumes where it stopped.
+ */
+bool UringPoller::ArmFd(int fd, FdState* st) {
+  if (st->interest != 0 && !st->poll_armed) {
+    // one-shot and armed again after each completion, which keeps the
+    // level-triggered semantics of epoll
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = static_cast<uint32_t>(st->interest);
+    sqe->user_data = MakeUserData(kOpPoll, st->gen, fd);
+    st->poll_armed = true;
+  }
+  if (st->accepting && !st->accept_armed) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = MakeUserData(kOpAccept, st->gen, fd);
+    st->accept_armed = true;
+  }
+  if (st->receiving && !st->recv_armed) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufGroup;
+    sqe->user_data = MakeUserData(kOpRecv, st->gen, fd);
+    st->recv_armed = true;
+  }
+  return true;
+}
+
+void UringPoller::ArmQueued() {
+  size_t done = 0;
+  while (done < cancels_.size() && SubmitCancel(cancels_[done])) {
+    ++done;
+  }
+  cancels_.erase(cancels_.begin(), cancels_.begin() + done);
+
+  // whatever does not fit stays queued, the completions this Wait() reaps
+  // make room for it at the next one
+  done = 0;
+  for (; done < rearm_.size(); ++done) {
+    int fd = rearm_[done];
+    FdState* st = &fds_[fd];
+    if (st->registered && !ArmFd(fd, st)) break;
+    st->queued = false;
+  }
+  rearm_.erase(rearm_.begin(), rearm_.begin() + done);
+}
+
+void UringPoller::RecycleBuffers() {
+  if (used_bufs_.empty()) return;
+  const unsigned mask = kBufEntries - 1;
+  // bufs of the header is preceded by an empty struct in C++ and sits 8
+  // bytes off, the entries are indexed from the start of the ring instead
+  struct io_uring_buf* entries =
+      reinterpret_cast<struct io_uring_buf*>(buf_ring_);
+  for (uint16_t bid : used_bufs_) {
+    // field by field, the tail overlays resv of the first entry
+    struct io_uring_buf* buf = &entries[buf_tail_ & mask];
+    buf->addr = reinterpret_cast<uint64_t>(bufs_ + bid * kBufSize);
+    buf->len = kBufSize;
+    buf->bid = bid;
+    ++buf_tail_;
+  }
+  __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+  used_bufs_.clear();
+}
+
+bool UringPoller::Translate(const struct io_uring_cqe* cqe, PollerEvent* ev) {
+  uint64_t op = cqe->user_data >> 62;
+  uint32_t gen = static_cast<uint32_t>(cqe->user_data >> 32) & kGenMask;
+  int fd = static_cast<int>(static_cast<uint32_t>(cqe->user_data));
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  const char* buf = nullptr;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    buf = bufs_ + bid * kBufSize;
+    used_bufs_.push_back(bid);
+  }
+  if (op == kOpInternal) return false;
+
+  // stale completions of a removed fd, or of a request cancelled for it
+  FdState* st = Find(fd);
+  if (st == nullptr || (st->gen & kGenMask) != gen) return false;
+
+  ev->data = st->data;
+  ev->res = cqe->res;
+  ev->buf = nullptr;
+  switch (op) {
+    case kOpPoll:
+      st->poll_armed = false;
+      if (st->interest != 0) QueueArm(fd, st);
+      if (cqe->res < 0) return false;
+      // readiness of a mask the fd no longer asks for is not reported
+      ev->res = cqe->res & (st->interest | POLLERR | POLLHUP | POLLNVAL);
+      ev->type = POLLER_READY;
+      return ev->res != 0;
+    case kOpAccept:
+      if (!more) st->accept_armed = false;
+      if (cqe->res < 0 && cqe->res != -ECONNABORTED && cqe->res != -EINTR &&
+          cqe->res != -EAGAIN && cqe->res != -ECANCELED) {
+        // EMFILE and the like fail again right away, the accept stays off
+        // until the owner calls AcceptMultishot() after a pause
+        st->accepting = false;
+        if (more) PrepCancel(IORING_OP_ASYNC_CANCEL, cqe->user_data);
+      }
+      if (!more && st->accepting) QueueArm(fd, st);
+      // only the cancel above ends an accept this way
+      if (cqe->res == -ECANCELED) return false;
+      ev->type = POLLER_ACCEPT;
+      return true;
+    default:
+      if (!more) {
+        st->recv_armed = false;
+        // out of buffers, or ended for a reason of the kernel's own with
+        // the connection still open
+        if (cqe->res == -ENOBUFS || cqe->res > 0) QueueArm(fd, st);
+      }
+      if (cqe->res == -ENOBUFS) return false;
+      ev->type = POLLER_RECV;
+      ev->buf = buf;
+      return true;
+  }
+}
+
+int UringPoller::Wait(PollerEvent* events, int max, int timeout) {
+  RecycleBuffers();
+  ArmQueued();
+
+  unsigned pending = *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  bool ready = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) != *cq_head_;
+  // entering with nothing to submit still runs deferred completion work
+  if (pending > 0 || !ready) {
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    unsigned min_complete = !ready && timeout != 0 ? 1 : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    const void* argp = nullptr;
+    size_t argsz = 0;
+    if (min_complete > 0 && timeout > 0) {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000LL;
+      memset(&arg, 0, sizeof(arg));
+      arg.sigmask_sz = _NSIG / 8;
+      arg.ts = reinterpret_cast<uint64_t>(&ts);
+      flags |= IORING_ENTER_EXT_ARG;
+      argp = &arg;
+      argsz = sizeof(arg);
+    }
+    int ret = SysEnter(ring_fd_, pending, min_complete, flags, argp, argsz);
+    if (ret < 0 && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+      return -errno;
+    }
+  }
+
+  int n = 0;
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  while (head != tail && n < max) {
+    if (Translate(&cqes_[head & cq_mask_], &events[n])) {
+      ++n;
+    }
+    ++head;
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+}  // namespace
+
+std::unique_ptr<Poller> CreateUringPoller() {
+  std::unique_ptr<UringPoller> poller(new UringPoller);
+  if (poller->Init() != 0) {
+    return nullptr;
+  }
+  return std::unique_ptr<Poller>(poller.release());
+}
+
+#else
+
+std::unique_ptr<Poller> CreateUringPoller() { return nullptr; }
+
+#endif
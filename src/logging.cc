@@ -13,18 +13,39 @@
 
 #include <sys/types.h>
 #ifndef WIN32
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "binlog.h"
+#include "inet_address.h"
 
 static int g_log_level = LOG_LEVEL_INFO;
 
 static const char* g_log_level_string[] = {"D", "I", "W", "E"};
 
+// longer lines are truncated
+static const size_t kMaxLineSize = 1024;
+
+static FILE* g_log_file = stdout;
+
 #ifndef NDEBUG
 static const char* GetBasename(const char* path) {
   char* p1 = strrchr(const_cast<char*>(path), '/');
@@ -33,41 +54,486 @@ static const char* GetBasename(const char* path) {
 }
 #endif
 
+/* "%Y-%m-%d %H:%M:%S" of the current second, formatted again only when the
+ * second changes.
+ */
+static const char* GetTimeString() {
+  static thread_local time_t cached_sec = -1;
+  static thread_local char cached_buf[32];
+
+  time_t now = time(nullptr);
+  if (now != cached_sec) {
+    struct tm now_tm;
+#ifdef WIN32
+    memset(&now_tm, 0, sizeof(now_tm));
+    (void)localtime_s(&now_tm, &now);
+#else
+    localtime_r(&now, &now_tm);
+#endif
+    strftime(cached_buf, sizeof(cached_buf), "%Y-%m-%d %H:%M:%S", &now_tm);
+    cached_sec = now;
+  }
+  return cached_buf;
+}
+
+/* Asynchronous mode, every logging thread owns a single-producer
+ * single-consumer ring of fixed size slots, one line per slot. The writer
+ * thread hands the filled slots of all rings to writev() straight from the
+ * ring memory and only then releases them.
+ */
+namespace {
+
+const size_t kRingSlots = 256;
+
+struct LogSlot {
+  uint32_t len;
+  char data[kMaxLineSize];
+};
+
+struct LogRing {
+  // written by the producer, read by the writer thread
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> dropped;
+  // keeps the two sides on different cache lines, plain new does not honor
+  // alignas() before C++17
+  char padding[64];
+  // written by the writer thread
+  std::atomic<uint64_t> tail;
+  LogSlot slots[kRingSlots];
+
+  LogRing() : head(0), dropped(0), tail(0) {}
+};
+
+struct AsyncLogger {
+  std::atomic<bool> running{false};
+  int policy = LOG_FULL_DROP;
+  int fd = -1;
+  std::thread thread;
+  // guards rings and wakes the writer thread
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::vector<std::unique_ptr<LogRing>> rings;
+  // dropped lines already reported by the writer thread
+  uint64_t reported_dropped = 0;
+};
+
+AsyncLogger g_async;
+thread_local LogRing* t_ring = nullptr;
+
+}  // namespace
+
+// flushes the writer thread's batch at most this often when nothing fills
+// half a ring
+static const std::chrono::milliseconds kLogFlushInterval(10);
+
+static LogRing* GetRing() {
+  if (t_ring == nullptr) {
+    std::unique_ptr<LogRing> ring(new LogRing());
+    t_ring = ring.get();
+    std::lock_guard<std::mutex> lock(g_async.mutex);
+    g_async.rings.push_back(std::move(ring));
+  }
+  return t_ring;
+}
+
+static bool WriteAll(int fd, struct iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+/* Writes out whatever the rings hold, returns the number of lines. */
+static size_t DrainRings() {
+  struct iovec iov[IOV_MAX];
+  std::vector<LogRing*> rings;
+  {
+    std::lock_guard<std::mutex> lock(g_async.mutex);
+    for (auto& ring : g_async.rings) rings.push_back(ring.get());
+  }
+
+  size_t lines = 0;
+  uint64_t dropped = 0;
+  for (LogRing* ring : rings) {
+    dropped += ring->dropped.load(std::memory_order_relaxed);
+
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    while (tail != head) {
+      int iovcnt = 0;
+      uint64_t end = tail;
+      while (end != head && iovcnt < IOV_MAX) {
+        LogSlot& slot = ring->slots[end % kRingSlots];
+        iov[iovcnt].iov_base = slot.data;
+        iov[iovcnt].iov_len = slot.len;
+        ++iovcnt;
+        ++end;
+      }
+      // nowhere to report a failed write, the lines are discarded
+      WriteAll(g_async.fd, iov, iovcnt);
+      lines += end - tail;
+      tail = end;
+      ring->tail.store(tail, std::memory_order_release);
+    }
+  }
+
+  if (dropped != g_async.reported_dropped) {
+    char line[128];
+    int n = snprintf(line, sizeof(line),
+                     "%s [W] %llu log lines dropped, %llu in total\n",
+                     GetTimeString(),
+                     static_cast<unsigned long long>(
+                         dropped - g_async.reported_dropped),
+                     static_cast<unsigned long long>(dropped));
+    struct iovec v = {line, static_cast<size_t>(n)};
+    WriteAll(g_async.fd, &v, 1);
+    g_async.reported_dropped = dropped;
+  }
+  return lines;
+}
+
+static void RunLogWriter() {
+  while (g_async.running.load(std::memory_order_acquire)) {
+    if (DrainRings() == 0) {
+      std::unique_lock<std::mutex> lock(g_async.mutex);
+      g_async.cond.wait_for(lock, kLogFlushInterval);
+    }
+  }
+  DrainRings();
+}
+
+/* Copies a formatted line into the caller's ring. */
+static void PushLine(const char* line, size_t len) {
+  LogRing* ring = GetRing();
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t tail = ring->tail.load(std::memory_order_acquire);
+  while (head - tail == kRingSlots) {
+    if (g_async.policy == LOG_FULL_DROP) {
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      g_async.cond.notify_one();
+      return;
+    }
+    // LOG_FULL_BLOCK
+    g_async.cond.notify_one();
+    std::this_thread::yield();
+    tail = ring->tail.load(std::memory_order_acquire);
+  }
+
+  LogSlot& slot = ring->slots[head % kRingSlots];
+  memcpy(slot.data, line, len);
+  slot.len = static_cast<uint32_t>(len);
+  ring->head.store(head + 1, std::memory_order_release);
+
+  // the writer thread polls every kLogFlushInterval, a half full ring wakes
+  // it early
+  if (head + 1 - tail == kRingSlots / 2) {
+    g_async.cond.notify_one();
+  }
+}
+
+/* Binary mode, records are appended to a sparse file mapped in full. A
+ * writer reserves its bytes with a compare-and-swap on the file offset,
+ * fills them in place and publishes the record by storing its size last.
+ */
+namespace {
+
+// sparse, only written pages take up disk space
+const size_t kBinaryLogSize = 256 << 20;
+// kept at the end of the file for site records, ordinary records filling
+// the file cannot crowd out a site that registers late, which logcat needs
+// to render any line of it. At a few hundred bytes a site it holds far more
+// sites than the program has.
+const size_t kSiteReserve = 256 << 10;
+
+struct BinaryLogger {
+  std::atomic<bool> enabled{false};
+  int fd = -1;
+  char* base = nullptr;
+  std::atomic<uint64_t> offset{0};
+  std::atomic<uint64_t> dropped{0};
+  // guards sites, so that each site record is written exactly once
+  std::mutex mutex;
+  std::vector<std::unique_ptr<LogSite>> sites;
+};
+
+BinaryLogger g_binary;
+
+}  // namespace
+
+static uint64_t GetRealTimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* Reserves a record of size payload bytes and fills its header except for
+ * the size, returns the payload or nullptr once the file is full. Only
+ * site records go into the last kSiteReserve bytes. A failed reservation
+ * leaves the offset as it is, the records stay contiguous.
+ */
+static char* ReserveRecord(uint32_t site, size_t size) {
+  size_t total = (sizeof(BinLogRecord) + size + 7) & ~static_cast<size_t>(7);
+  uint64_t limit = site & kBinLogSiteFlag ? kBinaryLogSize
+                                          : kBinaryLogSize - kSiteReserve;
+  uint64_t off = g_binary.offset.load(std::memory_order_relaxed);
+  do {
+    if (off + total > limit) {
+      g_binary.dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+  } while (!g_binary.offset.compare_exchange_weak(off, off + total,
+                                                  std::memory_order_relaxed));
+
+  BinLogRecord* rec = reinterpret_cast<BinLogRecord*>(g_binary.base + off);
+  rec->site = site;
+  rec->time = GetRealTimeNs();
+  return g_binary.base + off + sizeof(BinLogRecord);
+}
+
+static void CommitRecord(char* payload, size_t size) {
+  BinLogRecord* rec =
+      reinterpret_cast<BinLogRecord*>(payload - sizeof(BinLogRecord));
+  uint32_t total = static_cast<uint32_t>((sizeof(BinLogRecord) + size + 7) &
+                                         ~static_cast<size_t>(7));
+  __atomic_store_n(&rec->size, total, __ATOMIC_RELEASE);
+}
+
+static void WriteSiteRecord(const LogSite* site) {
+  size_t file_len = strlen(site->file) + 1;
+  size_t func_len = strlen(site->func) + 1;
+  size_t fmt_len = strlen(site->fmt) + 1;
+  size_t size = 1 + 4 + file_len + func_len + fmt_len;
+  char* p = ReserveRecord(kBinLogSiteFlag | site->id, size);
+  if (p == nullptr) return;
+
+  char* begin = p;
+  uint32_t line = static_cast<uint32_t>(site->line);
+  *p++ = static_cast<char>(site->level);
+  memcpy(p, &line, 4);
+  p += 4;
+  memcpy(p, site->file, file_len);
+  p += file_len;
+  memcpy(p, site->func, func_len);
+  p += func_len;
+  memcpy(p, site->fmt, fmt_len);
+  CommitRecord(begin, size);
+}
+
+const LogSite* RegisterLogSite(int lv, const char* file, int line,
+                               const char* func, const char* fmt) {
+  std::unique_ptr<LogSite> site(new LogSite);
+  site->level = lv;
+  site->file = file;
+  site->line = line;
+  site->func = func;
+  site->fmt = fmt;
+
+  std::lock_guard<std::mutex> lock(g_binary.mutex);
+  site->id = static_cast<uint32_t>(g_binary.sites.size());
+  if (g_binary.enabled.load(std::memory_order_relaxed)) {
+    WriteSiteRecord(site.get());
+  }
+  g_binary.sites.push_back(std::move(site));
+  return g_binary.sites.back().get();
+}
+
+int GetLogLevel() { return g_log_level; }
+
+bool BinaryLogEnabled() {
+  return g_binary.enabled.load(std::memory_order_relaxed);
+}
+
+char* BeginBinaryLog(const LogSite* site, size_t size) {
+  return ReserveRecord(site->id, size);
+}
+
+void EndBinaryLog(char* args, size_t size) { CommitRecord(args, size); }
+
+static_assert(sizeof(LogAddrText::buf) >= InetAddress::kTextSize,
+              "LogAddrText too small");
+
+const char* LogTextArg(const InetAddress& addr, LogAddrText&& text) {
+  addr.FormatTo(text.buf);
+  return text.buf;
+}
+
+size_t LogArgSize(const char* str) {
+  return 1 + 2 + std::min(strlen(str), static_cast<size_t>(UINT16_MAX));
+}
+
+char* LogArgPut(char* p, const char* str) {
+  uint16_t len = static_cast<uint16_t>(
+      std::min(strlen(str), static_cast<size_t>(UINT16_MAX)));
+  *p = BINLOG_ARG_STRING;
+  memcpy(p + 1, &len, 2);
+  memcpy(p + 3, str, len);
+  return p + 3 + len;
+}
+
+/* IP addresses are kept raw, anything else is logged as its text. */
+size_t LogArgSize(const InetAddress& addr) {
+  if (addr.family() == AF_INET) return 1 + 4 + 2;
+  if (addr.family() == AF_INET6) return 1 + 16 + 2;
+  LogAddrText text;
+  return LogArgSize(LogTextArg(addr, std::move(text)));
+}
+
+char* LogArgPut(char* p, const InetAddress& addr) {
+  if (addr.family() == AF_INET) {
+    const struct sockaddr_in* in =
+        reinterpret_cast<const struct sockaddr_in*>(addr.GetSockAddr());
+    *p = BINLOG_ARG_IPV4;
+    memcpy(p + 1, &in->sin_addr, 4);
+    memcpy(p + 5, &in->sin_port, 2);
+    return p + 7;
+  }
+  if (addr.family() == AF_INET6) {
+    const struct sockaddr_in6* in6 =
+        reinterpret_cast<const struct sockaddr_in6*>(addr.GetSockAddr());
+    *p = BINLOG_ARG_IPV6;
+    memcpy(p + 1, &in6->sin6_addr, 16);
+    memcpy(p + 17, &in6->sin6_port, 2);
+    return p + 19;
+  }
+  LogAddrText text;
+  return LogArgPut(p, LogTextArg(addr, std::move(text)));
+}
+
+int StartBinaryLog(const char* path) {
+  if (g_binary.enabled) return -1;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) return -2;
+
+  void* base = MAP_FAILED;
+  if (ftruncate(fd, kBinaryLogSize) == 0) {
+    base = mmap(nullptr, kBinaryLogSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+  }
+  if (base == MAP_FAILED) {
+    close(fd);
+    return -3;
+  }
+
+  g_binary.fd = fd;
+  g_binary.base = static_cast<char*>(base);
+  memcpy(g_binary.base, kBinLogMagic, sizeof(kBinLogMagic));
+  g_binary.offset = kBinLogHeaderSize;
+
+  // sites registered so far are described up front, later ones as they
+  // register
+  fflush(g_log_file);
+  std::lock_guard<std::mutex> lock(g_binary.mutex);
+  for (auto& site : g_binary.sites) {
+    WriteSiteRecord(site.get());
+  }
+  g_binary.enabled = true;
+  return 0;
+}
+
+void StopBinaryLog() {
+  if (!g_binary.enabled) return;
+
+  g_binary.enabled = false;
+  uint64_t used = std::min(g_binary.offset.load(),
+                           static_cast<uint64_t>(kBinaryLogSize));
+  munmap(g_binary.base, kBinaryLogSize);
+  if (ftruncate(g_binary.fd, used) != 0) {
+    // the zero filled tail reads as the end of the log
+  }
+  close(g_binary.fd);
+  g_binary.base = nullptr;
+  g_binary.fd = -1;
+}
+
 void SetLogLevel(int lv) {
   if (lv >= LOG_LEVEL_DEBUG && lv <= LOG_LEVEL_ERROR) {
     g_log_level = lv;
   }
 }
 
+int SetLogFile(const char* path) {
+  FILE* file = fopen(path, "ae");
+  if (file == nullptr) return -1;
+
+  if (g_log_file != stdout) fclose(g_log_file);
+  g_log_file = file;
+  return 0;
+}
+
+int StartAsyncLog(int policy) {
+  if (g_async.running) return -1;
+  if (policy != LOG_FULL_DROP && policy != LOG_FULL_BLOCK) return -2;
+
+  fflush(g_log_file);
+  g_async.policy = policy;
+  g_async.fd = fileno(g_log_file);
+  g_async.running = true;
+  g_async.thread = std::thread(RunLogWriter);
+  return 0;
+}
+
+void StopAsyncLog() {
+  if (!g_async.running) return;
+
+  g_async.running = false;
+  g_async.cond.notify_one();
+  g_async.thread.join();
+}
+
+uint64_t GetDroppedLogLines() {
+  std::lock_guard<std::mutex> lock(g_async.mutex);
+  uint64_t dropped = g_binary.dropped.load(std::memory_order_relaxed);
+  for (auto& ring : g_async.rings) {
+    dropped += ring->dropped.load(std::memory_order_relaxed);
+  }
+  return dropped;
+}
+
 void Log(int lv, const char* file, const int line, const char* func,
          const char* fmt, ...) {
   if (lv < g_log_level) return;
 
-  char timebuf[32];
-  time_t now = time(nullptr);
-#ifdef WIN32
-  struct tm now_tm;
-  memset(&now_tm, 0, sizeof(now_tm));
-  (void)localtime_s(&now_tm, &now);
-  strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &now_tm);
+  const char* level = (lv >= LOG_LEVEL_DEBUG && lv <= LOG_LEVEL_ERROR)
+                          ? g_log_level_string[lv]
+                          : "U";
+
+  // the whole line is formatted first and written at once
+  char buf[kMaxLineSize];
+  size_t cap = sizeof(buf) - 1;  // room for the newline
+#ifdef NDEBUG
+  int n = snprintf(buf, cap, "%s [%s] ", GetTimeString(), level);
 #else
-  strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+  int n = snprintf(buf, cap, "%s [%s:%d:%s] [%s] ", GetTimeString(),
+                   GetBasename(file), line, func, level);
 #endif
+  size_t len = std::min(static_cast<size_t>(n), cap - 1);
 
   va_list va;
   va_start(va, fmt);
-#ifdef NDEBUG
-  fprintf(stdout, "%s [%s] ", timebuf,
-          (lv >= LOG_LEVEL_DEBUG && lv <= LOG_LEVEL_ERROR)
-              ? g_log_level_string[lv]
-              : "U");
-#else
-  fprintf(stdout, "%s [%s:%d:%s] [%s] ", timebuf, GetBasename(file), line, func,
-          (lv >= LOG_LEVEL_DEBUG && lv <= LOG_LEVEL_ERROR)
-              ? g_log_level_string[lv]
-              : "U");
-#endif
-  vfprintf(stdout, fmt, va);
-  fprintf(stdout, "\n");
+  n = vsnprintf(buf + len, cap - len, fmt, va);
   va_end(va);
+  if (n > 0) {
+    len = std::min(len + n, cap - 1);
+  }
+  buf[len++] = '\n';
+
+  if (g_async.running.load(std::memory_order_acquire)) {
+    PushLine(buf, len);
+  } else {
+    fwrite(buf, 1, len, g_log_file);
+  }
 }
@@ -11,6 +11,13 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <string.h>
+
+#include <type_traits>
+
+class InetAddress;
+
 enum LogLevel {
   LOG_LEVEL_DEBUG = 0,
   LOG_LEVEL_INFO,
@@ -18,18 +25,180 @@ enum LogLevel {
   LOG_LEVEL_ERROR,
 };
 
+enum LogFullPolicy {
+  // 丢弃新日志并计数，不阻塞调用线程
+  LOG_FULL_DROP = 0,
+  // 等待后台线程腾出空间
+  LOG_FULL_BLOCK,
+};
+
 void SetLogLevel(int lv);
+
+/**
+ * @brief 将日志追加写入文件，默认为 stdout
+ *
+ * @return int 0 表示成功，-1 表示打开失败
+ */
+int SetLogFile(const char* path);
+
+/**
+ * @brief 切换到异步日志
+ *
+ * 调用线程将整行日志写入自己的无锁环形缓冲区，后台线程批量 writev() 输出。
+ * 缓冲区满时按 policy 丢弃或阻塞，丢弃的行数由后台线程定期输出。
+ *
+ * @param policy LogFullPolicy
+ * @return int 0 表示成功
+ */
+int StartAsyncLog(int policy);
+
+/**
+ * @brief 输出剩余日志并回到同步日志，调用前其他线程应已停止打印日志
+ */
+void StopAsyncLog();
+
+// 异步日志缓冲区满或二进制日志文件写满而丢弃的行数
+uint64_t GetDroppedLogLines();
+
 void Log(int lv, const char* file, const int line, const char* func,
          const char* fmt, ...);
 
-#define LOGD(fmt, ...) \
-  Log(LOG_LEVEL_DEBUG, __FILE__, __LINE__, __FUNCTION__, fmt, ##__VA_ARGS__)
+/**
+ * @brief 切换到二进制日志
+ *
+ * 之后的日志只写入调用点编号、时间戳及原始参数（整数、字符串、IPv4/IPv6 地址
+ * 不做格式化），追加到 mmap 的文件中，由 proxyproto-logcat 离线还原为文本。
+ * 文件写满后的日志计入丢弃行数。
+ *
+ * @return int 0 表示成功，负值表示文件创建或映射失败
+ */
+int StartBinaryLog(const char* path);
+
+/**
+ * @brief 停止二进制日志并截断文件，调用前其他线程应已停止打印日志
+ */
+void StopBinaryLog();
+
+// 每个 LOGx 调用点的静态信息，首次执行时注册并分配编号
+struct LogSite {
+  uint32_t id;
+  int level;
+  const char* file;
+  int line;
+  const char* func;
+  const char* fmt;
+};
+
+const LogSite* RegisterLogSite(int lv, const char* file, int line,
+                               const char* func, const char* fmt);
+int GetLogLevel();
+bool BinaryLogEnabled();
+
+// 返回 size 字节参数区的写入位置，文件已满时返回 nullptr
+char* BeginBinaryLog(const LogSite* site, size_t size);
+void EndBinaryLog(char* args, size_t size);
+
+/* Text mode arguments, InetAddress is rendered by FormatTo() into a buffer
+ * that lives until the end of the Log() call.
+ */
+struct LogAddrText {
+  char buf[128];
+};
+
+const char* LogTextArg(const InetAddress& addr,
+                       LogAddrText&& text = LogAddrText());
+
+template <typename T>
+inline T LogTextArg(T value) {
+  return value;
+}
+
+/* Binary mode arguments, see BinLogArgType in binlog.h. */
+template <typename T>
+inline typename std::enable_if<
+    std::is_arithmetic<T>::value || std::is_enum<T>::value, size_t>::type
+LogArgSize(const T&) {
+  return 1 + 8;
+}
+
+template <typename T>
+inline size_t LogArgSize(const T*) {
+  return 1 + 8;
+}
+
+size_t LogArgSize(const char* str);
+size_t LogArgSize(const InetAddress& addr);
+
+template <typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value, char*>::type
+LogArgPut(char* p, const T& value) {
+  double v = value;
+  *p = 'f';
+  memcpy(p + 1, &v, 8);
+  return p + 9;
+}
+
+template <typename T>
+inline typename std::enable_if<
+    std::is_integral<T>::value || std::is_enum<T>::value, char*>::type
+LogArgPut(char* p, const T& value) {
+  if (std::is_signed<T>::value) {
+    int64_t v = static_cast<int64_t>(value);
+    *p = 'i';
+    memcpy(p + 1, &v, 8);
+  } else {
+    uint64_t v = static_cast<uint64_t>(value);
+    *p = 'u';
+    memcpy(p + 1, &v, 8);
+  }
+  return p + 9;
+}
+
+template <typename T>
+inline char* LogArgPut(char* p, const T* ptr) {
+  uint64_t v = reinterpret_cast<uintptr_t>(ptr);
+  *p = 'p';
+  memcpy(p + 1, &v, 8);
+  return p + 9;
+}
+
+char* LogArgPut(char* p, const char* str);
+char* LogArgPut(char* p, const InetAddress& addr);
+
+template <typename... Args>
+void LogArgs(const LogSite* site, const Args&... args) {
+  if (BinaryLogEnabled()) {
+    // braced lists evaluate their elements in order
+    size_t size = 0;
+    int sizes[] = {0, (size += LogArgSize(args), 0)...};
+    (void)sizes;
+    char* begin = BeginBinaryLog(site, size);
+    if (begin != nullptr) {
+      char* p = begin;
+      int puts[] = {0, (p = LogArgPut(p, args), 0)...};
+      (void)puts;
+      (void)p;
+      EndBinaryLog(begin, size);
+    }
+    return;
+  }
+  Log(site->level, site->file, site->line, site->func, site->fmt,
+      LogTextArg(args)...);
+}
+
+#define LOG_AT(lv, fmt, ...)                                                \
+  do {                                                                      \
+    if ((lv) >= GetLogLevel()) {                                            \
+      static const LogSite* log_site =                                      \
+          RegisterLogSite(lv, __FILE__, __LINE__, __FUNCTION__, fmt);       \
+      LogArgs(log_site, ##__VA_ARGS__);                                     \
+    }                                                                       \
+  } while (0)
+
+#define LOGD(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
 
-#define LOGI(fmt, ...) \
-  Log(LOG_LEVEL_INFO, __FILE__, __LINE__, __FUNCTION__, fmt, ##__VA_ARGS__)
+#define LOGI(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
 
-#define LOGW(fmt, ...) \
-  Log(LOG_LEVEL_WARN, __FILE__, __LINE__, __FUNCTION__, fmt, ##__VA_ARGS__)
+#define LOGW(fmt, ...) LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
 
-#define LOGE(fmt, ...) \
-  Log(LOG_LEVEL_ERROR, __FILE__, __LINE__, __FUNCTION__, fmt, ##__VA_ARGS__)
+#define LOGE(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
@@ -9,16 +9,62 @@
  *
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <cstring>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "conf.h"
+#include "export_ring.h"
 #include "logging.h"
 #include "server.h"
+#include "trusted_proxies.h"
 
-bool g_exit = false;
+std::atomic<bool> g_exit(false);
+std::atomic<bool> g_reload(false);
 void OnSigal(int signum) { g_exit = true; }
+void OnReload(int signum) { g_reload = true; }
+
+static int ReloadTrustedProxies(const Conf& conf) {
+  int line = 0;
+  int err = LoadTrustedProxies(conf.trusted_proxies.c_str(), &line);
+  if (err == -1) {
+    LOGE("open trusted proxies %s failed", conf.trusted_proxies.c_str());
+  } else if (err != 0) {
+    LOGE("trusted proxies %s:%d bad prefix", conf.trusted_proxies.c_str(),
+         line);
+  } else {
+    std::shared_ptr<const PrefixSet> set = GetTrustedProxies();
+    LOGI("trusted proxies %s: %zu prefixes, %zu bytes",
+         conf.trusted_proxies.c_str(), set->size(), set->memory());
+  }
+  return err;
+}
+
+static void RunLoop(Server* server, int timeout) {
+  while (!g_exit) {
+    server->Poll(timeout);
+  }
+}
+
+// the main thread also reloads the trusted proxies on SIGHUP, reactors pick
+// up the new list at their next Poll()
+static void RunMainLoop(Server* server, const Conf& conf) {
+  while (!g_exit) {
+    server->Poll(conf.poll_timeout);
+    if (g_reload.exchange(false) && !conf.trusted_proxies.empty()) {
+      ReloadTrustedProxies(conf);
+    }
+  }
+}
 
 int main(int argc, char** argv) {
   auto conf = std::make_shared<Conf>();
@@ -27,21 +73,123 @@ int main(int argc, char** argv) {
 #else
   conf->log_level = LOG_LEVEL_DEBUG;
 #endif
+  conf->threads = 1;
+  conf->max_header_bytes = 16 + 65535;
+  conf->log_sample = 1;
+  conf->header_timeout = 10000;
+  conf->limit_entries = 16384;
+  conf->export_ring_size = 4096;
+  conf->record_segment_size = 64;
+  conf->record_rotate = 3600;
+  conf->events = 4;
+  conf->max_events = 20;
+  conf->max_conns = 1024;
+  conf->listen_backlog = SOMAXCONN;
+  conf->poll_timeout = 1000;
   if (LoadConf(argc, argv, conf.get()) != 0) {
     ShowHelp(argc, argv);
     return 1;
   }
 
   SetLogLevel(conf->log_level);
+  if (!conf->log_file.empty() && SetLogFile(conf->log_file.c_str()) != 0) {
+    LOGE("open log file %s failed", conf->log_file.c_str());
+    return 1;
+  }
+
+  if (!conf->trusted_proxies.empty() && ReloadTrustedProxies(*conf) != 0) {
+    return 1;
+  }
+
+  if (!conf->export_ring.empty()) {
+    int err = OpenExportRing(conf->export_ring.c_str(), conf->threads,
+                             static_cast<uint32_t>(conf->export_ring_size));
+    if (err != 0) {
+      LOGE("open export ring %s err %s", conf->export_ring.c_str(),
+           strerror(-err));
+      return 1;
+    }
+  }
+
+  if (conf->max_conns == 0) {
+    // the soft limit goes up to the hard one, then is split across reactors
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur < rl.rlim_max) {
+      struct rlimit raised = {rl.rlim_max, rl.rlim_max};
+      if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+        rl = raised;
+      }
+    }
+    conf->max_conns = Server::ConnLimitFromFiles(rl.rlim_cur, *conf);
+    LOGI("max conns %d per reactor from RLIMIT_NOFILE %llu", conf->max_conns,
+         static_cast<unsigned long long>(rl.rlim_cur));
+  }
+
+  // reactors create their segment files as connections come in, a directory
+  // they cannot write to would only show up then
+  if (!conf->record_dir.empty() &&
+      access(conf->record_dir.c_str(), W_OK | X_OK) != 0) {
+    LOGE("record dir %s err %s", conf->record_dir.c_str(), strerror(errno));
+    return 1;
+  }
 
-  auto server = std::make_shared<Server>(conf);
-  if (server->Start() == 0) {
-    LOGI("server start at port %d", conf->listen_port);
-    signal(SIGINT, OnSigal);
-    while (!g_exit) {
-      server->Poll(1000);
+  std::vector<std::unique_ptr<Server>> servers;
+  for (int i = 0; i < conf->threads; ++i) {
+    std::unique_ptr<Server> server(new Server(conf, i));
+    int err = server->Start();
+    if (err != 0) {
+      LOGE("server#%d start err %d", i, err);
+      return 1;
     }
-    LOGI("server stop");
+    servers.push_back(std::move(server));
+  }
+
+  if (!conf->binary_log.empty()) {
+    int err = StartBinaryLog(conf->binary_log.c_str());
+    if (err != 0) {
+      LOGE("open binary log %s err %d", conf->binary_log.c_str(), err);
+      return 1;
+    }
+  } else if (conf->log_async) {
+    StartAsyncLog(conf->log_async == 2 ? LOG_FULL_BLOCK : LOG_FULL_DROP);
+  }
+  LOGI("server start at port %d with %d reactor(s)", conf->listen_port,
+       conf->threads);
+  LOGI("events %d-%d%s, max conns %d per reactor, backlog %d",
+       conf->events, conf->max_events, conf->adaptive ? " adaptive" : "",
+       conf->max_conns, conf->listen_backlog);
+  if (!conf->forward_host.empty()) {
+    LOGI("forward to %s port %d", conf->forward_host.c_str(),
+         conf->forward_port);
+  }
+  signal(SIGINT, OnSigal);
+  signal(SIGHUP, OnReload);
+  // splice() into a socket the peer has reset raises SIGPIPE, there is no
+  // MSG_NOSIGNAL for it
+  signal(SIGPIPE, SIG_IGN);
+
+  // SIGINT and SIGHUP are only delivered to the main thread, so its wait
+  // wakes up at once while the others notice g_exit within one poll timeout
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < servers.size(); ++i) {
+    threads.emplace_back(RunLoop, servers[i].get(), conf->poll_timeout);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+
+  RunMainLoop(servers[0].get(), *conf);
+  for (auto& t : threads) {
+    t.join();
   }
+  servers.clear();
+  CloseExportRing();
+  LOGI("server stop");
+  StopAsyncLog();
+  StopBinaryLog();
   return 0;
 }
@@ -0,0 +1,281 @@
+/**
+ * @file metrics.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-20
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "metrics.h"
+
+#include <stdarg.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+const int Histogram::kSubBucketBits;
+const int Histogram::kSubBuckets;
+const int Histogram::kMaxBits;
+const int Histogram::kNumBuckets;
+
+Histogram::Histogram() : sum_(0) {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+uint64_t Histogram::BucketMax(int index) {
+  if (index < kSubBuckets) return static_cast<uint64_t>(index);
+  int shift = index / kSubBuckets - 1;
+  uint64_t sub = static_cast<uint64_t>(index % kSubBuckets + kSubBuckets);
+  return ((sub + 1) << shift) - 1;
+}
+
+HistogramSnapshot::HistogramSnapshot() : buckets(), count(0), sum(0) {}
+
+void HistogramSnapshot::Merge(const Histogram& h) {
+  // the count is the sum of the buckets read here rather than a counter of
+  // its own, so it always agrees with them
+  for (int i = 0; i < Histogram::kNumBuckets; ++i) {
+    uint64_t n = h.buckets_[i].load(std::memory_order_relaxed);
+    buckets[i] += n;
+    count += n;
+  }
+  sum += h.sum_.load(std::memory_order_relaxed);
+}
+
+uint64_t HistogramSnapshot::CountAtMost(uint64_t value) const {
+  uint64_t n = 0;
+  for (int i = 0; i < Histogram::kNumBuckets; ++i) {
+    if (Histogram::BucketMax(i) > value) break;
+    n += buckets[i];
+  }
+  return n;
+}
+
+uint64_t HistogramSnapshot::ValueAt(double q) const {
+  if (count == 0) return 0;
+  uint64_t rank = static_cast<uint64_t>(q * count + 0.5);
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t n = 0;
+  for (int i = 0; i < Histogram::kNumBuckets; ++i) {
+    n += buckets[i];
+    if (n >= rank) return Histogram::BucketMax(i);
+  }
+  return Histogram::BucketMax(Histogram::kNumBuckets - 1);
+}
+
+static std::mutex g_metrics_mutex;
+static std::vector<const ReactorMetrics*> g_metrics;
+
+void RegisterMetrics(const ReactorMetrics* metrics) {
+  std::lock_guard<std::mutex> lock(g_metrics_mutex);
+  if (std::find(g_metrics.begin(), g_metrics.end(), metrics) ==
+      g_metrics.end()) {
+    g_metrics.push_back(metrics);
+  }
+}
+
+void UnregisterMetrics(const ReactorMetrics* metrics) {
+  std::lock_guard<std::mutex> lock(g_metrics_mutex);
+  g_metrics.erase(std::remove(g_metrics.begin(), g_metrics.end(), metrics),
+                  g_metrics.end());
+}
+
+static void Append(std::string* out, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void Append(std::string* out, const char* fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n > 0) {
+    out->append(buf, std::min(static_cast<size_t>(n), sizeof(buf) - 1));
+  }
+}
+
+static void AppendCounter(std::string* out, const char* name,
+                          const char* help, uint64_t value) {
+  Append(out, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n", name, help,
+         name, name, value);
+}
+
+/* Buckets end at 2^k - 1 for k in [min_bits, max_bits], those are exact
+ * boundaries of the histogram. Values are multiplied by scale, e.g. 1e-9 to
+ * turn nanoseconds into seconds.
+ */
+static void AppendHistogram(std::string* out, const char* name,
+                            const char* help, const HistogramSnapshot& snap,
+                            double scale, int min_bits, int max_bits) {
+  Append(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  for (int k = min_bits; k <= max_bits; ++k) {
+    uint64_t le = (1ULL << k) - 1;
+    Append(out, "%s_bucket{le=\"%.9g\"} %" PRIu64 "\n", name, le * scale,
+           snap.CountAtMost(le));
+  }
+  Append(out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, snap.count);
+  Append(out, "%s_sum %.9g\n%s_count %" PRIu64 "\n", name, snap.sum * scale,
+         name, snap.count);
+
+  // the HDR buckets keep quantiles within 25%, finer than the exported ones
+  static const double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+  Append(out,
+         "# HELP %s_quantile Quantiles of %s.\n"
+         "# TYPE %s_quantile gauge\n",
+         name, name, name);
+  for (double q : kQuantiles) {
+    Append(out, "%s_quantile{quantile=\"%g\"} %.9g\n", name, q,
+           snap.ValueAt(q) * scale);
+  }
+}
+
+void RenderMetrics(std::string* out) {
+  uint64_t reactors = 0;
+  uint64_t accepts = 0;
+  uint64_t accept_errors = 0;
+  uint64_t conn_limit_rejects = 0;
+  uint64_t untrusted[2] = {0};
+  uint64_t rate_limited[2][2] = {{0}};
+  uint64_t rate_limit_untracked = 0;
+  uint64_t closed_by_peer = 0;
+  uint64_t oversized = 0;
+  uint64_t log_suppressed = 0;
+  uint64_t header_timeouts = 0;
+  uint64_t lifetime_timeouts = 0;
+  uint64_t bytes_read = 0;
+  uint64_t decoded[3] = {0};
+  uint64_t decode_errors[16] = {0};
+  uint64_t records = 0;
+  uint64_t record_errors = 0;
+  HistogramSnapshot events_per_wakeup;
+  HistogramSnapshot decode_latency;
+  HistogramSnapshot lifetime;
+
+  {
+    std::lock_guard<std::mutex> lock(g_metrics_mutex);
+    for (const ReactorMetrics* m : g_metrics) {
+      ++reactors;
+      accepts += m->accepts.Get();
+      accept_errors += m->accept_errors.Get();
+      conn_limit_rejects += m->conn_limit_rejects.Get();
+      untrusted[0] += m->untrusted[0].Get();
+      untrusted[1] += m->untrusted[1].Get();
+      for (int i = 0; i < 2; ++i) {
+        rate_limited[i][0] += m->rate_limited[i][0].Get();
+        rate_limited[i][1] += m->rate_limited[i][1].Get();
+      }
+      rate_limit_untracked += m->rate_limit_untracked.Get();
+      closed_by_peer += m->closed_by_peer.Get();
+      oversized += m->oversized.Get();
+      log_suppressed += m->log_suppressed.Get();
+      header_timeouts += m->header_timeouts.Get();
+      lifetime_timeouts += m->lifetime_timeouts.Get();
+      bytes_read += m->bytes_read.Get();
+      for (int i = 0; i < 3; ++i) {
+        decoded[i] += m->decoded[i].Get();
+      }
+      for (int i = 0; i < 16; ++i) {
+        decode_errors[i] += m->decode_errors[i].Get();
+      }
+      records += m->records.Get();
+      record_errors += m->record_errors.Get();
+      events_per_wakeup.Merge(m->events_per_wakeup);
+      decode_latency.Merge(m->decode_latency);
+      lifetime.Merge(m->lifetime);
+    }
+  }
+
+  Append(out,
+         "# HELP proxyproto_reactors Number of reactor threads.\n"
+         "# TYPE proxyproto_reactors gauge\nproxyproto_reactors %" PRIu64 "\n",
+         reactors);
+  AppendCounter(out, "proxyproto_accepts_total", "Accepted connections.",
+                accepts);
+  AppendCounter(out, "proxyproto_accept_errors_total",
+                "Failed accept() calls other than EAGAIN.", accept_errors);
+  AppendCounter(out, "proxyproto_conn_limit_rejects_total",
+                "Connections closed for exceeding the connection limit.",
+                conn_limit_rejects);
+  Append(out,
+         "# HELP proxyproto_untrusted_total Connections from peers outside "
+         "the trusted proxies.\n"
+         "# TYPE proxyproto_untrusted_total counter\n"
+         "proxyproto_untrusted_total{action=\"reject\"} %" PRIu64 "\n"
+         "proxyproto_untrusted_total{action=\"passthrough\"} %" PRIu64 "\n",
+         untrusted[0], untrusted[1]);
+  Append(out,
+         "# HELP proxyproto_rate_limited_total Connections closed for "
+         "exceeding a per address limit.\n"
+         "# TYPE proxyproto_rate_limited_total counter\n");
+  static const char* const kLimitKeys[] = {"peer", "source"};
+  static const char* const kLimits[] = {"rate", "conns"};
+  for (int i = 0; i < 2; ++i) {
+    for (int j = 0; j < 2; ++j) {
+      Append(out,
+             "proxyproto_rate_limited_total{key=\"%s\",limit=\"%s\"} %" PRIu64
+             "\n",
+             kLimitKeys[i], kLimits[j], rate_limited[i][j]);
+    }
+  }
+  AppendCounter(out, "proxyproto_rate_limit_untracked_total",
+                "Connections admitted untracked by a full limit table.",
+                rate_limit_untracked);
+  AppendCounter(out, "proxyproto_closed_by_peer_total",
+                "Connections closed by the peer before a complete header.",
+                closed_by_peer);
+  AppendCounter(out, "proxyproto_oversized_headers_total",
+                "Connections closed for a header over --max-header-bytes.",
+                oversized);
+  AppendCounter(out, "proxyproto_log_suppressed_total",
+                "Connection log lines left out by --log-error-rate.",
+                log_suppressed);
+  Append(out,
+         "# HELP proxyproto_timeouts_total Connections closed at a deadline.\n"
+         "# TYPE proxyproto_timeouts_total counter\n"
+         "proxyproto_timeouts_total{deadline=\"header\"} %" PRIu64 "\n"
+         "proxyproto_timeouts_total{deadline=\"lifetime\"} %" PRIu64 "\n",
+         header_timeouts, lifetime_timeouts);
+  AppendCounter(out, "proxyproto_read_bytes_total",
+                "Bytes read from client and backend sockets.", bytes_read);
+
+  Append(out,
+         "# HELP proxyproto_decoded_total Decoded headers by version.\n"
+         "# TYPE proxyproto_decoded_total counter\n");
+  for (int v = 1; v <= 2; ++v) {
+    Append(out, "proxyproto_decoded_total{version=\"%d\"} %" PRIu64 "\n", v,
+           decoded[v]);
+  }
+  Append(out,
+         "# HELP proxyproto_decode_errors_total Rejected headers by "
+         "DecodeProxyProto() return code.\n"
+         "# TYPE proxyproto_decode_errors_total counter\n");
+  for (int i = 1; i < 16; ++i) {
+    if (decode_errors[i] != 0) {
+      Append(out, "proxyproto_decode_errors_total{code=\"%d\"} %" PRIu64 "\n",
+             -i, decode_errors[i]);
+    }
+  }
+  AppendCounter(out, "proxyproto_records_total",
+                "Connection records appended to --record-dir.", records);
+  AppendCounter(out, "proxyproto_record_errors_total",
+                "Connection records dropped for want of a segment file.",
+                record_errors);
+
+  AppendHistogram(out, "proxyproto_epoll_events_per_wakeup",
+                  "Events returned by each poller wait.", events_per_wakeup,
+                  1, 0, 10);
+  AppendHistogram(out, "proxyproto_decode_latency_seconds",
+                  "Time from accept to a decoded header.", decode_latency,
+                  1e-9, 10, 35);
+  AppendHistogram(out, "proxyproto_conn_lifetime_seconds",
+                  "Time from accept to the connection being freed.", lifetime,
+                  1e-9, 14, 40);
+}
@@ -0,0 +1,157 @@
+/**
+ * @file metrics.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-20
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+/**
+ * @brief 单写者计数器
+ *
+ * 只由所属 reactor 线程递增，无需原子读改写；其他线程以 relaxed 方式读取，
+ * 读到的值可能稍旧但不会撕裂。
+ */
+class Counter {
+ public:
+  Counter() : value_(0) {}
+
+  void Add(uint64_t n = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+  uint64_t Get() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_;
+};
+
+/**
+ * @brief HDR 风格的单写者直方图
+ *
+ * 值按二进制数量级分段，每段再线性分为 kSubBuckets 个桶，相对误差不超过
+ * 1/kSubBuckets；小于 kSubBuckets 的值各占一个桶。记录为 O(1) 且不分配内存，
+ * 读取方式同 Counter。
+ */
+class Histogram {
+ public:
+  static const int kSubBucketBits = 2;
+  static const int kSubBuckets = 1 << kSubBucketBits;
+  // 大于等于 2^kMaxBits 的值计入最后一个桶
+  static const int kMaxBits = 48;
+  static const int kNumBuckets = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+  Histogram();
+
+  void Record(uint64_t value) {
+    Inc(&buckets_[BucketIndex(value)], 1);
+    Inc(&sum_, value);
+  }
+
+  static int BucketIndex(uint64_t value) {
+    if (value < kSubBuckets) return static_cast<int>(value);
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= kMaxBits) return kNumBuckets - 1;
+    int shift = msb - kSubBucketBits;
+    return (shift + 1) * kSubBuckets +
+           static_cast<int>((value >> shift) - kSubBuckets);
+  }
+
+  // 桶内最大的值
+  static uint64_t BucketMax(int index);
+
+ private:
+  friend struct HistogramSnapshot;
+
+  static void Inc(std::atomic<uint64_t>* v, uint64_t n) {
+    v->store(v->load(std::memory_order_relaxed) + n,
+             std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> buckets_[kNumBuckets];
+  std::atomic<uint64_t> sum_;
+};
+
+/**
+ * @brief 一个或多个 Histogram 的合计
+ */
+struct HistogramSnapshot {
+  uint64_t buckets[Histogram::kNumBuckets];
+  uint64_t count;
+  uint64_t sum;
+
+  HistogramSnapshot();
+  void Merge(const Histogram& h);
+  // 小于等于 value 的记录数，value + 1 为分桶边界时精确
+  uint64_t CountAtMost(uint64_t value) const;
+  // 分位数 q (0-1]，返回所在桶的最大值
+  uint64_t ValueAt(double q) const;
+};
+
+/**
+ * @brief 每个 reactor 一份的指标
+ *
+ * 前后填充缓存行，避免不同 reactor 的计数器伪共享。
+ */
+struct ReactorMetrics {
+  char padding0[64];
+  Counter accepts;
+  // 不含 EAGAIN，含 ECONNABORTED
+  Counter accept_errors;
+  Counter conn_limit_rejects;
+  // 来自受信任代理以外地址的连接，按 UntrustedPolicy 计数
+  Counter untrusted[2];
+  // 超过 RateLimiter 限制的连接，按 [对端, 头部源地址][速率, 并发] 计数
+  Counter rate_limited[2][2];
+  // 限制表已满、未被记录而放行的连接
+  Counter rate_limit_untracked;
+  // 头部完整前对端关闭，与头部超过 Conf::max_header_bytes 的连接
+  Counter closed_by_peer;
+  Counter oversized;
+  // 超过 Conf::log_error_rate 而未打印的日志
+  Counter log_suppressed;
+  // 超过 Conf::header_timeout、Conf::max_lifetime 被关闭的连接
+  Counter header_timeouts;
+  Counter lifetime_timeouts;
+  // 从客户端与后端 socket 读取的字节数
+  Counter bytes_read;
+  // 按版本 1、2 计数
+  Counter decoded[3];
+  // 按 DecodeProxyProto() 返回值取反计数
+  Counter decode_errors[16];
+  // 写入 --record-dir 的记录，与创建段文件失败而丢弃的记录
+  Counter records;
+  Counter record_errors;
+  // 每次 epoll_wait 返回的事件数
+  Histogram events_per_wakeup;
+  // accept 到头部解析完成的纳秒数
+  Histogram decode_latency;
+  // accept 到连接释放的纳秒数
+  Histogram lifetime;
+  char padding1[64];
+};
+
+/**
+ * @brief 登记 reactor 的指标，之后每次 RenderMetrics() 都会计入
+ */
+void RegisterMetrics(const ReactorMetrics* metrics);
+
+/**
+ * @brief 取消登记，未登记时什么也不做
+ */
+void UnregisterMetrics(const ReactorMetrics* metrics);
+
+/**
+ * @brief 以 Prometheus 文本格式输出所有已登记 reactor 的指标合计
+ */
+void RenderMetrics(std::string* out);
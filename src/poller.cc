@@ -0,0 +1,113 @@
+/**
+ * @file poller.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-22
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "poller.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+namespace {
+
+class EpollPoller : public Poller {
+ public:
+  explicit EpollPoller(int epoll_fd, bool edge_triggered)
+      : epoll_fd_(epoll_fd), trigger_mode_(edge_triggered ? EPOLLET : 0) {}
+  ~EpollPoller() override { close(epoll_fd_); }
+
+  const char* name() const override { return "epoll"; }
+  bool edge_triggered() const override { return trigger_mode_ != 0; }
+
+  int Add(int fd, int events, uint64_t data) override {
+    return Ctl(EPOLL_CTL_ADD, fd, events, data);
+  }
+  int Modify(int fd, int events, uint64_t data) override {
+    return Ctl(EPOLL_CTL_MOD, fd, events, data);
+  }
+  int Remove(int fd) override { return Ctl(EPOLL_CTL_DEL, fd, 0, 0); }
+
+  int Wait(PollerEvent* events, int max, int timeout) override {
+    if (ready_.size() < static_cast<size_t>(max)) {
+      ready_.resize(max);
+    }
+    int n = epoll_wait(epoll_fd_, ready_.data(), max, timeout);
+    if (n < 0) {
+      return -errno;
+    }
+    for (int i = 0; i < n; ++i) {
+      events[i].data = ready_[i].data.u64;
+      events[i].type = POLLER_READY;
+      events[i].res = static_cast<int>(ready_[i].events);
+      events[i].buf = nullptr;
+    }
+    return n;
+  }
+
+ private:
+  int Ctl(int operation, int fd, int events, uint64_t data) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events | trigger_mode_;
+    event.data.u64 = data;
+    return epoll_ctl(epoll_fd_, operation, fd, &event) == 0 ? 0 : -errno;
+  }
+
+  int epoll_fd_;
+  // EPOLLET in edge-triggered mode, or 0
+  int trigger_mode_;
+  std::vector<struct epoll_event> ready_;
+};
+
+}  // namespace
+
+const char* PollerOpName(int op) {
+  switch (op) {
+    case POLLER_ADD:
+      return "add";
+    case POLLER_MODIFY:
+      return "modify";
+    case POLLER_REMOVE:
+      return "remove";
+
+    default:
+      return "unknown";
+  }
+}
+
+std::unique_ptr<Poller> CreateEpollPoller(bool edge_triggered) {
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    return nullptr;
+  }
+  return std::unique_ptr<Poller>(new EpollPoller(epoll_fd, edge_triggered));
+}
+
+std::unique_ptr<Poller> CreatePoller(int backend, bool edge_triggered) {
+  switch (backend) {
+    case POLLER_EPOLL:
+      return CreateEpollPoller(edge_triggered);
+    case POLLER_IO_URING:
+      return CreateUringPoller();
+    default: {
+      // io_uring readiness is level-triggered only
+      if (edge_triggered) {
+        return CreateEpollPoller(true);
+      }
+      std::unique_ptr<Poller> poller = CreateUringPoller();
+      if (!poller) {
+        poller = CreateEpollPoller(false);
+      }
+      return poller;
+    }
+  }
+}
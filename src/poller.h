@@ -0,0 +1,138 @@
+/**
+ * @file poller.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-22
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <memory>
+
+enum PollerBackend {
+  // 内核支持时使用 io_uring，否则退回 epoll
+  POLLER_AUTO = 0,
+  POLLER_EPOLL,
+  POLLER_IO_URING,
+};
+
+enum PollerEventType {
+  // fd 就绪，res 为 poll(2) 事件位
+  POLLER_READY,
+  // AcceptMultishot() 的结果，res 为新连接 fd 或 -errno
+  POLLER_ACCEPT,
+  // RecvMultishot() 的结果，res 为字节数，0 表示对端关闭，负值为 -errno
+  POLLER_RECV,
+};
+
+// Server 等调用方对 Add()、Modify()、Remove() 的统一称呼，用于分派与日志
+enum PollerOp {
+  POLLER_ADD,
+  POLLER_MODIFY,
+  POLLER_REMOVE,
+};
+
+/**
+ * @brief PollerOp 的名称，用于日志
+ */
+const char* PollerOpName(int op);
+
+struct PollerEvent {
+  uint64_t data;
+  int type;
+  int res;
+  // POLLER_RECV 且 res > 0 时为收到的数据，下次 Wait() 之前有效
+  const char* buf;
+};
+
+/**
+ * @brief 事件循环后端
+ *
+ * 就绪通知与 epoll 水平触发一致（epoll 后端可选边缘触发）：Add()/Modify() 设置
+ * 关注的事件，Wait() 报告就绪的 fd。支持完成通知的后端还可以直接投递 accept
+ * 与 recv，结果由 Wait() 以 POLLER_ACCEPT、POLLER_RECV 事件返回。
+ *
+ * 所有方法只能在同一线程调用。出错时返回 -errno。
+ */
+class Poller {
+ public:
+  virtual ~Poller() {}
+
+  virtual const char* name() const = 0;
+  /**
+   * @brief 是否为边缘触发，此时需要读到 EAGAIN 才会再次报告就绪
+   */
+  virtual bool edge_triggered() const { return false; }
+
+  virtual int Add(int fd, int events, uint64_t data) = 0;
+  virtual int Modify(int fd, int events, uint64_t data) = 0;
+  /**
+   * @brief 取消 fd 上的所有关注与投递，之后才能关闭 fd
+   */
+  virtual int Remove(int fd) = 0;
+  /**
+   * @brief 按 PollerOp 调用 Add()、Modify() 或 Remove()
+   */
+  int Ctl(int op, int fd, int events, uint64_t data) {
+    switch (op) {
+      case POLLER_ADD:
+        return Add(fd, events, data);
+      case POLLER_MODIFY:
+        return Modify(fd, events, data);
+      case POLLER_REMOVE:
+        return Remove(fd);
+      default:
+        return -EINVAL;
+    }
+  }
+
+  /**
+   * @brief 是否支持 AcceptMultishot() 与 RecvMultishot()
+   */
+  virtual bool SupportsMultishot() const { return false; }
+  /**
+   * @brief 持续 accept 监听 fd，每个新连接产生一个 POLLER_ACCEPT 事件
+   *
+   * 除 ECONNABORTED、EINTR、EAGAIN 外的错误（如 EMFILE）报告后停止 accept，
+   * 调用者稍后对同一 fd 再次调用以恢复。
+   */
+  virtual int AcceptMultishot(int fd, uint64_t data) { return -ENOTSUP; }
+  /**
+   * @brief 持续接收 fd 上的数据，直到对端关闭、出错或 Remove()
+   *
+   * 与 Add() 不能用于同一个 fd。
+   */
+  virtual int RecvMultishot(int fd, uint64_t data) { return -ENOTSUP; }
+
+  /**
+   * @brief 等待事件
+   *
+   * @param events 输出的事件数组
+   * @param max 数组长度
+   * @param timeout 毫秒，-1 表示一直等待
+   * @return int 事件个数，出错时返回 -errno，被信号打断时为 -EINTR
+   */
+  virtual int Wait(PollerEvent* events, int max, int timeout) = 0;
+};
+
+/**
+ * @brief 创建事件循环后端
+ *
+ * POLLER_AUTO 在要求边缘触发时选择 epoll，否则优先 io_uring。
+ *
+ * @param backend PollerBackend
+ * @param edge_triggered epoll 后端使用边缘触发，io_uring 后端不支持，忽略
+ * @return std::unique_ptr<Poller> 所选后端不可用时返回 nullptr
+ */
+std::unique_ptr<Poller> CreatePoller(int backend, bool edge_triggered);
+
+// 内核不支持时返回 nullptr，由 CreatePoller() 调用
+std::unique_ptr<Poller> CreateEpollPoller(bool edge_triggered);
+std::unique_ptr<Poller> CreateUringPoller();
@@ -0,0 +1,275 @@
+/**
+ * @file prefix_set.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-27
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "prefix_set.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+template <typename Key, int kKeyBits>
+Poptrie<Key, kKeyBits>::Poptrie() {
+  TrieNode root = {{-1, -1}, -1};
+  trie_.push_back(root);
+  // nothing inserted yet, every key misses
+  direct_.assign(1U << kDirectBits, kLeafFlag | kNone);
+}
+
+template <typename Key, int kKeyBits>
+void Poptrie<Key, kKeyBits>::Insert(Key key, int len, uint8_t value) {
+  int n = 0;
+  for (int i = 0; i < len; ++i) {
+    int bit = Bit(key, i);
+    if (trie_[n].child[bit] == -1) {
+      TrieNode node = {{-1, -1}, -1};
+      trie_[n].child[bit] = static_cast<int32_t>(trie_.size());
+      trie_.push_back(node);
+    }
+    n = trie_[n].child[bit];
+  }
+  trie_[n].value = value;
+}
+
+template <typename Key, int kKeyBits>
+int Poptrie<Key, kKeyBits>::Walk(int n, uint32_t slot, int count,
+                                 uint8_t* value) const {
+  for (int i = count - 1; i >= 0; --i) {
+    n = trie_[n].child[(slot >> i) & 1];
+    if (n == -1) {
+      return -1;
+    }
+    if (trie_[n].value != -1) {
+      *value = static_cast<uint8_t>(trie_[n].value);
+    }
+  }
+  return n;
+}
+
+template <typename Key, int kKeyBits>
+void Poptrie<Key, kKeyBits>::Build() {
+  nodes_.clear();
+  leaves_.clear();
+  uint8_t root = trie_[0].value != -1 ? static_cast<uint8_t>(trie_[0].value)
+                                      : static_cast<uint8_t>(kNone);
+  for (uint32_t slot = 0; slot < direct_.size(); ++slot) {
+    uint8_t value = root;
+    int n = Walk(0, slot, kDirectBits, &value);
+    if (n != -1 && HasChildren(n)) {
+      uint32_t index = static_cast<uint32_t>(nodes_.size());
+      nodes_.push_back(Node());
+      Compile(n, value, index);
+      direct_[slot] = index;
+    } else {
+      direct_[slot] = kLeafFlag | value;
+    }
+  }
+
+  std::vector<TrieNode>().swap(trie_);
+  nodes_.shrink_to_fit();
+  leaves_.shrink_to_fit();
+}
+
+template <typename Key, int kKeyBits>
+void Poptrie<Key, kKeyBits>::Compile(int n, uint8_t value, uint32_t index) {
+  int children[64];
+  uint8_t values[64];
+  uint64_t vector = 0;
+  for (uint32_t v = 0; v < 64; ++v) {
+    values[v] = value;
+    children[v] = Walk(n, v, kStride, &values[v]);
+    if (children[v] != -1 && HasChildren(children[v])) {
+      vector |= 1ULL << v;
+    }
+  }
+
+  // leaves are stored once per run of equal values, slots that continue
+  // into a child neither start nor break a run
+  Node node;
+  node.vector = vector;
+  node.leafvec = 0;
+  node.base0 = static_cast<uint32_t>(leaves_.size());
+  node.base1 = static_cast<uint32_t>(nodes_.size());
+  int prev = -1;
+  for (int v = 0; v < 64; ++v) {
+    if ((vector >> v) & 1) continue;
+    if (values[v] != prev) {
+      node.leafvec |= 1ULL << v;
+      leaves_.push_back(values[v]);
+      prev = values[v];
+    }
+  }
+  nodes_.resize(nodes_.size() + __builtin_popcountll(vector));
+  nodes_[index] = node;
+
+  uint32_t child = node.base1;
+  for (int v = 0; v < 64; ++v) {
+    if ((vector >> v) & 1) {
+      Compile(children[v], values[v], child++);
+    }
+  }
+}
+
+template class Poptrie<uint64_t, 64>;
+template class Poptrie<unsigned __int128, 128>;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PREFIX_SET_X86
+#endif
+
+// without -mpopcnt __builtin_popcountll() is a libgcc call, this copy of
+// the lookup gets the instruction inlined instead
+#ifdef PREFIX_SET_X86
+template <typename Trie, typename Key>
+__attribute__((target("popcnt"))) static uint8_t LookupPopcnt(
+    const Trie& trie, Key key) {
+  return trie.Lookup(key);
+}
+#endif
+
+template <typename Trie, typename Key>
+static uint8_t Lookup(const Trie& trie, Key key, bool popcnt) {
+#ifdef PREFIX_SET_X86
+  if (popcnt) return LookupPopcnt(trie, key);
+#endif
+  return trie.Lookup(key);
+}
+
+static bool HasPopcnt() {
+#ifdef PREFIX_SET_X86
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("popcnt");
+#else
+  return false;
+#endif
+}
+
+static const uint8_t kMappedPrefix[12] = {0, 0, 0, 0, 0,    0,
+                                          0, 0, 0, 0, 0xFF, 0xFF};
+
+static unsigned __int128 Ipv6Key(const struct in6_addr& addr) {
+  uint64_t words[2];
+  memcpy(words, addr.s6_addr, 16);
+  return static_cast<unsigned __int128>(be64toh(words[0])) << 64 |
+         be64toh(words[1]);
+}
+
+PrefixSet::PrefixSet() : count_(0), popcnt_(HasPopcnt()) {}
+
+int PrefixSet::Add(const char* text) {
+  uint8_t value = Ipv4Trie::kInclude;
+  if (*text == '!') {
+    value = Ipv4Trie::kExclude;
+    ++text;
+  }
+
+  char addr[INET6_ADDRSTRLEN];
+  const char* slash = strchr(text, '/');
+  size_t addr_len = slash != nullptr ? static_cast<size_t>(slash - text)
+                                     : strlen(text);
+  if (addr_len == 0 || addr_len >= sizeof(addr)) {
+    return -1;
+  }
+  memcpy(addr, text, addr_len);
+  addr[addr_len] = '\0';
+
+  bool ipv6 = strchr(addr, ':') != nullptr;
+  int max_len = ipv6 ? 128 : 32;
+  int len = max_len;
+  if (slash != nullptr) {
+    char* end = nullptr;
+    long value_len = strtol(slash + 1, &end, 10);
+    if (end == slash + 1 || *end != '\0' || value_len < 0 ||
+        value_len > max_len) {
+      return -1;
+    }
+    len = static_cast<int>(value_len);
+  }
+
+  if (ipv6) {
+    struct in6_addr in6;
+    if (inet_pton(AF_INET6, addr, &in6) != 1) {
+      return -1;
+    }
+    ipv6_.Insert(Ipv6Key(in6), len, value);
+  } else {
+    struct in_addr in;
+    if (inet_pton(AF_INET, addr, &in) != 1) {
+      return -1;
+    }
+    ipv4_.Insert(static_cast<uint64_t>(ntohl(in.s_addr)) << 32, len, value);
+  }
+  ++count_;
+  return 0;
+}
+
+int PrefixSet::LoadFile(const char* path, int* line) {
+  FILE* fp = fopen(path, "r");
+  if (fp == nullptr) {
+    return -1;
+  }
+
+  char buf[256];
+  int err = 0;
+  *line = 0;
+  while (fgets(buf, sizeof(buf), fp) != nullptr) {
+    ++*line;
+    char* p = buf;
+    char* comment = strchr(p, '#');
+    if (comment != nullptr) *comment = '\0';
+    while (*p == ' ' || *p == '\t') ++p;
+    char* end = p + strlen(p);
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' ||
+                       end[-1] == '\n')) {
+      --end;
+    }
+    *end = '\0';
+    if (*p != '\0' && Add(p) != 0) {
+      err = -2;
+      break;
+    }
+  }
+  fclose(fp);
+  return err;
+}
+
+void PrefixSet::Build() {
+  ipv4_.Build();
+  ipv6_.Build();
+}
+
+bool PrefixSet::ContainsIpv4(const struct in_addr& addr) const {
+  uint64_t key = static_cast<uint64_t>(ntohl(addr.s_addr)) << 32;
+  return Lookup(ipv4_, key, popcnt_) == Ipv4Trie::kInclude;
+}
+
+bool PrefixSet::ContainsIpv6(const struct in6_addr& addr) const {
+  if (memcmp(addr.s6_addr, kMappedPrefix, sizeof(kMappedPrefix)) == 0) {
+    struct in_addr in;
+    memcpy(&in, addr.s6_addr + 12, 4);
+    return ContainsIpv4(in);
+  }
+  return Lookup(ipv6_, Ipv6Key(addr), popcnt_) == Ipv6Trie::kInclude;
+}
+
+bool PrefixSet::Contains(const struct sockaddr* addr) const {
+  if (addr->sa_family == AF_INET) {
+    return ContainsIpv4(
+        reinterpret_cast<const struct sockaddr_in*>(addr)->sin_addr);
+  }
+  if (addr->sa_family == AF_INET6) {
+    return ContainsIpv6(
+        reinterpret_cast<const struct sockaddr_in6*>(addr)->sin6_addr);
+  }
+  return false;
+}
@@ -0,0 +1,154 @@
+/**
+ * @file prefix_set.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-27
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+/* Poptrie (Asai and Ohara, SIGCOMM 2015): the top 16 bits index a direct
+ * table, below that each node covers 6 bits with one bitmap of the slots
+ * that continue into child nodes and one of the slots where a run of equal
+ * leaves starts. Children and leaves of a node are stored contiguously, so a
+ * lookup is a popcount and an array access per level.
+ */
+template <typename Key, int kKeyBits>
+class Poptrie {
+ public:
+  // leaf values of the set, 0 for addresses no prefix covers
+  enum { kNone = 0, kExclude = 1, kInclude = 2 };
+
+  Poptrie();
+
+  // key holds the prefix in its top len bits, later inserts of the same
+  // prefix replace earlier ones
+  void Insert(Key key, int len, uint8_t value);
+  // compiles the inserted prefixes, Lookup() is valid afterwards
+  void Build();
+
+  uint8_t Lookup(Key key) const {
+    uint32_t d =
+        direct_[static_cast<uint32_t>(key >> (kKeyBits - kDirectBits))];
+    if (d & kLeafFlag) {
+      return static_cast<uint8_t>(d);
+    }
+    const Node* node = &nodes_[d];
+    for (int offset = kDirectBits;; offset += kStride) {
+      int v = static_cast<int>((key << offset) >> (kKeyBits - kStride));
+      // 2 << 63 wraps to 0, the mask is then all ones
+      uint64_t mask = (2ULL << v) - 1;
+      if (!((node->vector >> v) & 1)) {
+        int run = __builtin_popcountll(node->leafvec & mask);
+        return leaves_[node->base0 + run - 1];
+      }
+      int child = __builtin_popcountll(node->vector & mask);
+      node = &nodes_[node->base1 + child - 1];
+    }
+  }
+
+  size_t memory() const {
+    return direct_.size() * sizeof(direct_[0]) +
+           nodes_.size() * sizeof(nodes_[0]) + leaves_.size();
+  }
+
+ private:
+  static const int kDirectBits = 16;
+  static const int kStride = 6;
+  static const uint32_t kLeafFlag = 1U << 31;
+
+  struct Node {
+    uint64_t vector;
+    uint64_t leafvec;
+    uint32_t base0;
+    uint32_t base1;
+  };
+
+  // binary trie the prefixes are inserted into, dropped by Build()
+  struct TrieNode {
+    int32_t child[2];
+    // -1 where no prefix ends
+    int16_t value;
+  };
+
+  static int Bit(Key key, int i) {
+    return static_cast<int>((key >> (kKeyBits - 1 - i)) & 1);
+  }
+  // follows bits [depth, depth + count) of slot from n, updating value with
+  // the prefixes passed, returns -1 when the trie ends before
+  int Walk(int n, uint32_t slot, int count, uint8_t* value) const;
+  bool HasChildren(int n) const {
+    return trie_[n].child[0] != -1 || trie_[n].child[1] != -1;
+  }
+  void Compile(int n, uint8_t value, uint32_t index);
+
+  std::vector<TrieNode> trie_;
+  std::vector<uint32_t> direct_;
+  std::vector<Node> nodes_;
+  std::vector<uint8_t> leaves_;
+};
+
+/**
+ * @brief IPv4 与 IPv6 前缀的只读集合，按最长前缀匹配判断地址是否在集合内
+ *
+ * 以 '!' 开头的前缀把更短前缀中的一段排除在外。构建后只读，可被多个线程
+ * 同时查询。
+ */
+class PrefixSet {
+ public:
+  PrefixSet();
+
+  /**
+   * @brief 加入一个前缀，如 10.0.0.0/8、2001:db8::/32、!10.1.2.3
+   *
+   * 不带长度时为单个地址，前缀长度以外的主机位被忽略。
+   *
+   * @return int 0 成功，-1 格式错误
+   */
+  int Add(const char* text);
+
+  /**
+   * @brief 读取文件，每行一个前缀，'#' 之后为注释，空行被忽略
+   *
+   * @param line 出错时写入出错的行号
+   * @return int 0 成功；-1 无法打开文件；-2 第 *line 行格式错误
+   */
+  int LoadFile(const char* path, int* line);
+
+  // 编译已加入的前缀，之后才能查询
+  void Build();
+
+  bool ContainsIpv4(const struct in_addr& addr) const;
+
+  // IPv4 映射地址按 IPv4 前缀查询
+  bool ContainsIpv6(const struct in6_addr& addr) const;
+
+  // AF_INET 或 AF_INET6 地址，其他协议族返回 false
+  bool Contains(const struct sockaddr* addr) const;
+
+  // 已加入的前缀数
+  size_t size() const { return count_; }
+  // 编译后的字节数
+  size_t memory() const { return ipv4_.memory() + ipv6_.memory(); }
+
+ private:
+  typedef Poptrie<uint64_t, 64> Ipv4Trie;
+  typedef Poptrie<unsigned __int128, 128> Ipv6Trie;
+
+  Ipv4Trie ipv4_;
+  Ipv6Trie ipv6_;
+  size_t count_;
+  // lookups run the copy compiled for the popcnt instruction
+  bool popcnt_;
+};
@@ -11,13 +11,19 @@
 
 #include "proxyproto.h"
 
-#include <arpa/inet.h>  // inet_pton()
+#include <arpa/inet.h>  // ntohs()
+#include <sys/un.h>
 
 #include <algorithm>
-#include <climits>
-#include <cstdlib>
 #include <cstring>
 
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PROXYPROTO_X86 1
+#endif
+
 static const char v2sig[12] = {
     0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A,
 };
@@ -30,6 +36,8 @@ enum Error {
   kUnknownFamily = -4,
   kInvalidAddr = -6,
   kInvalidPort = -7,
+  kInvalidTlv = -8,
+  kBadChecksum = -9,
 };
 
 union ProxyProtoHeader {
@@ -62,63 +70,165 @@ union ProxyProtoHeader {
   } v2;
 };
 
-#define INVALID 1
-#define TOOSMALL 2
-#define TOOLARGE 3
-
-static long long strtonum(const char* numstr, long long minval,
-                          long long maxval, const char** errstrp) {
-  long long ll = 0;
-  char* ep;
-  int error = 0;
-  struct errval {
-    const char* errstr;
-    int err;
-  } ev[4] = {
-      {NULL, 0},
-      {"invalid", EINVAL},
-      {"too small", ERANGE},
-      {"too large", ERANGE},
-  };
-
-  ev[0].err = errno;
-  errno = 0;
-  if (minval > maxval)
-    error = INVALID;
-  else {
-    ll = strtoll(numstr, &ep, 10);
-    if (numstr == ep || *ep != '\0')
-      error = INVALID;
-    else if ((ll == LLONG_MIN && errno == ERANGE) || ll < minval)
-      error = TOOSMALL;
-    else if ((ll == LLONG_MAX && errno == ERANGE) || ll > maxval)
-      error = TOOLARGE;
-  }
-  if (errstrp != NULL) *errstrp = ev[error].errstr;
-  errno = ev[error].err;
-  if (error) ll = 0;
-
-  return (ll);
+/* Advances *p past the next run of spaces and returns the token after it in
+ * [*tok, *p), mirroring strtok_r(str, " ", ...).
+ */
+static bool NextToken(const char** p, const char* end, const char** tok) {
+  const char* s = *p;
+  while (s < end && *s == ' ') ++s;
+  if (s == end) return false;
+
+  const char* e = s;
+  while (e < end && *e != ' ') ++e;
+  *tok = s;
+  *p = e;
+  return true;
 }
 
-static int DecodeV1(const char* data, size_t size, InetAddress* src,
-                    InetAddress* dst) {
-  const ProxyProtoHeader* hdr = reinterpret_cast<const ProxyProtoHeader*>(data);
+/* Same grammar as inet_pton(AF_INET): exactly four decimal octets, no
+ * leading zeros, each at most 255.
+ */
+static bool ParseIpv4(const char* s, const char* end, uint8_t* dst) {
+  uint8_t tmp[4] = {0};
+  int octets = 0;
+  bool saw_digit = false;
+  uint8_t* tp = tmp;
+  while (s < end) {
+    char ch = *s++;
+    if (ch >= '0' && ch <= '9') {
+      unsigned int val = *tp * 10u + static_cast<unsigned int>(ch - '0');
+      if (saw_digit && *tp == 0) return false;
+      if (val > 255) return false;
+      *tp = static_cast<uint8_t>(val);
+      if (!saw_digit) {
+        if (++octets > 4) return false;
+        saw_digit = true;
+      }
+    } else if (ch == '.' && saw_digit) {
+      if (octets == 4) return false;
+      *++tp = 0;
+      saw_digit = false;
+    } else {
+      return false;
+    }
+  }
+  if (octets < 4) return false;
+
+  memcpy(dst, tmp, sizeof(tmp));
+  return true;
+}
+
+static int HexDigit(char ch) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+  return -1;
+}
+
+/* Same grammar as inet_pton(AF_INET6): up to eight groups of at most four
+ * hex digits, a single "::" and an optional trailing dotted quad.
+ */
+static bool ParseIpv6(const char* s, const char* end, uint8_t* dst) {
+  uint8_t tmp[16] = {0};
+  uint8_t* tp = tmp;
+  uint8_t* endp = tmp + sizeof(tmp);
+  uint8_t* colonp = nullptr;
+
+  if (s == end) return false;
+  /* leading "::" */
+  if (*s == ':') {
+    ++s;
+    if (s == end || *s != ':') return false;
+  }
+
+  const char* curtok = s;
+  int xdigits = 0;
+  unsigned int val = 0;
+  while (s < end) {
+    char ch = *s++;
+    int digit = HexDigit(ch);
+    if (digit >= 0) {
+      if (xdigits == 4) return false;
+      val = (val << 4) | static_cast<unsigned int>(digit);
+      ++xdigits;
+      continue;
+    }
+
+    if (ch == ':') {
+      curtok = s;
+      if (xdigits == 0) {
+        if (colonp != nullptr) return false;
+        colonp = tp;
+        continue;
+      } else if (s == end) {
+        return false;
+      }
+      if (tp + 2 > endp) return false;
+      *tp++ = static_cast<uint8_t>(val >> 8);
+      *tp++ = static_cast<uint8_t>(val);
+      xdigits = 0;
+      val = 0;
+      continue;
+    }
+
+    if (ch == '.' && tp + 4 <= endp && ParseIpv4(curtok, end, tp)) {
+      tp += 4;
+      xdigits = 0;
+      break;
+    }
+    return false;
+  }
+
+  if (xdigits > 0) {
+    if (tp + 2 > endp) return false;
+    *tp++ = static_cast<uint8_t>(val >> 8);
+    *tp++ = static_cast<uint8_t>(val);
+  }
 
-  char* end = const_cast<char*>(
-      reinterpret_cast<const char*>(memchr(hdr->v1.line, '\r', size - 1)));
-  if (end == nullptr || end[1] != '\n') {
+  if (colonp != nullptr) {
+    /* "::" must stand for at least one zero group */
+    if (tp == endp) return false;
+    size_t n = tp - colonp;
+    memmove(endp - n, colonp, n);
+    memset(colonp, 0, endp - n - colonp);
+    tp = endp;
+  }
+  if (tp != endp) return false;
+
+  memcpy(dst, tmp, sizeof(tmp));
+  return true;
+}
+
+/* Decimal digits only, leading zeros allowed, at most 65535. */
+static bool ParsePort(const char* s, const char* end, uint16_t* port) {
+  if (s == end) return false;
+
+  uint32_t val = 0;
+  for (; s < end; ++s) {
+    uint32_t digit = static_cast<uint32_t>(*s - '0');
+    if (digit > 9) return false;
+    val = val * 10 + digit;
+    if (val > UINT16_MAX) return false;
+  }
+  *port = static_cast<uint16_t>(val);
+  return true;
+}
+
+static int DecodeV1(const char* data, size_t size, ProxyProtoResult* res) {
+  const char* cr = reinterpret_cast<const char*>(memchr(data, '\r', size - 1));
+  if (cr == nullptr) {
+    // a v1 line is at most 107 bytes including CRLF
+    return size < 108 ? kNeedMoreData : kWrongProtocol;
+  }
+  if (cr[1] != '\n') {
     return kWrongProtocol;
   }
-  *end = '\0';
-  size = end + 2 - hdr->v1.line;
+  size = cr + 2 - data;
 
-  union {
-    struct sockaddr_in v4;
-    struct sockaddr_in6 v6;
-  } src_addr, dst_addr;
-  memset(&src_addr, 0, sizeof(src_addr));
-  memset(&dst_addr, 0, sizeof(dst_addr));
+  /* an embedded NUL terminates the line early */
+  const char* end =
+      reinterpret_cast<const char*>(memchr(data, '\0', cr - data));
+  if (end == nullptr) end = cr;
 
   /* PROXY TCP4 255.255.255.255 255.255.255.255 65535 65535
    * PROXY TCP6 ffff:f...f:ffff ffff:f...f:ffff 65535 65535
@@ -126,180 +236,610 @@ static int DecodeV1(const char* data, size_t size, InetAddress* src,
    * PROXY UNKNOWN ffff:f...f:ffff ffff:f...f:ffff 65535 65535
    */
 
-  char* token;
-  char* str = const_cast<char*>(hdr->v1.line);
-  char* saveptr = nullptr;
-  for (int i = 1;; i++, str = nullptr) {
-    token = strtok_r(str, " ", &saveptr);
-    if (token == nullptr) {
-      return kWrongProtocol;
-    }
-
-    switch (i) {
-        /* PROXY */
-      case 1:
-        continue;
+  const char* p = data;
+  const char* tok;
+
+  /* PROXY */
+  if (!NextToken(&p, end, &tok)) return kWrongProtocol;
+
+  res->version = 1;
+  res->command = PROXYPROTO_CMD_PROXY;
+
+  /* TCP4, TCP6, UNKNOWN */
+  if (!NextToken(&p, end, &tok)) return kWrongProtocol;
+  bool ipv6;
+  if (p - tok == 4 && memcmp(tok, "TCP4", 4) == 0) {
+    ipv6 = false;
+  } else if (p - tok == 4 && memcmp(tok, "TCP6", 4) == 0) {
+    ipv6 = true;
+  } else if (p - tok == 7 && memcmp(tok, "UNKNOWN", 7) == 0) {
+    /* the rest of the line is ignored, the real endpoints apply */
+    res->transport = PROXYPROTO_TRANSPORT_UNSPEC;
+    res->src.set_unspec();
+    res->dst.set_unspec();
+    return static_cast<int>(size);
+  } else {
+    return kUnknownFamily;
+  }
 
-        /* TCP4, TCP6, UNKNOWN */
-      case 2:
-        if (strcmp(token, "TCP4") == 0) {
-          src_addr.v4.sin_family = AF_INET;
-          dst_addr.v4.sin_family = AF_INET;
-        } else if (strcmp(token, "TCP6") == 0) {
-          src_addr.v6.sin6_family = AF_INET6;
-          dst_addr.v6.sin6_family = AF_INET6;
-        } else {
-          return kUnknownFamily;
-        }
-        break;
+  /* source and destination address */
+  uint8_t addr[2][16];
+  for (int i = 0; i < 2; ++i) {
+    if (!NextToken(&p, end, &tok)) return kWrongProtocol;
+    bool ok = ipv6 ? ParseIpv6(tok, p, addr[i]) : ParseIpv4(tok, p, addr[i]);
+    if (!ok) return kInvalidAddr;
+  }
 
-        /* source address */
-      case 3: {
-        int ret = 0;
-        struct sockaddr* sa = reinterpret_cast<struct sockaddr*>(&src_addr);
-        if (sa->sa_family == AF_INET) {
-          ret = inet_pton(AF_INET, token, &src_addr.v4.sin_addr.s_addr);
-        } else if (sa->sa_family == AF_INET6) {
-          ret = inet_pton(AF_INET6, token, &src_addr.v6.sin6_addr);
-        }
-        if (ret != 1) return kInvalidAddr;
-      } break;
-
-        /* destination address */
-      case 4: {
-        int ret = 0;
-        struct sockaddr* sa = reinterpret_cast<struct sockaddr*>(&src_addr);
-        if (sa->sa_family == AF_INET) {
-          ret = inet_pton(AF_INET, token, &dst_addr.v4.sin_addr.s_addr);
-        } else if (sa->sa_family == AF_INET6) {
-          ret = inet_pton(AF_INET6, token, &dst_addr.v6.sin6_addr);
-        }
-        if (ret != 1) return kInvalidAddr;
-      } break;
-
-        /* source port */
-      case 5: {
-        if (!isdigit((unsigned char)token[0])) return kInvalidPort;
-
-        const char* errstr = nullptr;
-        uint16_t port = (uint16_t)strtonum(token, 0, UINT16_MAX, &errstr);
-        if (errstr != NULL) return kInvalidPort;
-
-        struct sockaddr* sa = reinterpret_cast<struct sockaddr*>(&src_addr);
-        if (sa->sa_family == AF_INET) {
-          src_addr.v4.sin_port = htons(port);
-        } else if (sa->sa_family == AF_INET6) {
-          src_addr.v6.sin6_port = htons(port);
-        }
-      } break;
-
-        /* destination port */
-      case 6: {
-        if (!isdigit((unsigned char)token[0])) return kInvalidPort;
-
-        const char* errstr = nullptr;
-        uint16_t port = (uint16_t)strtonum(token, 0, UINT16_MAX, &errstr);
-        if (errstr != NULL) return kInvalidPort;
-
-        struct sockaddr* sa = reinterpret_cast<struct sockaddr*>(&dst_addr);
-        if (sa->sa_family == AF_INET) {
-          dst_addr.v4.sin_port = htons(port);
-
-          src->set_addr4(src_addr.v4);
-          dst->set_addr4(dst_addr.v4);
-        } else if (sa->sa_family == AF_INET6) {
-          dst_addr.v6.sin6_port = htons(port);
-
-          src->set_addr6(src_addr.v6);
-          dst->set_addr6(dst_addr.v6);
-        }
-        return static_cast<int>(size);
-      }
+  /* source and destination port */
+  uint16_t port[2];
+  for (int i = 0; i < 2; ++i) {
+    if (!NextToken(&p, end, &tok)) return kWrongProtocol;
+    if (!ParsePort(tok, p, &port[i])) return kInvalidPort;
+  }
 
-      default:
-        return kWrongProtocol;
-    }
+  res->transport = PROXYPROTO_TRANSPORT_STREAM;
+  if (ipv6) {
+    struct sockaddr_in6 addr6;
+    memset(&addr6, 0, sizeof(addr6));
+    addr6.sin6_family = AF_INET6;
+    memcpy(&addr6.sin6_addr, addr[0], 16);
+    addr6.sin6_port = htons(port[0]);
+    res->src.set_addr6(addr6);
+
+    memcpy(&addr6.sin6_addr, addr[1], 16);
+    addr6.sin6_port = htons(port[1]);
+    res->dst.set_addr6(addr6);
+  } else {
+    struct sockaddr_in addr4;
+    memset(&addr4, 0, sizeof(addr4));
+    addr4.sin_family = AF_INET;
+    memcpy(&addr4.sin_addr.s_addr, addr[0], 4);
+    addr4.sin_port = htons(port[0]);
+    res->src.set_addr4(addr4);
+
+    memcpy(&addr4.sin_addr.s_addr, addr[1], 4);
+    addr4.sin_port = htons(port[1]);
+    res->dst.set_addr4(addr4);
   }
 
   return static_cast<int>(size);
 }
 
-static int DecodeV2(const char* data, size_t size, InetAddress* src,
-                    InetAddress* dst) {
+static int VerifyCrc32c(const char* data, size_t size);
+
+/* Length of the v2 address block for the address family in the high nibble
+ * of the fam byte.
+ */
+static size_t V2AddrLen(uint8_t fam) {
+  switch (fam >> 4) {
+    case 0x1: /* AF_INET */
+      return 12;
+    case 0x2: /* AF_INET6 */
+      return 36;
+    case 0x3: /* AF_UNIX */
+      return 216;
+    default: /* AF_UNSPEC */
+      return 0;
+  }
+}
+
+static int DecodeV2(const char* data, size_t size, ProxyProtoResult* res,
+                    int flags) {
   const ProxyProtoHeader* hdr = reinterpret_cast<const ProxyProtoHeader*>(data);
 
   size_t n = 16 + ntohs(hdr->v2.len);
   if (size < n) {
-    return kWrongDataSize;
+    return kNeedMoreData;
   }
 
+  res->version = 2;
   switch (hdr->v2.ver_cmd & 0xF) {
+    /* LOCAL command, the address block is ignored */
+    case 0x00:
+      res->command = PROXYPROTO_CMD_LOCAL;
+      res->transport = PROXYPROTO_TRANSPORT_UNSPEC;
+      res->src.set_unspec();
+      res->dst.set_unspec();
+      break;
+
     /* PROXY command */
-    case 0x01:
-      switch (hdr->v2.fam) {
-        /* TCPv4 */
-        case 0x11: {
+    case 0x01: {
+      res->command = PROXYPROTO_CMD_PROXY;
+
+      /* low nibble: UNSPEC, STREAM or DGRAM */
+      uint8_t transport = hdr->v2.fam & 0xF;
+      if (hdr->v2.fam == 0x00) {
+        res->transport = PROXYPROTO_TRANSPORT_UNSPEC;
+        res->src.set_unspec();
+        res->dst.set_unspec();
+        break;
+      } else if (transport != PROXYPROTO_TRANSPORT_STREAM &&
+                 transport != PROXYPROTO_TRANSPORT_DGRAM) {
+        return kUnknownFamily;
+      }
+      res->transport = transport;
+
+      size_t addr_len = V2AddrLen(hdr->v2.fam);
+      if (addr_len == 0) {
+        return kUnknownFamily;
+      }
+      if (n - 16 < addr_len) {
+        return kWrongDataSize;
+      }
+
+      switch (hdr->v2.fam >> 4) {
+        /* AF_INET */
+        case 0x1: {
           struct sockaddr_in addr;
           memset(&addr, 0, sizeof(addr));
           addr.sin_family = AF_INET;
           addr.sin_addr.s_addr = hdr->v2.addr.ip4.src_addr;
           addr.sin_port = hdr->v2.addr.ip4.src_port;
-          src->set_addr4(addr);
+          res->src.set_addr4(addr);
 
           addr.sin_family = AF_INET;
           addr.sin_addr.s_addr = hdr->v2.addr.ip4.dst_addr;
           addr.sin_port = hdr->v2.addr.ip4.dst_port;
-          dst->set_addr4(addr);
+          res->dst.set_addr4(addr);
         } break;
 
-          /* TCPv6 */
-        case 0x21: {
+          /* AF_INET6 */
+        case 0x2: {
           struct sockaddr_in6 addr;
           memset(&addr, 0, sizeof(addr));
           addr.sin6_family = AF_INET6;
           memcpy(&addr.sin6_addr, hdr->v2.addr.ip6.src_addr, 16);
           addr.sin6_port = hdr->v2.addr.ip6.src_port;
-          src->set_addr6(addr);
+          res->src.set_addr6(addr);
 
           addr.sin6_family = AF_INET6;
           memcpy(&addr.sin6_addr, hdr->v2.addr.ip6.dst_addr, 16);
           addr.sin6_port = hdr->v2.addr.ip6.dst_port;
-          dst->set_addr6(addr);
+          res->dst.set_addr6(addr);
         } break;
 
-        default:
-          return kUnknownFamily;
+          /* AF_UNIX, NUL padded paths of 108 bytes */
+        case 0x3: {
+          struct sockaddr_un addr;
+          static_assert(sizeof(addr.sun_path) == 108, "sun_path size");
+          memset(&addr, 0, sizeof(addr));
+          addr.sun_family = AF_UNIX;
+          memcpy(addr.sun_path, hdr->v2.addr.unx.src_addr, 108);
+          res->src.set_addr_un(addr);
+
+          memcpy(addr.sun_path, hdr->v2.addr.unx.dst_addr, 108);
+          res->dst.set_addr_un(addr);
+        } break;
       }
-      break;
+    } break;
 
-    case 0x00: /* LOCAL command */
     default:
       return kUnknownCommand; /* not a supported command */
   }
 
+  if (flags & PROXYPROTO_VERIFY_CRC32C) {
+    int ret = VerifyCrc32c(data, n);
+    if (ret != 0) return ret;
+  }
+
   return static_cast<int>(n);
 }
 
-int DecodeProxyProto(const char* data, size_t size, InetAddress* src,
-                     InetAddress* dst) {
+int DecodeProxyProto(const char* data, size_t size, ProxyProtoResult* result,
+                     int flags) {
   const ProxyProtoHeader* hdr = reinterpret_cast<const ProxyProtoHeader*>(data);
   if (size >= 16 && memcmp(&hdr->v2, v2sig, sizeof(v2sig)) == 0 &&
       (hdr->v2.ver_cmd & 0xF0) == 0x20) {
-    return DecodeV2(data, size, src, dst);
+    result->ret = DecodeV2(data, size, result, flags);
   } else if (size >= 8 && memcmp(hdr->v1.line, "PROXY", 5) == 0) {
-    return DecodeV1(data, size, src, dst);
+    result->ret = DecodeV1(data, size, result);
   } else {
     if (size >= 16)
-      return kWrongProtocol;
+      result->ret = kWrongProtocol;
     else if (memcmp(&hdr->v2, v2sig, std::min(sizeof(v2sig), size)) == 0)
-      return kNeedMoreData;
-
-    if (size >= 8)
-      return kWrongProtocol;
+      result->ret = kNeedMoreData;
+    else if (size >= 8)
+      result->ret = kWrongProtocol;
     else if (memcmp(hdr->v1.line, "PROXY",
                     std::min(static_cast<size_t>(5), size)) == 0)
-      return kNeedMoreData;
+      result->ret = kNeedMoreData;
+    else
+      result->ret = kWrongProtocol;
+  }
+  return result->ret;
+}
+
+int DecodeProxyProto(const char* data, size_t size, InetAddress* src,
+                     InetAddress* dst, int flags) {
+  ProxyProtoResult result;
+  int ret = DecodeProxyProto(data, size, &result, flags);
+  if (ret > 0) {
+    *src = result.src;
+    *dst = result.dst;
+  }
+  return ret;
+}
 
+int ProxyProtoTlvs::Init(const char* data, size_t size) {
+  const ProxyProtoHeader* hdr = reinterpret_cast<const ProxyProtoHeader*>(data);
+  if (size < 16 || memcmp(&hdr->v2, v2sig, sizeof(v2sig)) != 0 ||
+      (hdr->v2.ver_cmd & 0xF0) != 0x20) {
     return kWrongProtocol;
   }
+
+  size_t len = ntohs(hdr->v2.len);
+  size_t addr_len = V2AddrLen(hdr->v2.fam);
+  if (size < 16 + len || len < addr_len) {
+    return kWrongDataSize;
+  }
+
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+  return Reset(p + 16 + addr_len, p + 16 + len);
+}
+
+int ProxyProtoTlvs::InitSsl(const ProxyProtoTlv& ssl, uint8_t* client,
+                            uint32_t* verify) {
+  /* struct pp2_tlv_ssl { uint8_t client; uint32_t verify; sub-TLVs... } */
+  if (ssl.type != PP2_TYPE_SSL || ssl.length < 5) {
+    return kInvalidTlv;
+  }
+
+  *client = ssl.value[0];
+  uint32_t v;
+  memcpy(&v, ssl.value + 1, sizeof(v));
+  *verify = ntohl(v);
+  return Reset(ssl.value + 5, ssl.value + ssl.length);
+}
+
+/* The checksum covers the whole header with the 4 value bytes of the CRC32C
+ * TLV taken as zero.
+ */
+static int VerifyCrc32c(const char* data, size_t size) {
+  ProxyProtoTlvs tlvs;
+  int ret = tlvs.Init(data, size);
+  if (ret != 0) return ret;
+
+  ProxyProtoTlv tlv;
+  if (!tlvs.Find(PP2_TYPE_CRC32C, &tlv)) return 0;
+  if (tlv.length != 4) return kInvalidTlv;
+
+  static const uint8_t zero[4] = {0, 0, 0, 0};
+  size_t off = reinterpret_cast<const char*>(tlv.value) - data;
+  uint32_t crc = Crc32c(0, data, off);
+  crc = Crc32c(crc, zero, sizeof(zero));
+  crc = Crc32c(crc, tlv.value + 4, size - off - 4);
+
+  uint32_t expected;
+  memcpy(&expected, tlv.value, sizeof(expected));
+  return crc == ntohl(expected) ? 0 : kBadChecksum;
+}
+
+bool ProxyProtoTlvs::Find(uint8_t type, ProxyProtoTlv* tlv) const {
+  for (ProxyProtoTlv t : *this) {
+    if (t.type == type) {
+      *tlv = t;
+      return true;
+    }
+  }
+  return false;
+}
+
+int ProxyProtoTlvs::Reset(const uint8_t* begin, const uint8_t* end) {
+  begin_ = end_ = nullptr;
+
+  /* every TLV header and value must end within [begin, end) */
+  const uint8_t* p = begin;
+  while (p != end) {
+    if (end - p < 3) return kInvalidTlv;
+    size_t len = (static_cast<size_t>(p[1]) << 8) | p[2];
+    if (static_cast<size_t>(end - p - 3) < len) return kInvalidTlv;
+    p += 3 + len;
+  }
+
+  begin_ = begin;
+  end_ = end;
+  return 0;
+}
+
+/* Classification of a block of at most kBatchBlock inputs: bit i is set when
+ * inputs[i] is at least 16 bytes long and starts with the v2 signature and
+ * version, or with "PROXY". Shorter inputs are left to DecodeProxyProto().
+ */
+struct BlockClass {
+  uint32_t v1;
+  uint32_t v2;
+};
+
+typedef BlockClass (*ClassifyBlockFn)(const ProxyProtoSpan* inputs, size_t n);
+
+static const size_t kBatchBlock = 16;
+
+static BlockClass ClassifyBlockScalar(const ProxyProtoSpan* inputs, size_t n) {
+  BlockClass c = {0, 0};
+  for (size_t i = 0; i < n; ++i) {
+    const char* data = inputs[i].data;
+    if (inputs[i].size < 16) continue;
+
+    if (memcmp(data, v2sig, sizeof(v2sig)) == 0 && (data[12] & 0xF0) == 0x20) {
+      c.v2 |= 1u << i;
+    } else if (memcmp(data, "PROXY", 5) == 0) {
+      c.v1 |= 1u << i;
+    }
+  }
+  return c;
+}
+
+#ifdef PROXYPROTO_X86
+/* The first 13 bytes of a v2 header are the signature plus the version in the
+ * high nibble of byte 12, so AND-ing the input with kV2Mask and comparing it
+ * with kV2Pattern checks them in a single compare.
+ */
+#define V2_PATTERN                                                           \
+  0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A, \
+      0x20, 0, 0, 0
+#define V2_MASK -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -16, 0, 0, 0
+#define V1_PATTERN 'P', 'R', 'O', 'X', 'Y', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+
+#ifdef __SSE2__
+static BlockClass ClassifyBlockSse2(const ProxyProtoSpan* inputs, size_t n) {
+  const __m128i v2pat = _mm_setr_epi8(V2_PATTERN);
+  const __m128i v2mask = _mm_setr_epi8(V2_MASK);
+  const __m128i v1pat = _mm_setr_epi8(V1_PATTERN);
+
+  BlockClass c = {0, 0};
+  for (size_t i = 0; i < n; ++i) {
+    if (inputs[i].size < 16) continue;
+
+    __m128i d =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(inputs[i].data));
+    int v2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(d, v2mask), v2pat));
+    int v1 = _mm_movemask_epi8(_mm_cmpeq_epi8(d, v1pat));
+    c.v2 |= static_cast<uint32_t>(v2 == 0xFFFF) << i;
+    c.v1 |= static_cast<uint32_t>((v1 & 0x1F) == 0x1F && v2 != 0xFFFF) << i;
+  }
+  return c;
+}
+#endif
+
+/* Two inputs per 256-bit compare, one in each lane. */
+__attribute__((target("avx2"))) static BlockClass ClassifyBlockAvx2(
+    const ProxyProtoSpan* inputs, size_t n) {
+  const __m256i v2pat =
+      _mm256_broadcastsi128_si256(_mm_setr_epi8(V2_PATTERN));
+  const __m256i v2mask = _mm256_broadcastsi128_si256(_mm_setr_epi8(V2_MASK));
+  const __m256i v1pat = _mm256_broadcastsi128_si256(_mm_setr_epi8(V1_PATTERN));
+
+  BlockClass c = {0, 0};
+  for (size_t i = 0; i < n; i += 2) {
+    bool has_lo = inputs[i].size >= 16;
+    bool has_hi = i + 1 < n && inputs[i + 1].size >= 16;
+    if (!has_lo && !has_hi) continue;
+
+    __m128i lo = has_lo ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                              inputs[i].data))
+                        : _mm_setzero_si128();
+    __m128i hi = has_hi ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                              inputs[i + 1].data))
+                        : _mm_setzero_si128();
+    __m256i d = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+    uint32_t v2 = static_cast<uint32_t>(_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_and_si256(d, v2mask), v2pat)));
+    uint32_t v1 = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(d, v1pat)));
+
+    bool v2_lo = has_lo && (v2 & 0xFFFF) == 0xFFFF;
+    bool v2_hi = has_hi && (v2 >> 16) == 0xFFFF;
+    c.v2 |= (static_cast<uint32_t>(v2_lo) << i) |
+            (static_cast<uint32_t>(v2_hi) << (i + 1));
+    c.v1 |= (static_cast<uint32_t>(has_lo && !v2_lo && (v1 & 0x1F) == 0x1F)
+             << i) |
+            (static_cast<uint32_t>(has_hi && !v2_hi &&
+                                   ((v1 >> 16) & 0x1F) == 0x1F)
+             << (i + 1));
+  }
+  return c;
+}
+
+#undef V2_PATTERN
+#undef V2_MASK
+#undef V1_PATTERN
+#endif
+
+static ClassifyBlockFn SelectClassifyBlock() {
+#ifdef PROXYPROTO_X86
+  // may run before the libgcc constructor that initializes the cpu model
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return ClassifyBlockAvx2;
+#ifdef __SSE2__
+  return ClassifyBlockSse2;
+#endif
+#endif
+  return ClassifyBlockScalar;
+}
+
+static const ClassifyBlockFn g_classify_block = SelectClassifyBlock();
+
+void DecodeProxyProtoBatch(const ProxyProtoSpan* inputs, size_t n,
+                           ProxyProtoResult* out, int flags) {
+  for (size_t base = 0; base < n; base += kBatchBlock) {
+    size_t m = std::min(kBatchBlock, n - base);
+    BlockClass c = g_classify_block(inputs + base, m);
+
+    for (size_t i = 0; i < m; ++i) {
+      const ProxyProtoSpan& in = inputs[base + i];
+      ProxyProtoResult& res = out[base + i];
+      if (c.v2 & (1u << i)) {
+        res.ret = DecodeV2(in.data, in.size, &res, flags);
+      } else if (c.v1 & (1u << i)) {
+        res.ret = DecodeV1(in.data, in.size, &res);
+      } else if (in.size < 16) {
+        DecodeProxyProto(in.data, in.size, &res, flags);
+      } else {
+        res.ret = kWrongProtocol;
+      }
+    }
+  }
+}
+
+int EncodeProxyProtoV1(const InetAddress& src, const InetAddress& dst,
+                       char* out, size_t cap) {
+  /* the longest line is 107 bytes, it is built in place whenever out is big
+   * enough for any line and copied otherwise
+   */
+  char line[108];
+  char* begin = cap >= sizeof(line) ? out : line;
+  char* p = begin;
+
+  if (src.family() == AF_UNSPEC || dst.family() == AF_UNSPEC) {
+    memcpy(p, "PROXY UNKNOWN\r\n", 15);
+    p += 15;
+  } else if (src.family() == AF_INET && dst.family() == AF_INET) {
+    const struct sockaddr_in* s =
+        reinterpret_cast<const struct sockaddr_in*>(src.GetSockAddr());
+    const struct sockaddr_in* d =
+        reinterpret_cast<const struct sockaddr_in*>(dst.GetSockAddr());
+    memcpy(p, "PROXY TCP4 ", 11);
+    p = FormatIpv4(s->sin_addr, p + 11);
+    *p++ = ' ';
+    p = FormatIpv4(d->sin_addr, p);
+    *p++ = ' ';
+    p = FormatU16(ntohs(s->sin_port), p);
+    *p++ = ' ';
+    p = FormatU16(ntohs(d->sin_port), p);
+    *p++ = '\r';
+    *p++ = '\n';
+  } else if (src.family() == AF_INET6 && dst.family() == AF_INET6) {
+    const struct sockaddr_in6* s =
+        reinterpret_cast<const struct sockaddr_in6*>(src.GetSockAddr());
+    const struct sockaddr_in6* d =
+        reinterpret_cast<const struct sockaddr_in6*>(dst.GetSockAddr());
+    memcpy(p, "PROXY TCP6 ", 11);
+    p = FormatIpv6(s->sin6_addr, p + 11, false);
+    *p++ = ' ';
+    p = FormatIpv6(d->sin6_addr, p, false);
+    *p++ = ' ';
+    p = FormatU16(ntohs(s->sin6_port), p);
+    *p++ = ' ';
+    p = FormatU16(ntohs(d->sin6_port), p);
+    *p++ = '\r';
+    *p++ = '\n';
+  } else {
+    return kUnknownFamily;
+  }
+
+  size_t n = p - begin;
+  if (begin == line) {
+    if (n > cap) return kWrongDataSize;
+    memcpy(out, line, n);
+  }
+  return static_cast<int>(n);
+}
+
+int EncodeProxyProtoV2(const InetAddress& src, const InetAddress& dst,
+                       int command, int transport, const ProxyProtoTlv* tlvs,
+                       size_t num_tlvs, int flags, char* out, size_t cap) {
+  uint8_t fam = 0x00;
+  if (command == PROXYPROTO_CMD_PROXY) {
+    if (src.family() == AF_UNSPEC && dst.family() == AF_UNSPEC) {
+      fam = 0x00;
+    } else if (src.family() != dst.family() ||
+               (transport != PROXYPROTO_TRANSPORT_STREAM &&
+                transport != PROXYPROTO_TRANSPORT_DGRAM)) {
+      return kUnknownFamily;
+    } else if (src.family() == AF_INET) {
+      fam = 0x10 | transport;
+    } else if (src.family() == AF_INET6) {
+      fam = 0x20 | transport;
+    } else if (src.family() == AF_UNIX) {
+      fam = 0x30 | transport;
+    } else {
+      return kUnknownFamily;
+    }
+  } else if (command != PROXYPROTO_CMD_LOCAL) {
+    return kUnknownCommand;
+  }
+
+  size_t len = V2AddrLen(fam);
+  for (size_t i = 0; i < num_tlvs; ++i) {
+    len += 3 + tlvs[i].length;
+  }
+  if (flags & PROXYPROTO_ENCODE_CRC32C) {
+    len += 3 + 4;
+  }
+  if (len > 0xFFFF) return kInvalidTlv;
+  if (16 + len > cap) return kWrongDataSize;
+
+  ProxyProtoHeader* hdr = reinterpret_cast<ProxyProtoHeader*>(out);
+  memcpy(hdr->v2.sig, v2sig, sizeof(v2sig));
+  hdr->v2.ver_cmd = static_cast<uint8_t>(0x20 | command);
+  hdr->v2.fam = fam;
+  hdr->v2.len = htons(static_cast<uint16_t>(len));
+
+  switch (fam >> 4) {
+    /* AF_INET */
+    case 0x1: {
+      const struct sockaddr_in* s =
+          reinterpret_cast<const struct sockaddr_in*>(src.GetSockAddr());
+      const struct sockaddr_in* d =
+          reinterpret_cast<const struct sockaddr_in*>(dst.GetSockAddr());
+      hdr->v2.addr.ip4.src_addr = s->sin_addr.s_addr;
+      hdr->v2.addr.ip4.dst_addr = d->sin_addr.s_addr;
+      hdr->v2.addr.ip4.src_port = s->sin_port;
+      hdr->v2.addr.ip4.dst_port = d->sin_port;
+    } break;
+
+      /* AF_INET6 */
+    case 0x2: {
+      const struct sockaddr_in6* s =
+          reinterpret_cast<const struct sockaddr_in6*>(src.GetSockAddr());
+      const struct sockaddr_in6* d =
+          reinterpret_cast<const struct sockaddr_in6*>(dst.GetSockAddr());
+      memcpy(hdr->v2.addr.ip6.src_addr, &s->sin6_addr, 16);
+      memcpy(hdr->v2.addr.ip6.dst_addr, &d->sin6_addr, 16);
+      hdr->v2.addr.ip6.src_port = s->sin6_port;
+      hdr->v2.addr.ip6.dst_port = d->sin6_port;
+    } break;
+
+      /* AF_UNIX, sun_path is copied as is including its NUL padding */
+    case 0x3: {
+      const struct sockaddr_un* s =
+          reinterpret_cast<const struct sockaddr_un*>(src.GetSockAddr());
+      const struct sockaddr_un* d =
+          reinterpret_cast<const struct sockaddr_un*>(dst.GetSockAddr());
+      memcpy(hdr->v2.addr.unx.src_addr, s->sun_path, 108);
+      memcpy(hdr->v2.addr.unx.dst_addr, d->sun_path, 108);
+    } break;
+  }
+
+  uint8_t* p = reinterpret_cast<uint8_t*>(out) + 16 + V2AddrLen(fam);
+  for (size_t i = 0; i < num_tlvs; ++i) {
+    p[0] = tlvs[i].type;
+    p[1] = static_cast<uint8_t>(tlvs[i].length >> 8);
+    p[2] = static_cast<uint8_t>(tlvs[i].length);
+    if (tlvs[i].length > 0) memcpy(p + 3, tlvs[i].value, tlvs[i].length);
+    p += 3 + tlvs[i].length;
+  }
+
+  /* the checksum is computed over the whole header with its own value
+   * zeroed, then stored in network byte order
+   */
+  if (flags & PROXYPROTO_ENCODE_CRC32C) {
+    p[0] = PP2_TYPE_CRC32C;
+    p[1] = 0;
+    p[2] = 4;
+    memset(p + 3, 0, 4);
+    uint32_t crc = htonl(Crc32c(0, out, 16 + len));
+    memcpy(p + 3, &crc, sizeof(crc));
+  }
+
+  return static_cast<int>(16 + len);
+}
+
+int EncodeProxyProtoV2(const ProxyProtoResult& result,
+                       const ProxyProtoTlv* tlvs, size_t num_tlvs, int flags,
+                       char* out, size_t cap) {
+  return EncodeProxyProtoV2(result.src, result.dst, result.command,
+                            result.transport, tlvs, num_tlvs, flags, out, cap);
 }
+
@@ -17,14 +17,226 @@
 
 #include "inet_address.h"
 
+enum ProxyProtoCommand {
+  // 健康检查等由代理自身发起的连接，应使用连接的真实地址
+  PROXYPROTO_CMD_LOCAL = 0x0,
+  PROXYPROTO_CMD_PROXY = 0x1,
+};
+
+enum ProxyProtoTransport {
+  // v2 AF_UNSPEC 或 v1 UNKNOWN，未携带地址
+  PROXYPROTO_TRANSPORT_UNSPEC = 0x0,
+  PROXYPROTO_TRANSPORT_STREAM = 0x1,
+  PROXYPROTO_TRANSPORT_DGRAM = 0x2,
+};
+
+struct ProxyProtoResult {
+  int ret;            // 同 DecodeProxyProto() 返回值
+  uint8_t version;    // 1 或 2
+  uint8_t command;    // ProxyProtoCommand
+  uint8_t transport;  // ProxyProtoTransport
+  // AF_INET/AF_INET6/AF_UNIX，LOCAL 命令或 UNSPEC 时为 AF_UNSPEC
+  InetAddress src;
+  InetAddress dst;
+};
+
+enum ProxyProtoDecodeFlag {
+  // v2 头部携带 PP2_TYPE_CRC32C 时校验，不匹配返回错误
+  PROXYPROTO_VERIFY_CRC32C = 0x1,
+};
+
 /**
  * @brief 解析代理协议
  *
+ * 支持 v1 TCP4/TCP6/UNKNOWN，以及 v2 LOCAL/PROXY 命令下的 UNSPEC、TCP/UDP over
+ * IPv4/IPv6、AF_UNIX stream/dgram。
+ *
+ * @param data 输入数据
+ * @param size 输入数据长度
+ * @param result 输出的版本、命令、传输协议及地址信息，result->ret 同返回值
+ * @param flags ProxyProtoDecodeFlag 按位或
+ * @return int 负值表示错误，0表示数据不足，正值表示解析成功，值为代理数据长度
+ */
+int DecodeProxyProto(const char* data, size_t size, ProxyProtoResult* result,
+                     int flags = 0);
+
+/**
+ * @brief 解析代理协议，只输出地址信息
+ *
  * @param data 输入数据
  * @param size 输入数据长度
  * @param src 输出的来源地址信息
  * @param dst 输出的目的地址信息
+ * @param flags ProxyProtoDecodeFlag 按位或
  * @return int 负值表示错误，0表示数据不足，正值表示解析成功，值为代理数据长度
  */
 int DecodeProxyProto(const char* data, size_t size, InetAddress* src,
-                     InetAddress* dst);
+                     InetAddress* dst, int flags = 0);
+
+struct ProxyProtoSpan {
+  const char* data;
+  size_t size;
+};
+
+/**
+ * @brief 批量解析代理协议
+ *
+ * 以 16 个输入为一组，使用 SSE2/AVX2（运行时按 CPU 特性选择，其他平台退化为
+ * 标量实现）比对 v2 签名与 v1 前缀完成分类，再逐个解析。结果与逐个调用
+ * DecodeProxyProto() 完全一致。
+ *
+ * @param inputs 输入数据数组
+ * @param n 输入个数
+ * @param out 输出结果数组，长度不小于 n
+ * @param flags ProxyProtoDecodeFlag 按位或
+ */
+void DecodeProxyProtoBatch(const ProxyProtoSpan* inputs, size_t n,
+                           ProxyProtoResult* out, int flags = 0);
+
+enum ProxyProtoTlvType {
+  PP2_TYPE_ALPN = 0x01,
+  PP2_TYPE_AUTHORITY = 0x02,
+  PP2_TYPE_CRC32C = 0x03,
+  PP2_TYPE_NOOP = 0x04,
+  PP2_TYPE_UNIQUE_ID = 0x05,
+  PP2_TYPE_SSL = 0x20,
+  PP2_SUBTYPE_SSL_VERSION = 0x21,
+  PP2_SUBTYPE_SSL_CN = 0x22,
+  PP2_SUBTYPE_SSL_CIPHER = 0x23,
+  PP2_SUBTYPE_SSL_SIG_ALG = 0x24,
+  PP2_SUBTYPE_SSL_KEY_ALG = 0x25,
+  PP2_TYPE_NETNS = 0x30,
+};
+
+struct ProxyProtoTlv {
+  uint8_t type;
+  uint16_t length;
+  const uint8_t* value;  // 指向输入数据内部
+};
+
+/**
+ * @brief PROXY v2 TLV 视图
+ *
+ * 在原始头部上就地遍历 TLV，不拷贝数据。Init() 一次性校验全部 TLV 的边界，之后
+ * 的遍历按需解码每个 TLV 且不再做检查。DecodeProxyProto() 不解析 TLV，不使用本
+ * 视图的调用方没有额外开销。
+ *
+ *   ProxyProtoTlvs tlvs;
+ *   if (tlvs.Init(data, ret) == 0) {
+ *     for (ProxyProtoTlv tlv : tlvs) { ... }
+ *   }
+ */
+class ProxyProtoTlvs {
+ public:
+  class Iterator {
+   public:
+    explicit Iterator(const uint8_t* p) : p_(p) {}
+    ProxyProtoTlv operator*() const {
+      ProxyProtoTlv tlv = {p_[0], static_cast<uint16_t>((p_[1] << 8) | p_[2]),
+                           p_ + 3};
+      return tlv;
+    }
+    Iterator& operator++() {
+      p_ += 3 + ((p_[1] << 8) | p_[2]);
+      return *this;
+    }
+    bool operator!=(const Iterator& other) const { return p_ != other.p_; }
+
+   private:
+    const uint8_t* p_;
+  };
+
+  ProxyProtoTlvs() : begin_(nullptr), end_(nullptr) {}
+
+  /**
+   * @brief 定位 v2 头部中地址块之后的 TLV 区域并校验边界
+   *
+   * @param data 输入数据
+   * @param size 输入数据长度，不小于头部长度即可
+   * @return int 0 表示成功，负值表示不是完整的 v2 头部或 TLV 越界
+   */
+  int Init(const char* data, size_t size);
+
+  /**
+   * @brief 将视图切换到 PP2_TYPE_SSL 的子 TLV 并校验边界
+   *
+   * @param ssl 类型为 PP2_TYPE_SSL 的 TLV
+   * @param client 输出的 PP2_CLIENT_* 标志位
+   * @param verify 输出的证书校验结果，0 表示成功
+   * @return int 0 表示成功，负值表示格式错误
+   */
+  int InitSsl(const ProxyProtoTlv& ssl, uint8_t* client, uint32_t* verify);
+
+  /**
+   * @brief 查找第一个指定类型的 TLV
+   *
+   * @return bool 找到时返回 true 并填充 tlv
+   */
+  bool Find(uint8_t type, ProxyProtoTlv* tlv) const;
+
+  Iterator begin() const { return Iterator(begin_); }
+  Iterator end() const { return Iterator(end_); }
+  bool empty() const { return begin_ == end_; }
+  // 视图内 TLV 的原始字节
+  const uint8_t* data() const { return begin_; }
+  size_t size() const { return static_cast<size_t>(end_ - begin_); }
+
+ private:
+  int Reset(const uint8_t* begin, const uint8_t* end);
+
+  const uint8_t* begin_;
+  const uint8_t* end_;
+};
+
+enum ProxyProtoEncodeFlag {
+  // 追加 PP2_TYPE_CRC32C，校验和覆盖整个头部
+  PROXYPROTO_ENCODE_CRC32C = 0x1,
+};
+
+/**
+ * @brief 编码 v1 头部
+ *
+ * 两端均为 AF_INET 时输出 TCP4，均为 AF_INET6 时输出 TCP6，任一端为 AF_UNSPEC 时
+ * 输出 UNKNOWN。不分配内存，out 容量不小于 108 时直接写入 out。
+ *
+ * @param src 来源地址
+ * @param dst 目的地址
+ * @param out 输出缓冲区
+ * @param cap 输出缓冲区长度
+ * @return int 正值为写入长度，负值表示地址族不支持或 out 空间不足
+ */
+int EncodeProxyProtoV1(const InetAddress& src, const InetAddress& dst,
+                       char* out, size_t cap);
+
+/**
+ * @brief 编码 v2 头部
+ *
+ * LOCAL 命令及 AF_UNSPEC 地址不输出地址块，其他情况两端地址族必须一致。TLV 按
+ * 顺序写在地址块之后（如 PP2_TYPE_ALPN、PP2_TYPE_AUTHORITY），指定
+ * PROXYPROTO_ENCODE_CRC32C 时最后追加 PP2_TYPE_CRC32C。不分配内存。
+ *
+ * @param src 来源地址
+ * @param dst 目的地址
+ * @param command ProxyProtoCommand
+ * @param transport ProxyProtoTransport
+ * @param tlvs 附加的 TLV，可为 nullptr
+ * @param num_tlvs TLV 个数
+ * @param flags ProxyProtoEncodeFlag 按位或
+ * @param out 输出缓冲区
+ * @param cap 输出缓冲区长度
+ * @return int 正值为写入长度，负值表示参数错误或 out 空间不足
+ */
+int EncodeProxyProtoV2(const InetAddress& src, const InetAddress& dst,
+                       int command, int transport, const ProxyProtoTlv* tlvs,
+                       size_t num_tlvs, int flags, char* out, size_t cap);
+
+/**
+ * @brief 将解析结果重新编码为 v2 头部，如把 v1 头部转换为 v2
+ *
+ * 只保留命令、传输协议及地址，原头部的 TLV 需通过 tlvs 重新传入。
+ *
+ * @return int 同 EncodeProxyProtoV2()
+ */
+int EncodeProxyProtoV2(const ProxyProtoResult& result,
+                       const ProxyProtoTlv* tlvs, size_t num_tlvs, int flags,
+                       char* out, size_t cap);
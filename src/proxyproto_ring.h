@@ -0,0 +1,209 @@
+/**
+ * @file proxyproto_ring.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-29
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+/* The layout of the connection record ring proxyproto-server publishes with
+ * --export-ring, and a reader for it. Plain C with GCC/Clang atomics, so that
+ * consumers need nothing but this file.
+ *
+ * The shared memory object holds a header, then one ring per reactor. Each
+ * ring has a single producer and any number of readers, which only map the
+ * object read-only and never write to it:
+ *
+ *   struct pp_ring_header   64 bytes
+ *   ring 0                  pp_ring_header.ring_size bytes
+ *     uint64_t head         records published so far, padded to 64 bytes
+ *     struct pp_ring_record records[capacity]
+ *   ring 1 ...
+ *
+ * Record n of a ring lives in slot n % capacity. Its seq is 0 while the
+ * producer writes it and n + 1 once complete; a reader that finds any other
+ * value, before or after copying, has been overrun and counts the record as
+ * lost.
+ */
+
+#ifndef PROXYPROTO_RING_H
+#define PROXYPROTO_RING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PP_RING_MAGIC 0x47525050u /* "PPRG" */
+#define PP_RING_LAYOUT 1
+#define PP_RING_HEAD_SIZE 64
+
+struct pp_ring_header {
+  uint32_t magic;
+  uint16_t layout;
+  uint16_t record_size;
+  uint32_t num_rings;
+  /* records per ring, a power of two */
+  uint32_t capacity;
+  /* from the start of the mapping to ring 0, and from one ring to the next */
+  uint64_t ring_offset;
+  uint64_t ring_size;
+  /* CLOCK_REALTIME nanoseconds, tells a restarted server from the old one */
+  uint64_t created_ns;
+  uint32_t pid;
+  /* set once the server has stopped publishing */
+  uint32_t closed;
+  uint8_t reserved[16];
+};
+
+/* an IPv4 address takes the first 4 bytes of addr, an AF_UNIX one none */
+struct pp_ring_addr {
+  uint8_t addr[16];
+  /* network byte order */
+  uint16_t port;
+  /* AF_INET, AF_INET6, AF_UNIX or AF_UNSPEC */
+  uint8_t family;
+  uint8_t reserved;
+};
+
+struct pp_ring_record {
+  uint64_t seq;
+  /* CLOCK_REALTIME nanoseconds when the header was decoded */
+  uint64_t time_ns;
+  /* client socket and listen port on the server */
+  int32_t fd;
+  uint16_t local_port;
+  uint16_t reactor;
+  /* 1 or 2, PROXY 1 / LOCAL 0, UNSPEC 0 / STREAM 1 / DGRAM 2 */
+  uint8_t version;
+  uint8_t command;
+  uint8_t transport;
+  uint8_t reserved0;
+  /* bytes of the v2 TLVs within the header, and their CRC32C, 0 without */
+  uint16_t tlv_len;
+  uint16_t reserved1;
+  uint32_t tlv_crc32c;
+  /* bytes of the header */
+  uint32_t header_len;
+  /* the connected peer, usually a load balancer, and the header addresses */
+  struct pp_ring_addr peer;
+  struct pp_ring_addr src;
+  struct pp_ring_addr dst;
+  uint8_t reserved2[28];
+};
+
+struct pp_ring_map {
+  const struct pp_ring_header* header;
+  size_t size;
+};
+
+/* Maps the shared memory object NAME read-only, as in "/proxyproto".
+ * Returns 0, or a negative errno value, -EPROTO for an unknown layout.
+ */
+static inline int pp_ring_open(const char* name, struct pp_ring_map* map) {
+  map->header = NULL;
+  map->size = 0;
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd == -1) return -errno;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  size_t size = (size_t)st.st_size;
+  void* p = MAP_FAILED;
+  int err = -EPROTO;
+  if (size >= sizeof(struct pp_ring_header)) {
+    p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    err = p == MAP_FAILED ? -errno : 0;
+  }
+  close(fd);
+  if (err != 0) return err;
+
+  const struct pp_ring_header* h = (const struct pp_ring_header*)p;
+  if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != PP_RING_MAGIC ||
+      h->layout != PP_RING_LAYOUT ||
+      h->record_size != sizeof(struct pp_ring_record) || h->capacity == 0 ||
+      (h->capacity & (h->capacity - 1)) != 0 ||
+      h->ring_offset + (uint64_t)h->num_rings * h->ring_size > size) {
+    munmap(p, size);
+    return -EPROTO;
+  }
+  map->header = h;
+  map->size = size;
+  return 0;
+}
+
+static inline void pp_ring_close(struct pp_ring_map* map) {
+  if (map->header != NULL) {
+    munmap((void*)map->header, map->size);
+    map->header = NULL;
+  }
+}
+
+static inline const uint64_t* pp_ring_head(const struct pp_ring_map* map,
+                                           uint32_t ring) {
+  return (const uint64_t*)((const char*)map->header +
+                           map->header->ring_offset +
+                           ring * map->header->ring_size);
+}
+
+/* The number of records ring has published, a cursor starting there reads
+ * only what comes next.
+ */
+static inline uint64_t pp_ring_tail(const struct pp_ring_map* map,
+                                    uint32_t ring) {
+  return __atomic_load_n(pp_ring_head(map, ring), __ATOMIC_ACQUIRE);
+}
+
+/* Copies the record at *cursor of ring into out and advances the cursor.
+ * Records overwritten before they could be read are skipped and added to
+ * *lost. Returns 1 with a record, 0 when the cursor has caught up.
+ */
+static inline int pp_ring_read(const struct pp_ring_map* map, uint32_t ring,
+                               uint64_t* cursor, struct pp_ring_record* out,
+                               uint64_t* lost) {
+  const uint64_t* head = pp_ring_head(map, ring);
+  const struct pp_ring_record* records =
+      (const struct pp_ring_record*)((const char*)head + PP_RING_HEAD_SIZE);
+  uint64_t capacity = map->header->capacity;
+  for (;;) {
+    uint64_t end = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    if (*cursor >= end) return 0;
+    if (end - *cursor > capacity) {
+      *lost += end - capacity - *cursor;
+      *cursor = end - capacity;
+    }
+
+    const struct pp_ring_record* slot = &records[*cursor & (capacity - 1)];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    const uint64_t* src = (const uint64_t*)slot;
+    uint64_t* dst = (uint64_t*)out;
+    for (size_t i = 0; i < sizeof(*out) / 8; ++i) {
+      dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t again = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    ++*cursor;
+    if (seq == *cursor && again == seq) return 1;
+    ++*lost;
+  }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROXYPROTO_RING_H */
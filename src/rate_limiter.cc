@@ -0,0 +1,205 @@
+/**
+ * @file rate_limiter.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-28
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "rate_limiter.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cstring>
+
+// thousandths of a token per token
+static const uint64_t kTokenScale = 1000;
+// slots the clock hand passes per eviction at most. Entries holding
+// connections cannot go, with as many connections as entries a full sweep
+// would cost every new address O(capacity) on the reactor thread.
+static const size_t kEvictProbes = 64;
+
+static uint64_t Mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return x;
+}
+
+RateLimiter::RateLimiter()
+    : mask_(0),
+      size_(0),
+      max_entries_(0),
+      hand_(0),
+      seed_(0),
+      rate_(0),
+      max_conns_(0) {}
+
+void RateLimiter::Init(uint32_t rate, uint32_t max_conns, size_t max_entries,
+                       uint64_t seed) {
+  rate_ = rate;
+  max_conns_ = max_conns;
+  seed_ = seed;
+  size_ = 0;
+  hand_ = 0;
+  slots_.clear();
+  if ((rate == 0 && max_conns == 0) || max_entries == 0) {
+    max_entries_ = 0;
+    mask_ = 0;
+    return;
+  }
+
+  // at most half full, probe sequences stay short
+  size_t capacity = 16;
+  while (capacity < max_entries * 2) {
+    capacity *= 2;
+  }
+  max_entries_ = max_entries;
+  mask_ = capacity - 1;
+  Entry empty;
+  memset(&empty, 0, sizeof(empty));
+  slots_.assign(capacity, empty);
+}
+
+bool RateLimiter::MakeKey(const struct sockaddr* addr, RateKey* key) {
+  if (addr->sa_family == AF_INET) {
+    const struct sockaddr_in* in =
+        reinterpret_cast<const struct sockaddr_in*>(addr);
+    key->hi = 0;
+    key->lo = 0xFFFF00000000ULL | ntohl(in->sin_addr.s_addr);
+    return true;
+  }
+  if (addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6* in6 =
+        reinterpret_cast<const struct sockaddr_in6*>(addr);
+    uint64_t words[2];
+    memcpy(words, in6->sin6_addr.s6_addr, 16);
+    key->hi = be64toh(words[0]);
+    key->lo = be64toh(words[1]);
+    return true;
+  }
+  return false;
+}
+
+size_t RateLimiter::Home(const RateKey& key) const {
+  return static_cast<size_t>(Mix(Mix(key.hi ^ seed_) ^ key.lo)) & mask_;
+}
+
+RateLimiter::Entry* RateLimiter::Find(const RateKey& key) {
+  for (size_t i = Home(key);; i = (i + 1) & mask_) {
+    Entry* e = &slots_[i];
+    if (!e->used) return nullptr;
+    if (e->key == key) return e;
+  }
+}
+
+RateLimiter::Entry* RateLimiter::Insert(const RateKey& key, uint64_t now_ms) {
+  if (size_ >= max_entries_ && !Evict()) {
+    return nullptr;
+  }
+
+  size_t i = Home(key);
+  while (slots_[i].used) {
+    i = (i + 1) & mask_;
+  }
+  Entry* e = &slots_[i];
+  e->key = key;
+  e->refill_ms = now_ms;
+  e->tokens = static_cast<uint64_t>(rate_) * kTokenScale;
+  e->conns = 0;
+  e->used = true;
+  e->referenced = false;
+  ++size_;
+  return e;
+}
+
+bool RateLimiter::Evict() {
+  // the hand resumes where it stopped, later calls go on clearing
+  // reference bits. The table is at most half full, the probes see some 32
+  // entries.
+  size_t probes = std::min(kEvictProbes, 2 * slots_.size());
+  for (size_t n = 0; n < probes; ++n) {
+    size_t i = hand_;
+    hand_ = (hand_ + 1) & mask_;
+    Entry* e = &slots_[i];
+    if (!e->used || e->conns > 0) continue;
+    if (e->referenced) {
+      e->referenced = false;
+      continue;
+    }
+    Erase(i);
+    return true;
+  }
+  return false;
+}
+
+void RateLimiter::Erase(size_t slot) {
+  // backward shift: later entries of the probe run move up into the hole
+  // unless that would put them before their home slot
+  size_t j = slot;
+  for (;;) {
+    j = (j + 1) & mask_;
+    if (!slots_[j].used) break;
+    size_t home = Home(slots_[j].key);
+    if (((j - home) & mask_) >= ((j - slot) & mask_)) {
+      slots_[slot] = slots_[j];
+      slot = j;
+    }
+  }
+  slots_[slot].used = false;
+  --size_;
+}
+
+int RateLimiter::Acquire(const RateKey& key, uint64_t now_ms, bool* held) {
+  *held = false;
+  // only addresses seen again earn a second chance, a scan over many new
+  // ones evicts its own entries first
+  Entry* e = Find(key);
+  if (e != nullptr) {
+    e->referenced = true;
+  } else {
+    e = Insert(key, now_ms);
+    if (e == nullptr) {
+      return RATE_LIMIT_UNTRACKED;
+    }
+  }
+
+  if (max_conns_ != 0 && e->conns >= max_conns_) {
+    return RATE_LIMIT_CONNS;
+  }
+
+  if (rate_ != 0) {
+    uint64_t burst = static_cast<uint64_t>(rate_) * kTokenScale;
+    if (now_ms > e->refill_ms) {
+      // one thousandth of a token per millisecond for each token a second
+      e->tokens = std::min(burst, e->tokens + (now_ms - e->refill_ms) * rate_);
+      e->refill_ms = now_ms;
+    }
+    if (e->tokens < kTokenScale) {
+      return RATE_LIMIT_RATE;
+    }
+    e->tokens -= kTokenScale;
+  }
+
+  if (max_conns_ != 0) {
+    ++e->conns;
+    *held = true;
+  }
+  return RATE_LIMIT_ADMITTED;
+}
+
+void RateLimiter::Release(const RateKey& key) {
+  // entries holding connections are never evicted
+  Entry* e = Find(key);
+  if (e != nullptr && e->conns > 0) {
+    --e->conns;
+  }
+}
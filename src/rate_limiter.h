@@ -0,0 +1,119 @@
+/**
+ * @file rate_limiter.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-28
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+// an IPv6 address in two big-endian words, IPv4 as its mapped form
+struct RateKey {
+  uint64_t hi;
+  uint64_t lo;
+
+  bool operator==(const RateKey& other) const {
+    return hi == other.hi && lo == other.lo;
+  }
+};
+
+enum RateLimitResult {
+  RATE_LIMIT_ADMITTED = 0,
+  // admitted, but the table was full and the entries the clock hand passed
+  // were recently used or held connections
+  RATE_LIMIT_UNTRACKED = 1,
+  // out of tokens for new connections
+  RATE_LIMIT_RATE = 2,
+  // at the concurrent connection limit
+  RATE_LIMIT_CONNS = 3,
+};
+
+/**
+ * @brief 按地址限制新建连接速率与并发连接数
+ *
+ * 每个地址一个令牌桶，每秒补充 rate 个令牌，最多积累 rate 个。地址保存在线性
+ * 探测的开放寻址哈希表中，条目数不超过 max_entries，表满时按 clock 算法淘汰
+ * 最近未被访问、且没有在途连接的地址，每次淘汰至多检查固定个数的槽位。不加锁，
+ * 每个 reactor 各有一份。
+ */
+class RateLimiter {
+ public:
+  RateLimiter();
+
+  RateLimiter(const RateLimiter&) = delete;
+  RateLimiter& operator=(const RateLimiter&) = delete;
+
+  /**
+   * @brief 设置限制并分配哈希表，两个限制都为 0 时不分配
+   *
+   * @param rate 每秒允许的新连接数，0 不限
+   * @param max_conns 并发连接数，0 不限
+   * @param max_entries 最多记录的地址数
+   * @param seed 哈希种子，使对端无法预知冲突
+   */
+  void Init(uint32_t rate, uint32_t max_conns, size_t max_entries,
+            uint64_t seed);
+
+  bool enabled() const { return !slots_.empty(); }
+
+  /**
+   * @brief AF_INET 或 AF_INET6 地址转为键，其他协议族返回 false
+   */
+  static bool MakeKey(const struct sockaddr* addr, RateKey* key);
+
+  /**
+   * @brief 为 key 的一个新连接取令牌与并发名额
+   *
+   * @param now_ms 单调时钟毫秒数
+   * @param held 占用了并发名额时置为 true，连接结束时须 Release()
+   * @return RateLimitResult，RATE_LIMIT_ADMITTED 与 RATE_LIMIT_UNTRACKED 为放行
+   */
+  int Acquire(const RateKey& key, uint64_t now_ms, bool* held);
+
+  // 归还 Acquire() 占用的并发名额
+  void Release(const RateKey& key);
+
+  // 已记录的地址数
+  size_t size() const { return size_; }
+  // 哈希表的字节数
+  size_t memory() const { return slots_.size() * sizeof(Entry); }
+
+ private:
+  struct Entry {
+    RateKey key;
+    // when tokens was last brought up to date
+    uint64_t refill_ms;
+    // in thousandths of a token
+    uint64_t tokens;
+    uint32_t conns;
+    bool used;
+    // touched since the clock hand last passed
+    bool referenced;
+  };
+
+  size_t Home(const RateKey& key) const;
+  Entry* Find(const RateKey& key);
+  Entry* Insert(const RateKey& key, uint64_t now_ms);
+  bool Evict();
+  void Erase(size_t slot);
+
+  std::vector<Entry> slots_;
+  size_t mask_;
+  size_t size_;
+  size_t max_entries_;
+  // the clock hand, a slot index
+  size_t hand_;
+  uint64_t seed_;
+  uint32_t rate_;
+  uint32_t max_conns_;
+};
@@ -0,0 +1,310 @@
+/**
+ * @file record_file.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-30
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "record_file.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+// columns start on a boundary of the smallest page size, whatever the page
+// size of the writer
+static const uint64_t kColumnAlign = 4096;
+// records between two ReleasePages() calls
+static const uint32_t kReleaseRecords = 8192;
+
+static const uint8_t kColumnWidths[RECORD_NUM_COLUMNS] = {8, 8, 8, 8, 8,
+                                                          2, 2, 1, 1, 1};
+
+static_assert(sizeof(RecordSegmentHeader) <= kColumnAlign,
+              "RecordSegmentHeader fits its page");
+
+size_t RecordColumnWidth(int c) { return kColumnWidths[c]; }
+
+static uint64_t AlignUp(uint64_t n, uint64_t align) {
+  return (n + align - 1) / align * align;
+}
+
+// fills offsets for the largest capacity within segment_bytes, returns the
+// file size
+static uint64_t Layout(uint64_t segment_bytes, uint32_t* capacity,
+                       uint64_t offsets[RECORD_NUM_COLUMNS]) {
+  uint64_t record_bytes = 0;
+  for (int c = 0; c < RECORD_NUM_COLUMNS; ++c) {
+    record_bytes += kColumnWidths[c];
+  }
+  // a page for the header, and at most one of padding per column
+  uint64_t overhead = kColumnAlign * (1 + RECORD_NUM_COLUMNS);
+  uint64_t n = segment_bytes > overhead
+                   ? (segment_bytes - overhead) / record_bytes
+                   : 0;
+  *capacity = static_cast<uint32_t>(n < UINT32_MAX ? n : UINT32_MAX);
+
+  uint64_t offset = kColumnAlign;
+  for (int c = 0; c < RECORD_NUM_COLUMNS; ++c) {
+    offsets[c] = offset;
+    offset += AlignUp(static_cast<uint64_t>(*capacity) * kColumnWidths[c],
+                      kColumnAlign);
+  }
+  return offset;
+}
+
+uint8_t SetRecordAddress(const InetAddress& addr, uint64_t words[2],
+                         uint16_t* port) {
+  const struct sockaddr* sa = addr.GetSockAddr();
+  if (sa->sa_family == AF_INET) {
+    const struct sockaddr_in* in =
+        reinterpret_cast<const struct sockaddr_in*>(sa);
+    words[0] = 0;
+    words[1] = 0xFFFF00000000ULL | ntohl(in->sin_addr.s_addr);
+    *port = ntohs(in->sin_port);
+  } else if (sa->sa_family == AF_INET6) {
+    const struct sockaddr_in6* in6 =
+        reinterpret_cast<const struct sockaddr_in6*>(sa);
+    memcpy(words, in6->sin6_addr.s6_addr, 16);
+    words[0] = be64toh(words[0]);
+    words[1] = be64toh(words[1]);
+    *port = ntohs(in6->sin6_port);
+  } else {
+    words[0] = words[1] = 0;
+    *port = 0;
+  }
+  return static_cast<uint8_t>(sa->sa_family);
+}
+
+RecordSegment::RecordSegment() : base_(nullptr), header_(nullptr), size_(0) {}
+
+RecordSegment::~RecordSegment() { Close(); }
+
+int RecordSegment::Open(const char* path) {
+  Close();
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return -errno;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  if (size < kColumnAlign) {
+    close(fd);
+    return -EPROTO;
+  }
+  void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  int err = p == MAP_FAILED ? -errno : 0;
+  close(fd);
+  if (err != 0) return err;
+
+  const RecordSegmentHeader* h = static_cast<const RecordSegmentHeader*>(p);
+  bool valid = __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) ==
+                   PP_SEGMENT_MAGIC &&
+               h->layout == PP_SEGMENT_LAYOUT;
+  for (int c = 0; valid && c < RECORD_NUM_COLUMNS; ++c) {
+    valid = h->offsets[c] >= kColumnAlign &&
+            h->offsets[c] + static_cast<uint64_t>(h->capacity) *
+                                kColumnWidths[c] <=
+                size;
+  }
+  if (!valid) {
+    munmap(p, size);
+    return -EPROTO;
+  }
+  // queries read each column once from front to back
+  madvise(p, size, MADV_SEQUENTIAL);
+  base_ = static_cast<const char*>(p);
+  header_ = h;
+  size_ = size;
+  return 0;
+}
+
+void RecordSegment::Close() {
+  if (base_ != nullptr) {
+    munmap(const_cast<char*>(base_), size_);
+    base_ = nullptr;
+    header_ = nullptr;
+    size_ = 0;
+  }
+}
+
+RecordWriter::RecordWriter()
+    : reactor_(0),
+      segment_bytes_(0),
+      rotate_ns_(0),
+      capacity_(0),
+      offsets_(),
+      page_size_(static_cast<size_t>(sysconf(_SC_PAGESIZE))),
+      fd_(-1),
+      base_(nullptr),
+      header_(nullptr),
+      count_(0),
+      released_(0),
+      rotate_at_ns_(0),
+      retry_ns_(0),
+      segments_(0) {}
+
+RecordWriter::~RecordWriter() { Close(); }
+
+void RecordWriter::Init(const std::string& dir, int reactor,
+                        uint64_t segment_bytes, int rotate_sec) {
+  Close();
+  dir_ = dir;
+  reactor_ = reactor;
+  segment_bytes_ = Layout(segment_bytes, &capacity_, offsets_);
+  rotate_ns_ = static_cast<uint64_t>(rotate_sec) * 1000000000;
+  retry_ns_ = 0;
+}
+
+int RecordWriter::OpenSegment(uint64_t now_ns) {
+  time_t sec = static_cast<time_t>(now_ns / 1000000000);
+  struct tm tm;
+  gmtime_r(&sec, &tm);
+  char when[32];
+  strftime(when, sizeof(when), "%Y%m%dT%H%M%SZ", &tm);
+  char name[96];
+  snprintf(name, sizeof(name), "/proxyproto-%s-%09u-r%d.seg", when,
+           static_cast<unsigned>(now_ns % 1000000000), reactor_);
+  std::string path = dir_ + name;
+
+  int fd = open(path.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+  if (fd == -1) return -errno;
+  // blocks are allocated up front, running out of space fails here rather
+  // than as SIGBUS on a store to the mapping
+  int err = fallocate(fd, 0, 0, static_cast<off_t>(segment_bytes_));
+  if (err != 0 && errno == EOPNOTSUPP) {
+    err = ftruncate(fd, static_cast<off_t>(segment_bytes_));
+  }
+  void* p = MAP_FAILED;
+  if (err == 0) {
+    p = mmap(nullptr, segment_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+             0);
+  }
+  if (p == MAP_FAILED) {
+    err = -errno;
+    close(fd);
+    unlink(path.c_str());
+    return err;
+  }
+
+  RecordSegmentHeader* h = static_cast<RecordSegmentHeader*>(p);
+  h->layout = PP_SEGMENT_LAYOUT;
+  h->reactor = static_cast<uint16_t>(reactor_);
+  h->capacity = capacity_;
+  h->count = 0;
+  h->created_ns = now_ns;
+  h->min_ns = UINT64_MAX;
+  h->max_ns = 0;
+  h->sealed = 0;
+  h->pid = static_cast<uint32_t>(getpid());
+  memcpy(h->offsets, offsets_, sizeof(offsets_));
+  // readers check the magic first, it goes in last
+  __atomic_store_n(&h->magic, PP_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+
+  fd_ = fd;
+  base_ = static_cast<char*>(p);
+  header_ = h;
+  count_ = 0;
+  released_ = 0;
+  rotate_at_ns_ = rotate_ns_ != 0 ? now_ns + rotate_ns_ : UINT64_MAX;
+  ++segments_;
+  return 0;
+}
+
+void RecordWriter::SealSegment(bool sync) {
+  __atomic_store_n(&header_->sealed, 1, __ATOMIC_RELEASE);
+  if (sync) {
+    msync(base_, segment_bytes_, MS_SYNC);
+  } else {
+    // starts writeback without waiting for it, the reactor keeps serving
+    sync_file_range(fd_, 0, 0, SYNC_FILE_RANGE_WRITE);
+  }
+  munmap(base_, segment_bytes_);
+  close(fd_);
+  fd_ = -1;
+  base_ = nullptr;
+  header_ = nullptr;
+}
+
+void RecordWriter::ReleasePages() {
+  // the page cache keeps dirty pages until they are written back, dropping
+  // them from the mapping loses nothing and keeps the RSS flat
+  for (int c = 0; c < RECORD_NUM_COLUMNS; ++c) {
+    uint64_t begin = (offsets_[c] + static_cast<uint64_t>(released_) *
+                                        kColumnWidths[c]) /
+                     page_size_ * page_size_;
+    uint64_t end =
+        (offsets_[c] + static_cast<uint64_t>(count_) * kColumnWidths[c]) /
+        page_size_ * page_size_;
+    if (end > begin) {
+      msync(base_ + begin, end - begin, MS_ASYNC);
+      madvise(base_ + begin, end - begin, MADV_DONTNEED);
+    }
+  }
+  released_ = count_;
+}
+
+template <typename T>
+static void Store(char* base, uint64_t offset, uint32_t i, T value) {
+  reinterpret_cast<T*>(base + offset)[i] = value;
+}
+
+int RecordWriter::Append(const ConnRecord& record) {
+  if (base_ != nullptr &&
+      (count_ == capacity_ || record.time_ns >= rotate_at_ns_)) {
+    SealSegment(false);
+  }
+  if (base_ == nullptr) {
+    if (record.time_ns < retry_ns_) return -EAGAIN;
+    int err = OpenSegment(record.time_ns);
+    if (err != 0) {
+      retry_ns_ = record.time_ns + 1000000000;
+      return err;
+    }
+  }
+
+  uint32_t i = count_;
+  Store(base_, offsets_[RECORD_TIME], i, record.time_ns);
+  Store(base_, offsets_[RECORD_SRC_HI], i, record.src[0]);
+  Store(base_, offsets_[RECORD_SRC_LO], i, record.src[1]);
+  Store(base_, offsets_[RECORD_DST_HI], i, record.dst[0]);
+  Store(base_, offsets_[RECORD_DST_LO], i, record.dst[1]);
+  Store(base_, offsets_[RECORD_SRC_PORT], i, record.src_port);
+  Store(base_, offsets_[RECORD_DST_PORT], i, record.dst_port);
+  Store(base_, offsets_[RECORD_FAMILY], i, record.family);
+  Store(base_, offsets_[RECORD_VERSION], i, record.version);
+  Store(base_, offsets_[RECORD_ERROR], i, record.error);
+  if (record.time_ns < header_->min_ns) {
+    __atomic_store_n(&header_->min_ns, record.time_ns, __ATOMIC_RELAXED);
+  }
+  if (record.time_ns > header_->max_ns) {
+    __atomic_store_n(&header_->max_ns, record.time_ns, __ATOMIC_RELAXED);
+  }
+  ++count_;
+  __atomic_store_n(&header_->count, count_, __ATOMIC_RELEASE);
+
+  if (count_ - released_ >= kReleaseRecords) {
+    ReleasePages();
+  }
+  return 0;
+}
+
+void RecordWriter::Close() {
+  if (base_ != nullptr) {
+    SealSegment(true);
+  }
+}
@@ -0,0 +1,206 @@
+/**
+ * @file record_file.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-30
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "inet_address.h"
+
+/* A segment file of --record-dir holds one page of RecordSegmentHeader, then
+ * one array per column, each starting on a page boundary:
+ *
+ *   time_ns  uint64_t[capacity]   CLOCK_REALTIME nanoseconds
+ *   src_hi   uint64_t[capacity]   addresses as two host order words of the
+ *   src_lo   uint64_t[capacity]   IPv6 address, IPv4 in its mapped form
+ *   dst_hi   uint64_t[capacity]   ::ffff:a.b.c.d
+ *   dst_lo   uint64_t[capacity]
+ *   src_port uint16_t[capacity]   host order
+ *   dst_port uint16_t[capacity]
+ *   family   uint8_t[capacity]    AF_INET, AF_INET6, AF_UNIX or AF_UNSPEC
+ *   version  uint8_t[capacity]    1 or 2, 0 when decoding failed
+ *   error    int8_t[capacity]     DecodeProxyProto() return code, 0 if decoded
+ *
+ * Record i is at index i of every column. A filter over one column reads
+ * nothing but that column, in long runs the compiler vectorizes.
+ */
+
+#define PP_SEGMENT_MAGIC 0x53525050u /* "PPRS" */
+#define PP_SEGMENT_LAYOUT 1
+
+enum RecordColumn {
+  RECORD_TIME,
+  RECORD_SRC_HI,
+  RECORD_SRC_LO,
+  RECORD_DST_HI,
+  RECORD_DST_LO,
+  RECORD_SRC_PORT,
+  RECORD_DST_PORT,
+  RECORD_FAMILY,
+  RECORD_VERSION,
+  RECORD_ERROR,
+  RECORD_NUM_COLUMNS,
+};
+
+struct RecordSegmentHeader {
+  uint32_t magic;
+  uint16_t layout;
+  uint16_t reactor;
+  uint32_t capacity;
+  // records written, stored with release semantics after their columns and
+  // min_ns/max_ns, so readers of a live segment see whole records
+  uint32_t count;
+  uint64_t created_ns;
+  // range of time_ns over the records, lets readers skip a segment
+  uint64_t min_ns;
+  uint64_t max_ns;
+  // set once the writer has moved on to the next segment
+  uint32_t sealed;
+  uint32_t pid;
+  // from the start of the file
+  uint64_t offsets[RECORD_NUM_COLUMNS];
+};
+
+// a decoded or rejected connection, as appended by RecordWriter
+struct ConnRecord {
+  uint64_t time_ns;
+  uint64_t src[2];
+  uint64_t dst[2];
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t family;
+  uint8_t version;
+  int8_t error;
+};
+
+// bytes of one value of column c
+size_t RecordColumnWidth(int c);
+
+/**
+ * @brief 把地址写成记录中的两个字与端口
+ *
+ * @return uint8_t 协议族，Unix 地址与未指定地址的字与端口为 0
+ */
+uint8_t SetRecordAddress(const InetAddress& addr, uint64_t words[2],
+                         uint16_t* port);
+
+/**
+ * @brief 只读映射一个段文件，供离线查询
+ */
+class RecordSegment {
+ public:
+  RecordSegment();
+  ~RecordSegment();
+
+  RecordSegment(const RecordSegment&) = delete;
+  RecordSegment& operator=(const RecordSegment&) = delete;
+
+  /**
+   * @brief 打开并校验段文件
+   *
+   * @return int 0 成功，负的 errno 表示失败，-EPROTO 为格式不符
+   */
+  int Open(const char* path);
+  void Close();
+
+  const RecordSegmentHeader& header() const { return *header_; }
+
+  // 已写入的记录数，写入中的段也可读取
+  uint32_t count() const {
+    return __atomic_load_n(&header_->count, __ATOMIC_ACQUIRE);
+  }
+
+  template <typename T>
+  const T* column(int c) const {
+    return reinterpret_cast<const T*>(base_ + header_->offsets[c]);
+  }
+
+ private:
+  const char* base_;
+  const RecordSegmentHeader* header_;
+  size_t size_;
+};
+
+/**
+ * @brief 单个 reactor 把连接记录追加到自己的段文件，不加锁
+ *
+ * 段文件用 fallocate() 预分配后映射，写满 capacity 条或超过 rotate 秒后封存并
+ * 换用新文件。已写完的页定期交给内核回写并解除映射，常驻内存不随写入量增长。
+ * 文件名为 proxyproto-<UTC 创建时间>-<纳秒>-r<reactor>.seg，按名称排序即按时间
+ * 排序。
+ */
+class RecordWriter {
+ public:
+  RecordWriter();
+  ~RecordWriter();
+
+  RecordWriter(const RecordWriter&) = delete;
+  RecordWriter& operator=(const RecordWriter&) = delete;
+
+  /**
+   * @brief 设置目录与轮转条件，第一条记录追加时才创建文件
+   *
+   * @param dir 已存在的目录，为空时不写入
+   * @param reactor 写入文件名与段头
+   * @param segment_bytes 段文件大小，决定 capacity
+   * @param rotate_sec 段文件最长的时间跨度，0 不按时间轮转
+   */
+  void Init(const std::string& dir, int reactor, uint64_t segment_bytes,
+            int rotate_sec);
+
+  bool enabled() const { return !dir_.empty(); }
+
+  /**
+   * @brief 追加一条记录，需要时轮转
+   *
+   * 创建段文件失败后一秒内的追加直接失败，不再重试。
+   *
+   * @return int 0 成功，负的 errno 表示记录被丢弃
+   */
+  int Append(const ConnRecord& record);
+
+  /**
+   * @brief 封存当前段文件并等待写回磁盘，之后的 Append() 会创建新文件
+   */
+  void Close();
+
+  // 已创建的段文件数
+  uint64_t segments() const { return segments_; }
+
+ private:
+  int OpenSegment(uint64_t now_ns);
+  void SealSegment(bool sync);
+  // hands the pages completed since the last call to writeback and drops
+  // them from the mapping
+  void ReleasePages();
+
+  std::string dir_;
+  int reactor_;
+  uint64_t segment_bytes_;
+  uint64_t rotate_ns_;
+  uint32_t capacity_;
+  uint64_t offsets_[RECORD_NUM_COLUMNS];
+  size_t page_size_;
+
+  int fd_;
+  char* base_;
+  RecordSegmentHeader* header_;
+  // records written to and released from the current segment
+  uint32_t count_;
+  uint32_t released_;
+  uint64_t rotate_at_ns_;
+  // CLOCK_REALTIME nanoseconds before which no segment is opened again
+  uint64_t retry_ns_;
+  uint64_t segments_;
+};
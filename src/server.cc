@@ -14,6 +14,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <sys/socket.h>
@@ -22,40 +23,97 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
 #include <cstring>
-#include <sstream>
 #include <utility>
 
+#include "crc32c.h"
 #include "inet_address.h"
 #include "logging.h"
 #include "proxyproto.h"
+#include "trusted_proxies.h"
 
-const size_t Server::kInitialEventsNum = 4;
-const size_t Server::kMaxEventsNum = 20;
 const int Server::kNoneEvent = 0;
 const int Server::kReadEvent = POLLIN | POLLPRI;
 const int Server::kWriteEvent = POLLOUT;
-const size_t Server::kMaxConnNum = 1024;
+// descriptors of the process outside the reactors: stdio, log files, the
+// record segments being written
+const uint64_t Server::kReservedFiles = 64;
+// the limit derived from a large RLIMIT_NOFILE, as high as --max-conns goes
+const int Server::kMaxAutoConns = kMaxConns;
+// edge-triggered fairness budget: accept() calls per listener wakeup and
+// recv() calls per connection wakeup before yielding to other sockets
+const size_t Server::kAcceptBudget = 64;
+const size_t Server::kReadBudget = 4;
+// pause before accepting again after an error such as EMFILE
+const uint64_t Server::kAcceptRetryMs = 100;
+// never a valid slab handle, the slot index is out of range
+const uint64_t Server::kListenHandle = Slab<Conn>::kInvalidHandle;
+// spill blocks kept for reuse, the rest go back to the allocator
+const size_t Server::kMaxSpillBlocks = 16;
+// set in the slot index of backend socket handles, slab capacities stay far
+// below it
+const uint64_t Server::kBackendFlag = 1ULL << 31;
+// splice() rounds per relay direction and wakeup, each moves up to one pipe
+const size_t Server::kRelayBudget = 16;
+// the default pipe capacity
+const size_t Server::kPipeSize = 64 * 1024;
+// empty pipes kept for reuse by later connections
+const size_t Server::kMaxPooledPipes = 64;
+// next to kListenHandle, also out of the slot index range
+const uint64_t Server::kMetricsHandle = Slab<Conn>::kInvalidHandle - 1;
+// set in the handles of metrics connections, whose low bits index
+// metrics_conns_
+const uint64_t Server::kMetricsFlag = 1ULL << 30;
+// concurrent scrapes, further ones are closed at once
+const size_t Server::kMaxMetricsConns = 8;
+// a request line and a few headers
+const size_t Server::kMaxMetricsRequest = 4096;
+// a scrape gets this long to send its request and take the response, idle
+// connections cannot hold on to the kMaxMetricsConns slots
+const uint64_t Server::kMetricsTimeoutMs = 5000;
+// resolution of the connection deadlines
+const uint64_t Server::kTimerTickMs = 10;
 
-static void Close(int& fd) {
+// per-connection lines: info and debug only for sampled connections, see
+// Conf::log_sample, and failures of any connection within the per second
+// budget of AllowErrorLog()
+#define CONN_LOGD(conn, ...)                 \
+  do {                                       \
+    if ((conn)->sampled) LOGD(__VA_ARGS__);  \
+  } while (0)
+#define CONN_LOGI(conn, ...)                 \
+  do {                                       \
+    if ((conn)->sampled) LOGI(__VA_ARGS__);  \
+  } while (0)
+#define LIMITED_LOGI(...)                    \
+  do {                                       \
+    if (AllowErrorLog()) LOGI(__VA_ARGS__);  \
+  } while (0)
+#define LIMITED_LOGW(...)                    \
+  do {                                       \
+    if (AllowErrorLog()) LOGW(__VA_ARGS__);  \
+  } while (0)
+#define LIMITED_LOGE(...)                    \
+  do {                                       \
+    if (AllowErrorLog()) LOGE(__VA_ARGS__);  \
+  } while (0)
+
+// sockets and pipes of connections, whose closes are logged only for
+// sampled connections
+static void CloseFd(int& fd) {
   if (fd != -1) {
-    LOGD("close fd %d", fd);
     close(fd);
     fd = -1;
   }
 }
 
-static const char* Operation2String(int operation) {
-  switch (operation) {
-    case EPOLL_CTL_ADD:
-      return "EPOLL_CTL_ADD";
-    case EPOLL_CTL_DEL:
-      return "EPOLL_CTL_DEL";
-    case EPOLL_CTL_MOD:
-      return "EPOLL_CTL_MOD";
-
-    default:
-      return "UNKNOWN";
+static void Close(int& fd) {
+  if (fd != -1) {
+    LOGD("close fd %d", fd);
+    CloseFd(fd);
   }
 }
 
@@ -65,16 +123,99 @@ static size_t GetSteadyTime() {
       .count();
 }
 
-Server::Conn::~Conn() { Close(sockfd); }
+static uint64_t GetSteadyTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static uint64_t GetSteadyTimeNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static uint64_t GetWallTimeNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+static InetAddress ToInetAddress(const struct sockaddr* addr) {
+  InetAddress res;
+  if (addr->sa_family == AF_INET6) {
+    res.set_addr6(*reinterpret_cast<const struct sockaddr_in6*>(addr));
+  } else {
+    res.set_addr4(*reinterpret_cast<const struct sockaddr_in*>(addr));
+  }
+  return res;
+}
+
+Server::Conn::~Conn() { Reset(); }
 
-Server::Server(std::shared_ptr<Conf> conf)
+void Server::Conn::Reset() {
+  CloseFd(client.fd);
+  CloseFd(backend.fd);
+  CloseFd(up.rfd);
+  CloseFd(up.wfd);
+  CloseFd(down.rfd);
+  CloseFd(down.wfd);
+  name[0] = '\0';
+  handle = 0;
+  state = kDisconnected;
+  client.watch_events = kNoneEvent;
+  backend.watch_events = kNoneEvent;
+  read_pending = false;
+  sampled = false;
+  conn_time = 0;
+  accept_ns = 0;
+  ibuf = inline_buf;
+  ipos = 0;
+  ilen = 0;
+  icap = sizeof(inline_buf);
+  up.bytes = up.total = 0;
+  up.eof = false;
+  down.bytes = down.total = 0;
+  down.eof = false;
+  peer_held = false;
+  source_held = false;
+  memset(&peer, 0, sizeof(peer));
+}
+
+Server::Server(std::shared_ptr<Conf> conf, int id)
     : conf_{std::move(conf)},
-      epoll_fd_(-1),
+      id_(id),
       listen_sockfd_{-1},
-      conn_index_{0},
-      active_events_{kInitialEventsNum} {}
+      conn_index_(static_cast<uint32_t>(id)),
+      edge_triggered_(false),
+      recv_multishot_(false),
+      decode_flags_(conf_->verify_crc32c ? PROXYPROTO_VERIFY_CRC32C : 0),
+      accept_pending_(false),
+      accept_retry_ms_(0),
+      active_events_(static_cast<size_t>(conf_->events)),
+      events_avg_(0),
+      forward_(false),
+      trusted_version_(0),
+      stats_(),
+      stats_time_(GetSteadyTime()),
+      accept_count_(0),
+      error_log_time_(0),
+      error_log_count_(0),
+      metrics_sockfd_(-1),
+      metrics_conns_(kMaxMetricsConns),
+      timer_wheel_(GetSteadyTimeMs() / kTimerTickMs) {}
 
-Server::~Server() { Stop(); }
+Server::~Server() {
+  Stop();
+  conns_.ForEach([this](uint64_t, Conn* conn) { FreeConn(conn); });
+  for (char* block : spill_pool_) {
+    delete[] block;
+  }
+  for (auto& fds : pipe_pool_) {
+    Close(fds.first);
+    Close(fds.second);
+  }
+}
 
 int Server::Start() {
   int err = 0;
@@ -85,11 +226,70 @@ int Server::Start() {
       break;
     }
 
-    epoll_fd_ = epoll_create(1024);
-    if (epoll_fd_ == -1) {
+    if (conns_.Init(static_cast<size_t>(conf_->max_conns)) != 0) {
+      err = -9;
+      break;
+    }
+
+    forward_ = !conf_->forward_host.empty();
+    if (forward_) {
+      struct addrinfo hints;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      struct addrinfo* result = nullptr;
+      err = getaddrinfo(conf_->forward_host.c_str(), nullptr, &hints, &result);
+      if (err != 0) {
+        LOGE("resolve %s err %s", conf_->forward_host.c_str(),
+             gai_strerror(err));
+        err = -10;
+        break;
+      }
+
+      uint16_t port = htons(static_cast<uint16_t>(conf_->forward_port));
+      if (result->ai_family == AF_INET6) {
+        struct sockaddr_in6 addr;
+        memcpy(&addr, result->ai_addr, sizeof(addr));
+        addr.sin6_port = port;
+        forward_addr_.set_addr6(addr);
+      } else {
+        struct sockaddr_in addr;
+        memcpy(&addr, result->ai_addr, sizeof(addr));
+        addr.sin_port = port;
+        forward_addr_.set_addr4(addr);
+      }
+      freeaddrinfo(result);
+    }
+
+    if (!conf_->trusted_proxies.empty()) {
+      trusted_version_ = TrustedProxiesVersion();
+      trusted_ = GetTrustedProxies();
+    }
+
+    // seeded per reactor and start, peers cannot aim at one probe run
+    uint64_t seed = GetSteadyTimeNs() ^ static_cast<uint64_t>(id_) << 48;
+    peer_limiter_.Init(static_cast<uint32_t>(conf_->peer_rate),
+                       static_cast<uint32_t>(conf_->peer_conns),
+                       static_cast<size_t>(conf_->limit_entries), seed);
+    source_limiter_.Init(static_cast<uint32_t>(conf_->source_rate),
+                         static_cast<uint32_t>(conf_->source_conns),
+                         static_cast<size_t>(conf_->limit_entries), ~seed);
+
+    export_.Attach(id_);
+    records_.Init(conf_->record_dir, id_,
+                  static_cast<uint64_t>(conf_->record_segment_size) << 20,
+                  conf_->record_rotate);
+
+    poller_ = CreatePoller(conf_->poller, conf_->edge_triggered);
+    if (!poller_) {
+      LOGE("reactor#%d poller unavailable", id_);
       err = -2;
       break;
     }
+    edge_triggered_ = poller_->edge_triggered();
+    // forward mode keeps reading the client by readiness, payload that
+    // follows the header is spliced and must not land in a recv buffer
+    recv_multishot_ = poller_->SupportsMultishot() && !forward_;
 
     listen_sockfd_ = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_sockfd_ == -1) {
@@ -116,6 +316,17 @@ int Server::Start() {
       break;
     }
 
+    // every reactor binds the same port, the kernel spreads connections
+    // across their listen sockets
+    if (conf_->threads > 1) {
+      err = setsockopt(listen_sockfd_, SOL_SOCKET, SO_REUSEPORT, &reuse,
+                       sizeof(reuse));
+      if (err != 0) {
+        err = -8;
+        break;
+      }
+    }
+
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -128,13 +339,32 @@ int Server::Start() {
       break;
     }
 
-    err = listen(listen_sockfd_, SOMAXCONN);
+    err = listen(listen_sockfd_, conf_->listen_backlog);
     if (err != 0) {
       err = -7;
       break;
     }
 
-    Update(EPOLL_CTL_ADD, listen_sockfd_, kReadEvent, this);
+    if (poller_->SupportsMultishot()) {
+      err = poller_->AcceptMultishot(listen_sockfd_, kListenHandle);
+      if (err != 0) {
+        LOGE("accept multishot err %s", strerror(-err));
+        err = -2;
+        break;
+      }
+    } else {
+      Update(POLLER_ADD, listen_sockfd_, kReadEvent, kListenHandle);
+    }
+    LOGI("reactor#%d listen fd %d poller %s", id_, listen_sockfd_,
+         poller_->name());
+
+    if (id_ == 0 && conf_->metrics_port > 0) {
+      err = StartMetrics();
+      if (err != 0) {
+        break;
+      }
+    }
+    RegisterMetrics(&metrics_);
   } while (0);
 
   if (err != 0) {
@@ -143,169 +373,1174 @@ int Server::Start() {
   return err;
 }
 
+int Server::StartMetrics() {
+  metrics_sockfd_ =
+      socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (metrics_sockfd_ == -1) {
+    return -11;
+  }
+
+  int reuse = 1;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(conf_->metrics_port);
+  if (setsockopt(metrics_sockfd_, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                 sizeof(reuse)) != 0 ||
+      bind(metrics_sockfd_, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) != 0 ||
+      listen(metrics_sockfd_, 16) != 0) {
+    LOGE("metrics port %d err %s", conf_->metrics_port, strerror(errno));
+    return -11;
+  }
+
+  Update(POLLER_ADD, metrics_sockfd_, kReadEvent, kMetricsHandle);
+  LOGD("reactor#%d metrics fd %d", id_, metrics_sockfd_);
+  return 0;
+}
+
 int Server::Stop() {
+  UnregisterMetrics(&metrics_);
+  for (MetricsConn& mc : metrics_conns_) {
+    CloseMetricsConn(&mc);
+  }
+  Close(metrics_sockfd_);
   Close(listen_sockfd_);
-  Close(epoll_fd_);
+  records_.Close();
+  // io_uring holds the files of its requests until the ring goes away
+  poller_.reset();
   return 0;
 }
 
 int Server::Poll(int timeout) {
-  int num_events = epoll_wait(epoll_fd_, &*active_events_.begin(),
-                              static_cast<int>(active_events_.size()), timeout);
-  if (num_events > 0) {
-    for (int i = 0; i < num_events; ++i) {
-      HandleEvents(active_events_[i].events, active_events_[i].data.ptr);
+  // a reload takes effect between two wakeups, connections keep the result
+  // of the lookup made at accept
+  if (trusted_ && TrustedProxiesVersion() != trusted_version_) {
+    trusted_version_ = TrustedProxiesVersion();
+    trusted_ = GetTrustedProxies();
+  }
+
+  if (!read_pending_.empty() || (accept_pending_ && accept_retry_ms_ == 0)) {
+    timeout = 0;
+  } else {
+    // wake up for the next due slot of the timing wheel, or to retry a
+    // failed accept
+    uint64_t at = accept_pending_ ? accept_retry_ms_ : UINT64_MAX;
+    uint64_t next = timer_wheel_.NextTick();
+    if (next != TimingWheel::kNoTick) {
+      at = std::min(at, next * kTimerTickMs);
+    }
+    if (at != UINT64_MAX) {
+      uint64_t now = GetSteadyTimeMs();
+      int wait = at > now ? static_cast<int>(std::min<uint64_t>(
+                                at - now, static_cast<uint64_t>(INT_MAX)))
+                          : 0;
+      if (timeout < 0 || wait < timeout) {
+        timeout = wait;
+      }
     }
+  }
 
-    if (static_cast<size_t>(num_events) == active_events_.size() &&
-        active_events_.size() < kMaxEventsNum) {
-      active_events_.resize(std::min(active_events_.size() * 2, kMaxEventsNum));
+  int num_events = poller_->Wait(&*active_events_.begin(),
+                                 static_cast<int>(active_events_.size()),
+                                 timeout);
+  if (num_events >= 0) {
+    metrics_.events_per_wakeup.Record(static_cast<uint64_t>(num_events));
+    ResizeEvents(num_events);
+  }
+  if (num_events > 0) {
+    for (int i = 0; i < num_events; ++i) {
+      const PollerEvent& event = active_events_[i];
+      switch (event.type) {
+        case POLLER_ACCEPT:
+          OnAccepted(event.res);
+          break;
+        case POLLER_RECV:
+          OnRecv(event.data, event.res, event.buf);
+          break;
+        default:
+          HandleEvents(event.res, event.data);
+          break;
+      }
     }
   } else if (num_events == 0) {
     // nothing happened
   } else {
-    if (errno != EINTR) {
-      LOGE("epoll_wait err %s", strerror(errno));
+    if (num_events != -EINTR) {
+      LOGE("%s wait err %s", poller_->name(), strerror(-num_events));
     }
   }
+
+  HandlePending();
+  ExpireConns();
+  ReportStats();
   return 0;
 }
 
-void Server::Update(int operation, int sockfd, int events, void* userp) {
-  struct epoll_event event;
-  memset(&event, 0, sizeof(event));
-  event.events = events;
-  event.data.ptr = userp;
-  if (epoll_ctl(epoll_fd_, operation, sockfd, &event) < 0) {
-    LOGE("epoll_ctl op=%s fd=%d err %s", Operation2String(operation), sockfd,
-         strerror(errno));
+void Server::ResizeEvents(int num_events) {
+  size_t size = active_events_.size();
+  size_t max_size = static_cast<size_t>(conf_->max_events);
+  // a full wakeup may have left events behind, take twice as many next time
+  if (static_cast<size_t>(num_events) == size && size < max_size) {
+    active_events_.resize(std::min(size * 2, max_size));
+    // the average starts over at half the new size, well clear of the
+    // shrink threshold
+    events_avg_ = static_cast<uint32_t>(active_events_.size() * 32);
+    LOGD("reactor#%d events %zu", id_, active_events_.size());
+    return;
+  }
+  if (!conf_->adaptive) return;
+
+  // one wakeup weighs 1/64, the average takes some 44 wakeups to halve and
+  // short lulls between bursts do not shrink the array
+  events_avg_ =
+      events_avg_ - events_avg_ / 64 + static_cast<uint32_t>(num_events);
+  // halving at under a quarter leaves the array at least twice the average,
+  // a burst grows it again on its first full wakeup. A smaller array bounds
+  // the events one wakeup handles before pending reads and timers run.
+  size_t min_size = static_cast<size_t>(conf_->events);
+  if (size > min_size && events_avg_ < size * 16) {
+    active_events_.resize(std::max(size / 2, min_size));
+    active_events_.shrink_to_fit();
+    LOGD("reactor#%d events %zu", id_, active_events_.size());
+  }
+}
+
+int Server::ConnLimitFromFiles(uint64_t max_files, const Conf& conf) {
+  bool forward = !conf.forward_host.empty();
+  // poller, listen socket, metrics socket and its clients
+  uint64_t per_reactor = 3 + kMaxMetricsConns;
+  if (forward) {
+    per_reactor += 2 * kMaxPooledPipes;
+  }
+  uint64_t reserved =
+      kReservedFiles + per_reactor * static_cast<uint64_t>(conf.threads);
+  if (max_files <= reserved) return 1;
+
+  // the client, and forwarding the backend and a pipe each way
+  uint64_t per_conn = forward ? 6 : 1;
+  uint64_t n = (max_files - reserved) / per_conn /
+               static_cast<uint64_t>(conf.threads);
+  return static_cast<int>(
+      std::max<uint64_t>(1, std::min<uint64_t>(n, kMaxAutoConns)));
+}
+
+void Server::HandlePending() {
+  if (accept_pending_ &&
+      (accept_retry_ms_ == 0 || GetSteadyTimeMs() >= accept_retry_ms_)) {
+    if (poller_->SupportsMultishot()) {
+      RearmAccept();
+    } else {
+      OnNewConn(kReadEvent);
+    }
+  }
+
+  if (!read_pending_.empty()) {
+    read_pending_swap_.swap(read_pending_);
+    // handles of connections closed meanwhile are stale and ignored, the
+    // write event resumes relays that ran out of budget with a full pipe
+    for (uint64_t handle : read_pending_swap_) {
+      Conn* conn = conns_.Get(handle);
+      if (conn == nullptr) continue;
+      // cleared as its entry is taken off, the wakeup below may queue it
+      // again
+      conn->read_pending = false;
+      HandleEvents(kReadEvent | kWriteEvent, handle);
+    }
+    read_pending_swap_.clear();
+  }
+}
+
+void Server::Update(int operation, int sockfd, int events, uint64_t handle) {
+  int err = poller_->Ctl(operation, sockfd, events, handle);
+  if (err != 0) {
+    LOGE("%s op=%s fd=%d err %s", poller_->name(), PollerOpName(operation),
+         sockfd, strerror(-err));
   }
 }
 
-void Server::Update(Conn* conn) {
-  Update(EPOLL_CTL_MOD, conn->sockfd, conn->watch_events, conn);
+void Server::Update(Conn* conn, Endpoint* ep) {
+  uint64_t handle = conn->handle;
+  if (ep == &conn->backend) {
+    handle |= kBackendFlag;
+  }
+  Update(POLLER_MODIFY, ep->fd, ep->watch_events, handle);
 }
 
-void Server::EnableReading(Conn* conn) {
-  conn->watch_events |= kReadEvent;
-  Update(conn);
+// the relay toggles interest on every backpressure change, so requests that
+// leave the watch set as it is skip the poller call
+
+void Server::EnableReading(Conn* conn, Endpoint* ep) {
+  if ((ep->watch_events & kReadEvent) == kReadEvent) return;
+  ep->watch_events |= kReadEvent;
+  Update(conn, ep);
 }
-void Server::EnableWriting(Conn* conn) {
-  conn->watch_events |= kWriteEvent;
-  Update(conn);
+void Server::EnableWriting(Conn* conn, Endpoint* ep) {
+  if (ep->watch_events & kWriteEvent) return;
+  ep->watch_events |= kWriteEvent;
+  Update(conn, ep);
 }
 
-void Server::DisableReading(Conn* conn) {
-  conn->watch_events &= ~kReadEvent;
-  Update(conn);
+void Server::DisableReading(Conn* conn, Endpoint* ep) {
+  if (!(ep->watch_events & kReadEvent)) return;
+  ep->watch_events &= ~kReadEvent;
+  Update(conn, ep);
 }
 
-void Server::DisableWriting(Conn* conn) {
-  conn->watch_events &= ~kWriteEvent;
-  Update(conn);
+void Server::DisableWriting(Conn* conn, Endpoint* ep) {
+  if (!(ep->watch_events & kWriteEvent)) return;
+  ep->watch_events &= ~kWriteEvent;
+  Update(conn, ep);
 }
 
-void Server::HandleEvents(int events, void* userp) {
-  if (userp == this) {
+void Server::HandleEvents(int events, uint64_t handle) {
+  if (handle == kListenHandle) {
     OnNewConn(events);
+  } else if (handle == kMetricsHandle) {
+    OnNewMetricsConn();
+  } else if (handle & kMetricsFlag) {
+    OnMetricsEvt(handle, events);
   } else {
-    Conn* conn = reinterpret_cast<Conn*>(userp);
-    auto iter = conns_.find(conn);
-    if (iter != conns_.end()) {
-      OnConnEvt(conn, events);
+    // stale events of a recycled slot carry an old generation and miss
+    Conn* conn = conns_.Get(handle & ~kBackendFlag);
+    if (conn != nullptr) {
+      if (handle & kBackendFlag) {
+        OnBackendEvt(conn, events);
+      } else {
+        OnConnEvt(conn, events);
+      }
       if (conn->state == kDisconnected) {
-        LOGI("del conn [%s]", conn->cname());
-        Update(EPOLL_CTL_DEL, conn->sockfd, conn->watch_events, conn);
-        conns_.erase(conn);
+        CloseConn(conn);
       }
     }
   }
 }
 
+void Server::CloseConn(Conn* conn) {
+  CONN_LOGI(conn, "del conn [%s]", conn->cname());
+  Update(POLLER_REMOVE, conn->client.fd, conn->client.watch_events,
+         conn->handle);
+  if (conn->backend.fd != -1) {
+    Update(POLLER_REMOVE, conn->backend.fd, conn->backend.watch_events,
+           conn->handle | kBackendFlag);
+  }
+  FreeConn(conn);
+}
+
 void Server::OnNewConn(int events) {
-  if (events & (POLLIN | POLLPRI | POLLRDHUP)) {
+  if (!(events & (POLLIN | POLLPRI | POLLRDHUP))) {
+    return;
+  }
+
+  // level-triggered mode accepts once per wakeup and lets the poller report
+  // the rest of the backlog, edge-triggered mode drains it up to the budget
+  size_t budget = edge_triggered_ ? kAcceptBudget : 1;
+  accept_pending_ = false;
+  accept_retry_ms_ = 0;
+  for (size_t i = 0; i < budget; ++i) {
     struct sockaddr_in addr;
     socklen_t addrlen = sizeof(addr);
-    int sockfd = accept(listen_sockfd_,
-                        reinterpret_cast<struct sockaddr*>(&addr), &addrlen);
-    if (sockfd != -1) {
-      LOGD("accept new sockfd %d", sockfd);
-
-      if (conns_.size() >= kMaxConnNum) {
-        Close(sockfd);
-        LOGI("the number of connections exceeds the limit");
-        return;
+    int sockfd =
+        accept4(listen_sockfd_, reinterpret_cast<struct sockaddr*>(&addr),
+                &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sockfd == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == ECONNABORTED) {
+        metrics_.accept_errors.Add();
+        continue;
       }
+      int err = errno;
+      if (err != EAGAIN && err != EWOULDBLOCK) {
+        metrics_.accept_errors.Add();
+        LIMITED_LOGE("accept err %s", strerror(err));
+        // no new edge comes for the connections still queued, they are
+        // retried after a pause that lets EMFILE and the like clear
+        if (edge_triggered_) {
+          accept_pending_ = true;
+          accept_retry_ms_ = GetSteadyTimeMs() + kAcceptRetryMs;
+        }
+      }
+      return;
+    }
+    AddConn(sockfd, reinterpret_cast<struct sockaddr*>(&addr));
+  }
 
-      std::unique_ptr<Conn> conn(new Conn);
-      conn->sockfd = sockfd;
-      conn->state = kConnected;
-      conn->watch_events = kReadEvent;
-      conn->conn_time = GetSteadyTime();
+  if (edge_triggered_) {
+    accept_pending_ = true;
+  }
+}
 
-      std::ostringstream oss;
-      oss << "conn#" << conn_index_++ << "-" << sockfd << "-"
-          << conn->conn_time;
-      conn->name = oss.str();
+void Server::OnAccepted(int res) {
+  if (res >= 0) {
+    // multishot accept leaves the peer address out
+    AddConn(res, nullptr);
+  } else if (res != -EAGAIN && res != -EWOULDBLOCK && res != -EINTR) {
+    metrics_.accept_errors.Add();
+    if (res != -ECONNABORTED) {
+      LIMITED_LOGE("accept err %s", strerror(-res));
+      // the poller has stopped accepting, it starts again after a pause
+      // that lets EMFILE and the like clear
+      accept_pending_ = true;
+      accept_retry_ms_ = GetSteadyTimeMs() + kAcceptRetryMs;
+    }
+  }
+}
 
-      Update(EPOLL_CTL_ADD, sockfd, kReadEvent, conn.get());
+void Server::RearmAccept() {
+  accept_pending_ = false;
+  accept_retry_ms_ = 0;
+  int err = poller_->AcceptMultishot(listen_sockfd_, kListenHandle);
+  if (err != 0) {
+    LIMITED_LOGE("accept multishot err %s", strerror(-err));
+    accept_pending_ = true;
+    accept_retry_ms_ = GetSteadyTimeMs() + kAcceptRetryMs;
+  }
+}
 
-      LOGI("add conn [%s]", conn->cname());
-      conns_.insert(std::make_pair(conn.get(), std::move(conn)));
-    } else {
-      LOGE("accept err %s", strerror(errno));
+bool Server::IsTrusted(int sockfd, const struct sockaddr* peer) {
+  if (!trusted_ || trusted_->Contains(peer)) {
+    return true;
+  }
+
+  metrics_.untrusted[conf_->untrusted].Add();
+  LIMITED_LOGI("untrusted peer %s fd %d", ToInetAddress(peer), sockfd);
+  return false;
+}
+
+bool Server::Admit(RateLimiter* limiter, int key, const RateKey& addr,
+                   uint64_t now_ms, bool* held) {
+  int res = limiter->Acquire(addr, now_ms, held);
+  if (res == RATE_LIMIT_ADMITTED) {
+    return true;
+  }
+  if (res == RATE_LIMIT_UNTRACKED) {
+    metrics_.rate_limit_untracked.Add();
+    return true;
+  }
+  // no line per reject, a flood of them is what the limit is for
+  metrics_.rate_limited[key][res == RATE_LIMIT_CONNS].Add();
+  return false;
+}
+
+void Server::AddConn(int sockfd, const struct sockaddr* peer) {
+  // multishot accept leaves the peer address out, it is looked up only for
+  // the checks that need it
+  struct sockaddr_storage addr;
+  if (peer == nullptr &&
+      (trusted_ || peer_limiter_.enabled() || export_.enabled())) {
+    socklen_t addrlen = sizeof(addr);
+    if (getpeername(sockfd, reinterpret_cast<struct sockaddr*>(&addr),
+                    &addrlen) != 0) {
+      CloseFd(sockfd);
+      return;
+    }
+    peer = reinterpret_cast<struct sockaddr*>(&addr);
+  }
+
+  // checked before any byte of the header is read
+  bool trusted = IsTrusted(sockfd, peer);
+  if (!trusted && conf_->untrusted == UNTRUSTED_REJECT) {
+    CloseFd(sockfd);
+    return;
+  }
+
+  uint64_t now_ns = GetSteadyTimeNs();
+  RateKey peer_key = {0, 0};
+  bool peer_held = false;
+  if (peer_limiter_.enabled() && RateLimiter::MakeKey(peer, &peer_key) &&
+      !Admit(&peer_limiter_, 0, peer_key, now_ns / 1000000, &peer_held)) {
+    LOGD("peer of fd %d over limit", sockfd);
+    CloseFd(sockfd);
+    return;
+  }
+
+  uint64_t handle;
+  Conn* conn = conns_.Alloc(&handle);
+  if (conn == nullptr) {
+    if (peer_held) {
+      peer_limiter_.Release(peer_key);
     }
+    CloseFd(sockfd);
+    metrics_.conn_limit_rejects.Add();
+    LIMITED_LOGI("the number of connections exceeds the limit");
+    return;
   }
+
+  conn->handle = handle;
+  conn->client.fd = sockfd;
+  conn->client.watch_events = kReadEvent;
+  conn->state = kConnected;
+  conn->conn_time = GetSteadyTime();
+  conn->accept_ns = now_ns;
+  conn->peer_key = peer_key;
+  conn->peer_held = peer_held;
+  if (export_.enabled()) {
+    ToInetAddress(peer).Pack(&conn->peer);
+  }
+  conn->timer.data = handle;
+  ScheduleTimer(conn);
+  conn->sampled = accept_count_++ % conf_->log_sample == 0;
+  CONN_LOGD(conn, "accept new sockfd %d", sockfd);
+  metrics_.accepts.Add();
+
+  snprintf(conn->name, sizeof(conn->name), "conn#%u-%d-%zu", conn_index_,
+           sockfd, conn->conn_time);
+  // reactors number their connections id, id+N, id+2N, ...
+  conn_index_ += static_cast<uint32_t>(conf_->threads);
+
+  if (!trusted) {
+    // passed through, LoadConf() allows it with --forward only: relayed as
+    // is, the header is left to the backend to reject
+    CONN_LOGI(conn, "add conn [%s] untrusted, passthrough", conn->cname());
+    Update(POLLER_ADD, sockfd, kReadEvent, handle);
+    Connect(conn);
+    if (conn->state == kDisconnected) {
+      CloseConn(conn);
+    }
+    return;
+  }
+
+  if (recv_multishot_) {
+    int err = poller_->RecvMultishot(sockfd, handle);
+    if (err != 0) {
+      LOGE("%s recv multishot fd=%d err %s", poller_->name(), sockfd,
+           strerror(-err));
+    }
+  } else {
+    Update(POLLER_ADD, sockfd, kReadEvent, handle);
+  }
+
+  CONN_LOGI(conn, "add conn [%s]", conn->cname());
 }
 
 void Server::OnConnEvt(Conn* conn, int events) {
+  if (conn->state == kRelaying) {
+    OnRelayEvt(conn, &conn->client, events);
+    return;
+  }
+
   if ((events & POLLHUP) && !(events & POLLIN)) {
     // close
     conn->state = kDisconnected;
-    LOGI("%s close", conn->cname());
+    CONN_LOGI(conn, "%s close", conn->cname());
   }
 
   if (events & (POLLERR | POLLNVAL)) {
     // error
     conn->state = kDisconnected;
-    LOGI("%s error", conn->cname());
+    LIMITED_LOGI("%s error", conn->cname());
   }
 
-  if (events & (POLLIN | POLLPRI | POLLRDHUP)) {
+  if (conn->state == kConnected && (events & (POLLIN | POLLPRI | POLLRDHUP))) {
     // readable
-    char buf[1024];
-    ssize_t n = recv(conn->sockfd, buf, sizeof(buf), 0);
+    OnReadable(conn);
+  }
+}
+
+void Server::OnBackendEvt(Conn* conn, int events) {
+  if (conn->state == kRelaying) {
+    OnRelayEvt(conn, &conn->backend, events);
+    return;
+  }
+
+  if (conn->state == kConnecting && (events & (POLLOUT | POLLERR | POLLHUP))) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->backend.fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+      err = errno;
+    }
+    if (err != 0) {
+      conn->state = kDisconnected;
+      LIMITED_LOGW("%s connect %s err %s", conn->cname(), forward_addr_,
+                   strerror(err));
+      return;
+    }
+    StartRelay(conn);
+  }
+}
+
+void Server::OnRelayEvt(Conn* conn, Endpoint* ep, int events) {
+  if (events & (POLLERR | POLLNVAL)) {
+    conn->state = kDisconnected;
+    LIMITED_LOGI("%s %s error", conn->cname(),
+                 ep == &conn->client ? "client" : "backend");
+    return;
+  }
+
+  // POLLHUP without POLLIN still lets splice() report the EOF, and pipes
+  // that still hold data get a chance to drain
+  Endpoint* peer = ep == &conn->client ? &conn->backend : &conn->client;
+  Pipe* in = ep == &conn->client ? &conn->up : &conn->down;
+  Pipe* out = ep == &conn->client ? &conn->down : &conn->up;
+  if ((events & POLLHUP) && in->eof) {
+    // the hangup cannot be masked and level-triggered polling reports it on
+    // every wakeup. ep has sent its EOF and takes nothing more either: both
+    // of its directions are shut down, or the connection was reset.
+    conn->state = kDisconnected;
+    CONN_LOGI(conn, "%s %s hung up, relayed %" PRIu64 " bytes up, %" PRIu64
+              " bytes down", conn->cname(),
+              ep == &conn->client ? "client" : "backend", conn->up.total,
+              conn->down.total);
+    return;
+  }
+  if (events & (POLLIN | POLLPRI | POLLRDHUP | POLLHUP)) {
+    Relay(conn, in, ep, peer);
+  }
+  if (conn->state == kRelaying && (events & (POLLOUT | POLLHUP))) {
+    Relay(conn, out, peer, ep);
+  }
+
+  if (conn->state == kRelaying && conn->up.eof && conn->down.eof) {
+    conn->state = kDisconnected;
+    CONN_LOGI(conn, "%s relayed %" PRIu64 " bytes up, %" PRIu64 " bytes down",
+              conn->cname(), conn->up.total, conn->down.total);
+  }
+}
+
+void Server::OnReadable(Conn* conn) {
+  // edge-triggered mode reads until EAGAIN, a complete header or the budget
+  size_t budget = edge_triggered_ ? kReadBudget : 1;
+  for (size_t i = 0; i < budget && conn->state == kConnected; ++i) {
+    size_t room = ReserveInput(conn);
+    if (room == 0) {
+      conn->state = kDisconnected;
+      metrics_.oversized.Add();
+      LIMITED_LOGW("%s header exceeds %d bytes", conn->cname(),
+                   conf_->max_header_bytes);
+      return;
+    }
+
+    ssize_t n = recv(conn->client.fd, conn->ibuf + conn->ilen, room, 0);
     if (n > 0) {
-      conn->ibuf.append(buf, n);
-
-      InetAddress src, dst;
-      int ret =
-          DecodeProxyProto(conn->ibuf.data(), conn->ibuf.size(), &src, &dst);
-      if (ret > 0) {
-        LOGI("%s proxy: %s -> %s", conn->cname(), src.ToAddrPort().c_str(),
-             dst.ToAddrPort().c_str());
+      conn->ilen += n;
+      metrics_.bytes_read.Add(n);
+      DecodeInput(conn);
+    } else if (n == 0) {
+      conn->state = kDisconnected;
+      metrics_.closed_by_peer.Add();
+      CONN_LOGI(conn, "%s closed by peer", conn->cname());
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    } else if (errno == EINTR) {
+      continue;
+    } else {
+      LIMITED_LOGW("%s recv err %s", conn->cname(), strerror(errno));
+      return;
+    }
+  }
+
+  if (edge_triggered_ && conn->state == kConnected) {
+    SetPending(conn);
+  }
+}
+
+void Server::OnRecv(uint64_t handle, int res, const char* buf) {
+  Conn* conn = conns_.Get(handle);
+  if (conn == nullptr || conn->state != kConnected) return;
+
+  // the provided buffer goes back to the kernel at the next Wait(), the
+  // bytes are copied into ibuf in pieces that fit
+  size_t left = res > 0 ? static_cast<size_t>(res) : 0;
+  while (left > 0 && conn->state == kConnected) {
+    size_t room = ReserveInput(conn);
+    if (room == 0) {
+      conn->state = kDisconnected;
+      metrics_.oversized.Add();
+      LIMITED_LOGW("%s header exceeds %d bytes", conn->cname(),
+                   conf_->max_header_bytes);
+      break;
+    }
+    size_t n = std::min(room, left);
+    memcpy(conn->ibuf + conn->ilen, buf, n);
+    conn->ilen += n;
+    buf += n;
+    left -= n;
+    metrics_.bytes_read.Add(n);
+    DecodeInput(conn);
+  }
+
+  if (res == 0) {
+    conn->state = kDisconnected;
+    metrics_.closed_by_peer.Add();
+    CONN_LOGI(conn, "%s closed by peer", conn->cname());
+  } else if (res < 0) {
+    // the multishot recv has ended, nothing else would read the client
+    conn->state = kDisconnected;
+    LIMITED_LOGW("%s recv err %s", conn->cname(), strerror(-res));
+  }
+
+  if (conn->state == kDisconnected) {
+    CloseConn(conn);
+  }
+}
+
+void Server::DecodeInput(Conn* conn) {
+  ProxyProtoResult res;
+  int ret = DecodeProxyProto(conn->ibuf, conn->ilen, &res, decode_flags_);
+  if (ret > 0) {
+    uint64_t now_ns = GetSteadyTimeNs();
+    metrics_.decoded[res.version].Add();
+    metrics_.decode_latency.Record(now_ns - conn->accept_ns);
+    uint64_t wall_ns =
+        records_.enabled() || export_.enabled() ? GetWallTimeNs() : 0;
+    // recorded whether or not the limits below let it through
+    if (records_.enabled()) {
+      RecordConn(&res, 0, wall_ns);
+    }
+    // LOCAL and UNSPEC headers carry no source address to limit
+    if (source_limiter_.enabled() && res.command == PROXYPROTO_CMD_PROXY &&
+        RateLimiter::MakeKey(res.src.GetSockAddr(), &conn->source_key) &&
+        !Admit(&source_limiter_, 1, conn->source_key, now_ns / 1000000,
+               &conn->source_held)) {
+      CONN_LOGD(conn, "%s source %s over limit", conn->cname(), res.src);
+      conn->state = kDisconnected;
+      return;
+    }
+    if (export_.enabled()) {
+      ExportConn(conn, res, ret, wall_ns);
+    }
+    if (res.command == PROXYPROTO_CMD_LOCAL) {
+      // load balancer health checks, nothing to report
+      CONN_LOGD(conn, "%s local", conn->cname());
+    } else if (res.transport == PROXYPROTO_TRANSPORT_UNSPEC) {
+      CONN_LOGI(conn, "%s proxy: unspec", conn->cname());
+    } else {
+      CONN_LOGI(conn, "%s proxy%s: %s -> %s", conn->cname(),
+                res.transport == PROXYPROTO_TRANSPORT_DGRAM ? " dgram" : "",
+                res.src, res.dst);
+    }
+
+    if (forward_) {
+      // LOCAL connections are relayed as well, the spec has the receiver
+      // use the real endpoints of the connection for them
+      conn->ipos = static_cast<size_t>(ret);
+      Connect(conn);
+    } else {
+      conn->state = kDisconnected;
+    }
+  } else if (ret < 0) {
+    metrics_.decode_errors[std::min(-ret, 15)].Add();
+    LIMITED_LOGW("%s decode proxy proto err %d", conn->cname(), ret);
+    if (records_.enabled()) {
+      RecordConn(nullptr, ret, GetWallTimeNs());
+    }
+    conn->state = kDisconnected;
+  }
+}
+
+void Server::ExportConn(Conn* conn, const ProxyProtoResult& res,
+                        int header_len, uint64_t wall_ns) {
+  struct pp_ring_record record;
+  memset(&record, 0, sizeof(record));
+  record.time_ns = wall_ns;
+  record.fd = conn->client.fd;
+  record.local_port = static_cast<uint16_t>(conf_->listen_port);
+  record.reactor = static_cast<uint16_t>(id_);
+  record.version = res.version;
+  record.command = res.command;
+  record.transport = res.transport;
+  record.header_len = static_cast<uint32_t>(header_len);
+  memcpy(&record.peer, &conn->peer, sizeof(record.peer));
+  // Pack() leaves AF_UNIX addresses out, consumers still see the family
+  PackedInetAddress packed;
+  if (!res.src.Pack(&packed)) packed.family = AF_UNIX;
+  memcpy(&record.src, &packed, sizeof(record.src));
+  if (!res.dst.Pack(&packed)) packed.family = AF_UNIX;
+  memcpy(&record.dst, &packed, sizeof(record.dst));
+
+  ProxyProtoTlvs tlvs;
+  if (res.version == 2 && tlvs.Init(conn->ibuf, header_len) == 0 &&
+      !tlvs.empty()) {
+    record.tlv_len = static_cast<uint16_t>(tlvs.size());
+    record.tlv_crc32c = Crc32c(0, tlvs.data(), tlvs.size());
+  }
+  export_.Publish(record);
+}
+
+void Server::RecordConn(const ProxyProtoResult* res, int error,
+                        uint64_t wall_ns) {
+  ConnRecord record;
+  memset(&record, 0, sizeof(record));
+  record.time_ns = wall_ns;
+  record.error = static_cast<int8_t>(error);
+  if (res != nullptr) {
+    record.version = res->version;
+    record.family = SetRecordAddress(res->src, record.src, &record.src_port);
+    SetRecordAddress(res->dst, record.dst, &record.dst_port);
+  }
+  int err = records_.Append(record);
+  if (err == 0) {
+    metrics_.records.Add();
+  } else {
+    metrics_.record_errors.Add();
+    // a failed segment is retried a second later, the drops in between
+    // only show in the metric
+    if (err != -EAGAIN) {
+      LIMITED_LOGW("reactor#%d record segment err %s", id_, strerror(-err));
+    }
+  }
+}
+
+void Server::SetPending(Conn* conn) {
+  if (!conn->read_pending) {
+    conn->read_pending = true;
+    read_pending_.push_back(conn->handle);
+  }
+}
+
+void Server::Connect(Conn* conn) {
+  const struct sockaddr* addr = forward_addr_.GetSockAddr();
+  socklen_t addrlen = forward_addr_.family() == AF_INET6
+                          ? sizeof(struct sockaddr_in6)
+                          : sizeof(struct sockaddr_in);
+  int sockfd = socket(forward_addr_.family(),
+                      SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sockfd == -1) {
+    conn->state = kDisconnected;
+    LIMITED_LOGE("%s socket err %s", conn->cname(), strerror(errno));
+    return;
+  }
+
+  int err;
+  do {
+    err = connect(sockfd, addr, addrlen);
+  } while (err == -1 && errno == EINTR);
+  if (err == -1 && errno != EINPROGRESS) {
+    CloseFd(sockfd);
+    conn->state = kDisconnected;
+    LIMITED_LOGW("%s connect %s err %s", conn->cname(), forward_addr_,
+                 strerror(errno));
+    return;
+  }
+
+  // the client is not read again until the backend is there to take it
+  conn->backend.fd = sockfd;
+  conn->backend.watch_events = kWriteEvent;
+  conn->state = kConnecting;
+  Update(POLLER_ADD, sockfd, kWriteEvent, conn->handle | kBackendFlag);
+  DisableReading(conn, &conn->client);
+  CONN_LOGD(conn, "%s connect backend fd %d", conn->cname(), sockfd);
+
+  if (err == 0) {
+    StartRelay(conn);
+  }
+}
+
+void Server::StartRelay(Conn* conn) {
+  if (AcquirePipe(&conn->up) != 0 || AcquirePipe(&conn->down) != 0) {
+    conn->state = kDisconnected;
+    LIMITED_LOGE("%s pipe err %s", conn->cname(), strerror(errno));
+    return;
+  }
+
+  conn->state = kRelaying;
+  ScheduleTimer(conn);
+  DisableWriting(conn, &conn->backend);
+  EnableReading(conn, &conn->client);
+  EnableReading(conn, &conn->backend);
+  // payload that came in along with the header goes out first, then
+  // whatever the client sent while the backend was connecting
+  OnRelayEvt(conn, &conn->client, kReadEvent);
+}
+
+bool Server::FlushInput(Conn* conn) {
+  while (conn->ipos < conn->ilen) {
+    ssize_t n = send(conn->backend.fd, conn->ibuf + conn->ipos,
+                     conn->ilen - conn->ipos, MSG_NOSIGNAL);
+    if (n > 0) {
+      conn->ipos += n;
+      conn->up.total += n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      DisableReading(conn, &conn->client);
+      EnableWriting(conn, &conn->backend);
+      return false;
+    } else if (errno != EINTR) {
+      conn->state = kDisconnected;
+      LIMITED_LOGW("%s send err %s", conn->cname(), strerror(errno));
+      return false;
+    }
+  }
+  return true;
+}
+
+void Server::Relay(Conn* conn, Pipe* pipe, Endpoint* src, Endpoint* dst) {
+  if (pipe == &conn->up && !FlushInput(conn)) {
+    return;
+  }
+
+  const unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+  for (size_t i = 0; i < kRelayBudget; ++i) {
+    while (pipe->bytes > 0) {
+      ssize_t n =
+          splice(pipe->rfd, nullptr, dst->fd, nullptr, pipe->bytes, flags);
+      if (n > 0) {
+        pipe->bytes -= n;
+        pipe->total += n;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // dst is slower than src, stop reading src until dst drains the pipe
+        DisableReading(conn, src);
+        EnableWriting(conn, dst);
+        return;
+      } else if (errno != EINTR) {
         conn->state = kDisconnected;
-      } else if (ret == 0) {
-        // continue
-      } else {
-        LOGW("%s decode proxy proto err %d", conn->cname(), ret);
+        LIMITED_LOGW("%s splice to fd %d err %s", conn->cname(), dst->fd,
+                     strerror(errno));
+        return;
       }
+    }
+
+    DisableWriting(conn, dst);
+    if (pipe->eof) {
+      return;
+    }
+
+    ssize_t n = splice(src->fd, nullptr, pipe->wfd, nullptr, kPipeSize, flags);
+    if (n > 0) {
+      pipe->bytes = n;
+      metrics_.bytes_read.Add(n);
     } else if (n == 0) {
+      // half-close, the other direction keeps going until its own EOF
+      pipe->eof = true;
+      DisableReading(conn, src);
+      shutdown(dst->fd, SHUT_WR);
+      CONN_LOGD(conn, "%s fd %d eof", conn->cname(), src->fd);
+      return;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      EnableReading(conn, src);
+      return;
+    } else if (errno != EINTR) {
       conn->state = kDisconnected;
-      LOGI("%s closed by peer", conn->cname());
+      LIMITED_LOGW("%s splice from fd %d err %s", conn->cname(), src->fd,
+                   strerror(errno));
+      return;
+    }
+  }
+
+  // out of budget with data left in the pipe, a level-triggered poller reports
+  // dst as writable again, edge-triggered mode queues the connection
+  if (edge_triggered_) {
+    SetPending(conn);
+  } else {
+    EnableWriting(conn, dst);
+  }
+}
+
+size_t Server::ReserveInput(Conn* conn) {
+  size_t limit = static_cast<size_t>(conf_->max_header_bytes);
+  if (conn->ilen < std::min(conn->icap, limit)) {
+    return std::min(conn->icap, limit) - conn->ilen;
+  }
+  if (conn->ilen >= limit) {
+    return 0;
+  }
+
+  // the inline buffer is full but the header is not, move it to a spill
+  // block big enough for the largest header we accept
+  char* block;
+  if (!spill_pool_.empty()) {
+    block = spill_pool_.back();
+    spill_pool_.pop_back();
+  } else {
+    block = new char[limit];
+  }
+  memcpy(block, conn->ibuf, conn->ilen);
+  conn->ibuf = block;
+  conn->icap = limit;
+  return limit - conn->ilen;
+}
+
+int Server::AcquirePipe(Pipe* pipe) {
+  if (!pipe_pool_.empty()) {
+    pipe->rfd = pipe_pool_.back().first;
+    pipe->wfd = pipe_pool_.back().second;
+    pipe_pool_.pop_back();
+    return 0;
+  }
+
+  int fds[2];
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+    return -1;
+  }
+  pipe->rfd = fds[0];
+  pipe->wfd = fds[1];
+  return 0;
+}
+
+void Server::ReleasePipe(Pipe* pipe) {
+  // a pipe still holding payload of an aborted relay cannot be reused
+  if (pipe->rfd != -1 && pipe->bytes == 0 &&
+      pipe_pool_.size() < kMaxPooledPipes) {
+    pipe_pool_.emplace_back(pipe->rfd, pipe->wfd);
+    pipe->rfd = pipe->wfd = -1;
+  }
+}
+
+void Server::FreeConn(Conn* conn) {
+  timer_wheel_.Remove(&conn->timer);
+  if (conn->peer_held) {
+    peer_limiter_.Release(conn->peer_key);
+  }
+  if (conn->source_held) {
+    source_limiter_.Release(conn->source_key);
+  }
+  metrics_.lifetime.Record(GetSteadyTimeNs() - conn->accept_ns);
+  ReleasePipe(&conn->up);
+  ReleasePipe(&conn->down);
+
+  if (conn->ibuf != conn->inline_buf) {
+    if (spill_pool_.size() < kMaxSpillBlocks) {
+      spill_pool_.push_back(conn->ibuf);
     } else {
-      LOGW("%s recv err %s", conn->cname(), strerror(errno));
+      delete[] conn->ibuf;
+    }
+  }
+
+  CONN_LOGD(conn, "%s close fd %d", conn->cname(), conn->client.fd);
+  uint64_t handle = conn->handle;
+  conn->Reset();
+  conns_.Free(handle);
+}
+
+void Server::ScheduleTimer(Conn* conn) {
+  // the header deadline also covers the backend connect of forward mode
+  uint64_t accept_ms = conn->accept_ns / 1000000;
+  uint64_t deadline = UINT64_MAX;
+  if (conf_->header_timeout > 0 && conn->state != kRelaying) {
+    deadline = accept_ms + conf_->header_timeout;
+  }
+  if (conf_->max_lifetime > 0) {
+    deadline = std::min<uint64_t>(deadline,
+                                  accept_ms + conf_->max_lifetime * 1000ULL);
+  }
+
+  if (deadline == UINT64_MAX) {
+    timer_wheel_.Remove(&conn->timer);
+  } else {
+    timer_wheel_.Add(&conn->timer,
+                     (deadline + kTimerTickMs - 1) / kTimerTickMs);
+  }
+}
+
+void Server::ExpireConns() {
+  uint64_t now = GetSteadyTimeMs();
+  timer_wheel_.Advance(now / kTimerTickMs, [this, now](TimerNode* node) {
+    if (node->data & kMetricsFlag) {
+      LIMITED_LOGI("metrics connection timeout");
+      CloseMetricsConn(&metrics_conns_[node->data & ~kMetricsFlag]);
+    } else {
+      OnTimeout(node->data, now);
+    }
+  });
+}
+
+void Server::OnTimeout(uint64_t handle, uint64_t now_ms) {
+  Conn* conn = conns_.Get(handle);
+  if (conn == nullptr) return;
+
+  bool lifetime =
+      conf_->max_lifetime > 0 &&
+      now_ms >= conn->accept_ns / 1000000 + conf_->max_lifetime * 1000ULL;
+  if (lifetime) {
+    metrics_.lifetime_timeouts.Add();
+  } else {
+    metrics_.header_timeouts.Add();
+  }
+  LIMITED_LOGI("%s %s timeout", conn->cname(),
+               lifetime ? "lifetime" : "header");
+  conn->state = kDisconnected;
+  CloseConn(conn);
+}
+
+bool Server::AllowErrorLog() {
+  if (conf_->log_error_rate == 0) return true;
+
+  size_t now = GetSteadyTime();
+  if (now != error_log_time_) {
+    error_log_time_ = now;
+    error_log_count_ = 0;
+  }
+  if (error_log_count_ < conf_->log_error_rate) {
+    ++error_log_count_;
+    return true;
+  }
+  metrics_.log_suppressed.Add();
+  return false;
+}
+
+void Server::CollectStats(Stats* stats) const {
+  stats->accepted = metrics_.accepts.Get();
+  stats->decoded_v1 = metrics_.decoded[1].Get();
+  stats->decoded_v2 = metrics_.decoded[2].Get();
+  stats->closed_by_peer = metrics_.closed_by_peer.Get();
+  stats->over_limit = metrics_.conn_limit_rejects.Get();
+  stats->untrusted =
+      metrics_.untrusted[0].Get() + metrics_.untrusted[1].Get();
+  stats->rate_limited = 0;
+  for (int i = 0; i < 2; ++i) {
+    stats->rate_limited +=
+        metrics_.rate_limited[i][0].Get() + metrics_.rate_limited[i][1].Get();
+  }
+  stats->oversized = metrics_.oversized.Get();
+  stats->timed_out =
+      metrics_.header_timeouts.Get() + metrics_.lifetime_timeouts.Get();
+  for (int i = 0; i < 16; ++i) {
+    stats->decode_errors[i] = metrics_.decode_errors[i].Get();
+  }
+  stats->suppressed = metrics_.log_suppressed.Get();
+}
+
+void Server::ReportStats() {
+  if (conf_->stats_interval == 0) return;
+
+  size_t now = GetSteadyTime();
+  if (now < stats_time_ + conf_->stats_interval) return;
+
+  Stats cur;
+  CollectStats(&cur);
+  Stats d;
+  d.accepted = cur.accepted - stats_.accepted;
+  d.decoded_v1 = cur.decoded_v1 - stats_.decoded_v1;
+  d.decoded_v2 = cur.decoded_v2 - stats_.decoded_v2;
+  d.closed_by_peer = cur.closed_by_peer - stats_.closed_by_peer;
+  d.over_limit = cur.over_limit - stats_.over_limit;
+  d.untrusted = cur.untrusted - stats_.untrusted;
+  d.rate_limited = cur.rate_limited - stats_.rate_limited;
+  d.oversized = cur.oversized - stats_.oversized;
+  d.timed_out = cur.timed_out - stats_.timed_out;
+  for (int i = 0; i < 16; ++i) {
+    d.decode_errors[i] = cur.decode_errors[i] - stats_.decode_errors[i];
+  }
+  d.suppressed = cur.suppressed - stats_.suppressed;
+
+  // only the error codes that occurred, as " code:count"
+  char errors[512] = "";
+  size_t len = 0;
+  for (int i = 1; i < 16 && len < sizeof(errors); ++i) {
+    if (d.decode_errors[i] != 0) {
+      len += snprintf(errors + len, sizeof(errors) - len, " %d:%" PRIu64, -i,
+                      d.decode_errors[i]);
+    }
+  }
+
+  LOGI("reactor#%d %zus: accepted %" PRIu64 " v1 %" PRIu64 " v2 %" PRIu64
+       " closed-by-peer %" PRIu64 " over-limit %" PRIu64 " untrusted %" PRIu64
+       " rate-limited %" PRIu64 " oversized %" PRIu64 " timed-out %" PRIu64
+       " decode-errors%s suppressed %" PRIu64,
+       id_, now - stats_time_, d.accepted, d.decoded_v1, d.decoded_v2,
+       d.closed_by_peer, d.over_limit, d.untrusted, d.rate_limited,
+       d.oversized, d.timed_out, len > 0 ? errors : " 0", d.suppressed);
+  stats_ = cur;
+  stats_time_ = now;
+}
+
+void Server::OnNewMetricsConn() {
+  for (;;) {
+    int sockfd =
+        accept4(metrics_sockfd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sockfd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOGE("metrics accept err %s", strerror(errno));
+      }
+      return;
+    }
+
+    size_t i = 0;
+    while (i < metrics_conns_.size() && metrics_conns_[i].fd != -1) ++i;
+    if (i == metrics_conns_.size()) {
+      Close(sockfd);
+      LIMITED_LOGI("too many metrics connections");
+      continue;
     }
+    MetricsConn* mc = &metrics_conns_[i];
+    mc->fd = sockfd;
+    mc->timer.data = kMetricsFlag | i;
+    uint64_t deadline = GetSteadyTimeMs() + kMetricsTimeoutMs;
+    timer_wheel_.Add(&mc->timer, (deadline + kTimerTickMs - 1) / kTimerTickMs);
+    Update(POLLER_ADD, sockfd, kReadEvent, mc->timer.data);
   }
+}
+
+void Server::OnMetricsEvt(uint64_t handle, int events) {
+  size_t i = static_cast<size_t>(handle & ~kMetricsFlag);
+  if (i >= metrics_conns_.size() || metrics_conns_[i].fd == -1) return;
+  MetricsConn* mc = &metrics_conns_[i];
 
-  if (events & POLLOUT) {
-    // writable
-    if (!conn->obuf.empty()) {
-      //
+  if (events & (POLLERR | POLLNVAL)) {
+    CloseMetricsConn(mc);
+    return;
+  }
+
+  if (!mc->replying) {
+    // read until EAGAIN, which edge-triggered mode needs as well
+    char buf[1024];
+    for (;;) {
+      ssize_t n = recv(mc->fd, buf, sizeof(buf), 0);
+      if (n > 0) {
+        mc->buf.append(buf, n);
+        if (mc->buf.size() > kMaxMetricsRequest) {
+          CloseMetricsConn(mc);
+          return;
+        }
+      } else if (n == -1 && errno == EINTR) {
+        continue;
+      } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      } else {
+        CloseMetricsConn(mc);
+        return;
+      }
     }
+    if (mc->buf.find("\r\n\r\n") == std::string::npos) return;
+
+    bool found = mc->buf.compare(0, 13, "GET /metrics ") == 0 ||
+                 mc->buf.compare(0, 13, "GET /metrics?") == 0;
+    std::string body;
+    if (found) {
+      RenderMetrics(&body);
+    } else {
+      body = "not found\n";
+    }
+    char head[160];
+    snprintf(head, sizeof(head),
+             "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+             "Connection: close\r\n\r\n",
+             found ? "200 OK" : "404 Not Found",
+             found ? "text/plain; version=0.0.4" : "text/plain", body.size());
+    mc->buf = head;
+    mc->buf += body;
+    mc->pos = 0;
+    mc->replying = true;
+    Update(POLLER_MODIFY, mc->fd, kWriteEvent, handle);
+  }
 
-    if (conn->obuf.empty()) {
-      DisableWriting(conn);
+  while (mc->pos < mc->buf.size()) {
+    ssize_t n = send(mc->fd, mc->buf.data() + mc->pos,
+                     mc->buf.size() - mc->pos, MSG_NOSIGNAL);
+    if (n > 0) {
+      mc->pos += n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    } else if (errno != EINTR) {
+      break;
     }
   }
+  CloseMetricsConn(mc);
+}
+
+void Server::CloseMetricsConn(MetricsConn* mc) {
+  if (mc->fd == -1) return;
+  timer_wheel_.Remove(&mc->timer);
+  if (poller_) {
+    Update(POLLER_REMOVE, mc->fd, kNoneEvent, 0);
+  }
+  Close(mc->fd);
+  std::string().swap(mc->buf);
+  mc->pos = 0;
+  mc->replying = false;
 }
@@ -12,41 +12,147 @@
 #pragma once
 
 #include <stdint.h>
-#include <sys/epoll.h>
 
-#include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "conf.h"
+#include "export_ring.h"
+#include "inet_address.h"
+#include "metrics.h"
+#include "poller.h"
+#include "prefix_set.h"
+#include "proxyproto.h"
+#include "rate_limiter.h"
+#include "record_file.h"
+#include "slab.h"
+#include "timing_wheel.h"
 
 class Server {
   enum ConnState {
     kDisconnected,
+    // reading the proxy header
     kConnected,
+    // header decoded, non-blocking connect to the forward backend in flight
+    kConnecting,
+    // relaying payload between client and backend
+    kRelaying,
+  };
+
+  // covers any v1 line and v2 headers carrying a few hundred bytes of TLVs
+  static const size_t kInlineBufSize = 512;
+
+  struct Endpoint {
+    int fd;
+    int watch_events;
+  };
+
+  // one relay direction: src socket -> pipe -> dst socket via splice()
+  struct Pipe {
+    int rfd;
+    int wfd;
+    // spliced into the pipe but not yet out of it
+    size_t bytes;
+    uint64_t total;
+    // src reached EOF, dst is shut down for writing once the pipe drains
+    bool eof;
   };
 
   struct Conn {
-    std::string name;
+    char name[48];
+    uint64_t handle;
     int state;
-    int sockfd;
-    int watch_events;
+    Endpoint client;
+    Endpoint backend;
+    bool read_pending;
+    // logged in full, see Conf::log_sample
+    bool sampled;
     size_t conn_time;
-    std::string ibuf;
-    std::string obuf;
+    // steady clock nanoseconds at accept
+    uint64_t accept_ns;
+    // the nearer of the header and lifetime deadlines, data is the handle
+    TimerNode timer;
+    // points to inline_buf, or to a spill block for oversized v2 headers
+    char* ibuf;
+    // in forward mode, ibuf[ipos, ilen) is payload read along with the
+    // header that still has to be sent to the backend
+    size_t ipos;
+    size_t ilen;
+    size_t icap;
+    Pipe up;    // client -> backend
+    Pipe down;  // backend -> client
+    // the addresses of the per address limits, *_held while the connection
+    // counts towards their concurrent connection limit
+    RateKey peer_key;
+    RateKey source_key;
+    bool peer_held;
+    bool source_held;
+    // the connected peer, kept for the export ring only
+    PackedInetAddress peer;
+    char inline_buf[kInlineBufSize];
 
     Conn()
-        : state(kDisconnected),
-          sockfd(-1),
-          watch_events(kNoneEvent),
-          conn_time(0) {}
+        : handle(0),
+          state(kDisconnected),
+          client{-1, kNoneEvent},
+          backend{-1, kNoneEvent},
+          read_pending(false),
+          sampled(false),
+          conn_time(0),
+          accept_ns(0),
+          ibuf(inline_buf),
+          ipos(0),
+          ilen(0),
+          icap(sizeof(inline_buf)),
+          up{-1, -1, 0, 0, false},
+          down{-1, -1, 0, 0, false},
+          peer_key{0, 0},
+          source_key{0, 0},
+          peer_held(false),
+          source_held(false),
+          peer() {
+      name[0] = '\0';
+    }
     ~Conn();
-    const char* cname() const { return name.c_str(); }
+    void Reset();
+    const char* cname() const { return name; }
+  };
+
+  // a scrape of the metrics endpoint, one request per connection
+  struct MetricsConn {
+    int fd;
+    // the request while reading it, then the response
+    std::string buf;
+    // response bytes sent
+    size_t pos;
+    bool replying;
+    // closes the scrape after kMetricsTimeoutMs, data is its handle
+    TimerNode timer;
+
+    MetricsConn() : fd(-1), pos(0), replying(false) {}
+  };
+
+  // the totals of the summary line, summed up from ReactorMetrics
+  struct Stats {
+    uint64_t accepted;
+    uint64_t decoded_v1;
+    uint64_t decoded_v2;
+    uint64_t closed_by_peer;
+    uint64_t over_limit;
+    uint64_t untrusted;
+    uint64_t rate_limited;
+    uint64_t oversized;
+    uint64_t timed_out;
+    // indexed by the negated DecodeProxyProto() error code
+    uint64_t decode_errors[16];
+    // warnings left out by the per second limit
+    uint64_t suppressed;
   };
 
  public:
-  explicit Server(std::shared_ptr<Conf> conf);
+  explicit Server(std::shared_ptr<Conf> conf, int id = 0);
   ~Server();
 
   Server(const Server&) = delete;
@@ -56,29 +162,143 @@ class Server {
   int Stop();
   int Poll(int timeout);
 
+  /**
+   * @brief 按进程可打开的文件数估算每个 reactor 的连接上限
+   *
+   * 扣除日志、poller、监听与指标 socket、转发模式下的管道池后平分给各
+   * reactor，每个连接按客户端一个 fd 计，转发模式另加后端 socket 与两个管道。
+   *
+   * @param max_files RLIMIT_NOFILE 的软限制
+   * @return int 不超过 kMaxAutoConns，至少为 1
+   */
+  static int ConnLimitFromFiles(uint64_t max_files, const Conf& conf);
+
  private:
-  void Update(int operation, int sockfd, int events, void* userp);
-  void Update(Conn* conn);
-  void EnableReading(Conn* conn);
-  void EnableWriting(Conn* conn);
-  void DisableReading(Conn* conn);
-  void DisableWriting(Conn* conn);
-  void HandleEvents(int events, void* userp);
+  // operation is a PollerOp
+  void Update(int operation, int sockfd, int events, uint64_t handle);
+  void Update(Conn* conn, Endpoint* ep);
+  void EnableReading(Conn* conn, Endpoint* ep);
+  void EnableWriting(Conn* conn, Endpoint* ep);
+  void DisableReading(Conn* conn, Endpoint* ep);
+  void DisableWriting(Conn* conn, Endpoint* ep);
+  void HandleEvents(int events, uint64_t handle);
   void OnNewConn(int events);
+  void OnAccepted(int res);
+  void RearmAccept();
+  void AddConn(int sockfd, const struct sockaddr* peer);
+  bool IsTrusted(int sockfd, const struct sockaddr* peer);
+  bool Admit(RateLimiter* limiter, int key, const RateKey& addr,
+             uint64_t now_ms, bool* held);
+  void OnRecv(uint64_t handle, int res, const char* buf);
+  int StartMetrics();
+  void OnNewMetricsConn();
+  void OnMetricsEvt(uint64_t handle, int events);
+  void CloseMetricsConn(MetricsConn* mc);
   void OnConnEvt(Conn* conn, int events);
+  void OnBackendEvt(Conn* conn, int events);
+  void OnRelayEvt(Conn* conn, Endpoint* ep, int events);
+  void OnReadable(Conn* conn);
+  void DecodeInput(Conn* conn);
+  void ExportConn(Conn* conn, const ProxyProtoResult& res, int header_len,
+                  uint64_t wall_ns);
+  // res is null when decoding failed with error
+  void RecordConn(const ProxyProtoResult* res, int error, uint64_t wall_ns);
+  size_t ReserveInput(Conn* conn);
+  void Connect(Conn* conn);
+  void StartRelay(Conn* conn);
+  void Relay(Conn* conn, Pipe* pipe, Endpoint* src, Endpoint* dst);
+  bool FlushInput(Conn* conn);
+  void SetPending(Conn* conn);
+  int AcquirePipe(Pipe* pipe);
+  void ReleasePipe(Pipe* pipe);
+  void FreeConn(Conn* conn);
+  void HandlePending();
+  void ScheduleTimer(Conn* conn);
+  void ExpireConns();
+  void OnTimeout(uint64_t handle, uint64_t now_ms);
+  void CloseConn(Conn* conn);
+  bool AllowErrorLog();
+  void CollectStats(Stats* stats) const;
+  void ReportStats();
+  void ResizeEvents(int num_events);
 
  private:
-  static const size_t kInitialEventsNum;
-  static const size_t kMaxEventsNum;
   static const int kNoneEvent;
   static const int kReadEvent;
   static const int kWriteEvent;
-  static const size_t kMaxConnNum;
+  static const uint64_t kReservedFiles;
+  static const int kMaxAutoConns;
+  static const size_t kAcceptBudget;
+  static const size_t kReadBudget;
+  static const uint64_t kAcceptRetryMs;
+  static const uint64_t kListenHandle;
+  static const size_t kMaxSpillBlocks;
+  static const uint64_t kBackendFlag;
+  static const size_t kRelayBudget;
+  static const size_t kPipeSize;
+  static const size_t kMaxPooledPipes;
+  static const uint64_t kMetricsHandle;
+  static const uint64_t kMetricsFlag;
+  static const size_t kMaxMetricsConns;
+  static const size_t kMaxMetricsRequest;
+  static const uint64_t kMetricsTimeoutMs;
+  static const uint64_t kTimerTickMs;
 
   std::shared_ptr<Conf> conf_;
-  int epoll_fd_;
+  int id_;
+  std::unique_ptr<Poller> poller_;
   int listen_sockfd_;
   uint32_t conn_index_;
-  std::vector<struct epoll_event> active_events_;
-  std::map<Conn*, std::unique_ptr<Conn>> conns_;
+  // the poller reports readiness once per edge, sockets are drained
+  bool edge_triggered_;
+  // client headers arrive as POLLER_RECV events instead of readiness
+  bool recv_multishot_;
+  // ProxyProtoDecodeFlag
+  int decode_flags_;
+  // sockets left undrained because they ran out of budget, retried before
+  // the next Wait() blocks, or a multishot accept ended by an error
+  bool accept_pending_;
+  // steady clock milliseconds before which the accept is not retried, 0
+  // when it is not held back
+  uint64_t accept_retry_ms_;
+  std::vector<uint64_t> read_pending_;
+  std::vector<uint64_t> read_pending_swap_;
+  std::vector<PollerEvent> active_events_;
+  // moving average of events per wakeup in 1/64ths, for --adaptive
+  uint32_t events_avg_;
+  // PollerEvent.data carries the slab handle of each connection
+  Slab<Conn> conns_;
+  // free conf_->max_header_bytes sized blocks shared by all connections
+  std::vector<char*> spill_pool_;
+  // empty relay pipes of closed connections, as {read fd, write fd}
+  std::vector<std::pair<int, int>> pipe_pool_;
+  bool forward_;
+  InetAddress forward_addr_;
+  // the list of --trusted-proxies as of trusted_version_, null when every
+  // peer is trusted
+  std::shared_ptr<const PrefixSet> trusted_;
+  uint64_t trusted_version_;
+  // --peer-rate and --peer-conns at accept, --source-rate and --source-conns
+  // once the header is decoded
+  RateLimiter peer_limiter_;
+  RateLimiter source_limiter_;
+  // this reactor's ring of --export-ring
+  ExportRingWriter export_;
+  // this reactor's segment files in --record-dir
+  RecordWriter records_;
+  // as of the last summary line, which reports the difference
+  Stats stats_;
+  size_t stats_time_;
+  // accepted connections, picks the sampled ones
+  uint64_t accept_count_;
+  // error lines logged within error_log_time_
+  size_t error_log_time_;
+  int error_log_count_;
+  // registered for the metrics endpoint while started
+  ReactorMetrics metrics_;
+  // reactor#0 serves the endpoint for all reactors, -1 on the others
+  int metrics_sockfd_;
+  std::vector<MetricsConn> metrics_conns_;
+  // deadlines of connections, in kTimerTickMs ticks of the steady clock
+  TimingWheel timer_wheel_;
 };
@@ -0,0 +1,159 @@
+/**
+ * @file slab.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <new>
+
+/**
+ * @brief 定长对象池
+ *
+ * 槽位一次性预分配并按缓存行对齐，空闲槽位通过侵入式链表串联，分配与释放均为
+ * O(1) 且不触发内存分配。对象在 Init() 时构造、在析构时销毁，期间反复复用。
+ *
+ * 句柄高 32 位为槽位代数，低 32 位为槽位下标。槽位每次分配、释放都会递增代数
+ * （使用中为奇数），已回收槽位的旧句柄在 Get() 中会被识别为失效。
+ */
+template <typename T>
+class Slab {
+  struct alignas(64) Slot {
+    T value;
+    uint32_t generation;
+    uint32_t next_free;
+  };
+
+ public:
+  static const uint64_t kInvalidHandle = UINT64_MAX;
+
+  Slab() : slots_(nullptr), capacity_(0), size_(0), free_head_(kNil) {}
+  ~Slab() { Destroy(); }
+
+  Slab(const Slab&) = delete;
+  Slab& operator=(const Slab&) = delete;
+
+  /**
+   * @brief 销毁现有对象并预分配 capacity 个槽位
+   *
+   * @return int 0 表示成功，-1 表示内存不足
+   */
+  int Init(size_t capacity) {
+    Destroy();
+    if (capacity == 0 || capacity >= kNil) return -1;
+
+    void* mem = nullptr;
+    if (posix_memalign(&mem, alignof(Slot), capacity * sizeof(Slot)) != 0) {
+      return -1;
+    }
+
+    slots_ = static_cast<Slot*>(mem);
+    for (size_t i = 0; i < capacity; ++i) {
+      new (&slots_[i]) Slot();
+      slots_[i].generation = 0;
+      slots_[i].next_free = static_cast<uint32_t>(i + 1);
+    }
+    slots_[capacity - 1].next_free = kNil;
+    capacity_ = capacity;
+    size_ = 0;
+    free_head_ = 0;
+    return 0;
+  }
+
+  /**
+   * @brief 分配一个槽位
+   *
+   * @param handle 输出的句柄
+   * @return T* 槽位对象，已满时返回 nullptr
+   */
+  T* Alloc(uint64_t* handle) {
+    if (free_head_ == kNil) return nullptr;
+
+    uint32_t index = free_head_;
+    Slot& slot = slots_[index];
+    free_head_ = slot.next_free;
+    ++slot.generation;
+    ++size_;
+    *handle = MakeHandle(index, slot.generation);
+    return &slot.value;
+  }
+
+  /**
+   * @brief 释放句柄对应的槽位，失效句柄将被忽略
+   */
+  void Free(uint64_t handle) {
+    if (Get(handle) == nullptr) return;
+
+    uint32_t index = static_cast<uint32_t>(handle);
+    Slot& slot = slots_[index];
+    ++slot.generation;
+    slot.next_free = free_head_;
+    free_head_ = index;
+    --size_;
+  }
+
+  /**
+   * @brief 按句柄查找对象
+   *
+   * @return T* 句柄失效（越界、槽位空闲或已被复用）时返回 nullptr
+   */
+  T* Get(uint64_t handle) const {
+    uint32_t index = static_cast<uint32_t>(handle);
+    uint32_t generation = static_cast<uint32_t>(handle >> 32);
+    if (index >= capacity_) return nullptr;
+
+    Slot& slot = slots_[index];
+    if (slot.generation != generation || !(generation & 1)) return nullptr;
+    return &slot.value;
+  }
+
+  /**
+   * @brief 遍历所有使用中的槽位，f 的签名为 void(uint64_t handle, T* value)
+   */
+  template <typename F>
+  void ForEach(F f) {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (slots_[i].generation & 1) {
+        f(MakeHandle(static_cast<uint32_t>(i), slots_[i].generation),
+          &slots_[i].value);
+      }
+    }
+  }
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+
+ private:
+  static const uint32_t kNil = UINT32_MAX;
+
+  static uint64_t MakeHandle(uint32_t index, uint32_t generation) {
+    return (static_cast<uint64_t>(generation) << 32) | index;
+  }
+
+  void Destroy() {
+    if (slots_ == nullptr) return;
+
+    for (size_t i = 0; i < capacity_; ++i) {
+      slots_[i].~Slot();
+    }
+    free(slots_);
+    slots_ = nullptr;
+    capacity_ = 0;
+    size_ = 0;
+    free_head_ = kNil;
+  }
+
+  Slot* slots_;
+  size_t capacity_;
+  size_t size_;
+  uint32_t free_head_;
+};
@@ -0,0 +1,215 @@
+/**
+ * @file timing_wheel.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-21
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief 定时器节点，嵌入在被定时的对象中
+ *
+ * data 由使用者设置，到期回调时原样带回。
+ */
+struct TimerNode {
+  TimerNode* prev;
+  TimerNode* next;
+  uint64_t expire;
+  uint64_t data;
+  // 所在槽位，kDetached 表示不在任何槽位
+  uint32_t slot;
+
+  static const uint32_t kDetached = UINT32_MAX;
+
+  TimerNode()
+      : prev(nullptr), next(nullptr), expire(0), data(0), slot(kDetached) {}
+  bool linked() const { return prev != nullptr; }
+};
+
+/**
+ * @brief 分层时间轮
+ *
+ * 共 kLevels 层，每层 kSlots 个槽位，第 n 层一个槽位跨 kSlots^n 个 tick。添加、
+ * 删除为 O(1)；Advance() 只访问到期的槽位，上层槽位在下层转完一圈时整体下移，
+ * 每层用位图记录非空槽位，空槽位直接跳过，不存在按 tick 或按定时器的扫描。
+ *
+ * 时间以调用方定义的 tick 为单位，expire 为绝对 tick，在 Advance(now) 中
+ * now >= expire 时到期。
+ */
+class TimingWheel {
+ public:
+  static const int kLevels = 4;
+  static const int kSlotBits = 6;
+  static const uint32_t kSlots = 1 << kSlotBits;
+  static const uint64_t kSlotMask = kSlots - 1;
+  static const uint64_t kNoTick = UINT64_MAX;
+
+  explicit TimingWheel(uint64_t now = 0) : current_(now), size_(0) {
+    for (int i = 0; i < kLevels; ++i) {
+      bitmap_[i] = 0;
+    }
+    for (uint32_t i = 0; i < kLevels * kSlots; ++i) {
+      slots_[i].prev = slots_[i].next = &slots_[i];
+    }
+  }
+
+  TimingWheel(const TimingWheel&) = delete;
+  TimingWheel& operator=(const TimingWheel&) = delete;
+
+  size_t size() const { return size_; }
+
+  /**
+   * @brief 添加或重新设置定时器，已处理过的 expire 按下一个 tick 计
+   */
+  void Add(TimerNode* node, uint64_t expire) {
+    Remove(node);
+    node->expire = expire;
+    Link(node);
+    ++size_;
+  }
+
+  void Remove(TimerNode* node) {
+    if (!node->linked()) return;
+    Unlink(node);
+    --size_;
+  }
+
+  /**
+   * @brief 推进到 now，对每个到期的节点先移出时间轮再调用 fn(node)
+   *
+   * fn 中可以添加、删除任意定时器，包括同一批到期的其他节点。
+   */
+  template <typename Fn>
+  void Advance(uint64_t now, Fn fn) {
+    while (current_ <= now) {
+      if (size_ == 0) {
+        current_ = now + 1;
+        break;
+      }
+
+      uint64_t next = NextTick();
+      if (next > now) {
+        current_ = now + 1;
+        break;
+      }
+      current_ = next;
+
+      if ((current_ & kSlotMask) == 0) {
+        Cascade();
+      }
+
+      // detach the slot first, fn may add timers back into it or remove
+      // others that expire along with it
+      uint32_t index = static_cast<uint32_t>(current_ & kSlotMask);
+      TimerNode expired;
+      expired.prev = expired.next = &expired;
+      Splice(&slots_[index], &expired);
+      bitmap_[0] &= ~(1ULL << index);
+      ++current_;
+
+      while (expired.next != &expired) {
+        TimerNode* node = expired.next;
+        Unlink(node);
+        --size_;
+        fn(node);
+      }
+    }
+  }
+
+  /**
+   * @brief 下一个需要 Advance() 处理的 tick，可能是到期槽位，也可能是上层槽位
+   * 下移的时刻；时间轮为空时返回 kNoTick
+   */
+  uint64_t NextTick() const {
+    if (size_ == 0) return kNoTick;
+    uint64_t index = current_ & kSlotMask;
+    if (index == 0) return current_;
+    uint64_t bits = bitmap_[0] >> index;
+    if (bits != 0) return current_ + __builtin_ctzll(bits);
+    return (current_ | kSlotMask) + 1;
+  }
+
+ private:
+  void Link(TimerNode* node) {
+    uint64_t expire = node->expire < current_ ? current_ : node->expire;
+    uint64_t delta = expire - current_;
+    int level = 0;
+    while (level < kLevels - 1 &&
+           delta >= (1ULL << ((level + 1) * kSlotBits))) {
+      ++level;
+    }
+    // beyond the top level, parked in its farthest slot and placed again
+    // each time that slot comes down
+    if (level == kLevels - 1 &&
+        delta >= (1ULL << (kLevels * kSlotBits)) - kSlots) {
+      expire = current_ + (1ULL << (kLevels * kSlotBits)) - kSlots;
+    }
+    uint32_t index =
+        static_cast<uint32_t>((expire >> (level * kSlotBits)) & kSlotMask);
+    TimerNode* head = &slots_[level * kSlots + index];
+    node->slot = level * kSlots + index;
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+    bitmap_[level] |= 1ULL << index;
+  }
+
+  void Unlink(TimerNode* node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    if (node->slot != TimerNode::kDetached) {
+      TimerNode* head = &slots_[node->slot];
+      if (head->next == head) {
+        bitmap_[node->slot / kSlots] &= ~(1ULL << (node->slot % kSlots));
+      }
+    }
+    node->prev = node->next = nullptr;
+    node->slot = TimerNode::kDetached;
+  }
+
+  // moves the list of head to the empty list dst, its nodes are detached
+  void Splice(TimerNode* head, TimerNode* dst) {
+    if (head->next == head) return;
+    dst->next = head->next;
+    dst->prev = head->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+    head->prev = head->next = head;
+    for (TimerNode* node = dst->next; node != dst; node = node->next) {
+      node->slot = TimerNode::kDetached;
+    }
+  }
+
+  // level 0 wrapped around, brings the due slot of each upper level down
+  void Cascade() {
+    for (int level = 1; level < kLevels; ++level) {
+      uint32_t index = static_cast<uint32_t>(
+          (current_ >> (level * kSlotBits)) & kSlotMask);
+      TimerNode moved;
+      moved.prev = moved.next = &moved;
+      Splice(&slots_[level * kSlots + index], &moved);
+      bitmap_[level] &= ~(1ULL << index);
+      while (moved.next != &moved) {
+        TimerNode* node = moved.next;
+        Unlink(node);
+        Link(node);
+      }
+      if (index != 0) break;
+    }
+  }
+
+  // the next tick to process, everything before it has fired
+  uint64_t current_;
+  size_t size_;
+  uint64_t bitmap_[kLevels];
+  TimerNode slots_[kLevels * kSlots];
+};
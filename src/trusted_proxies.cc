@@ -0,0 +1,44 @@
+/**
+ * @file trusted_proxies.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-27
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "trusted_proxies.h"
+
+#include <atomic>
+#include <mutex>
+
+static std::mutex g_mutex;
+static std::shared_ptr<const PrefixSet> g_trusted;
+static std::atomic<uint64_t> g_version(0);
+
+int LoadTrustedProxies(const char* path, int* line) {
+  // parsed and compiled outside the lock, readers keep using the old list
+  std::shared_ptr<PrefixSet> set(new PrefixSet);
+  int err = set->LoadFile(path, line);
+  if (err != 0) {
+    return err;
+  }
+  set->Build();
+
+  // the old list is freed by whichever reactor drops it last
+  std::lock_guard<std::mutex> lock(g_mutex);
+  g_trusted = std::move(set);
+  g_version.fetch_add(1, std::memory_order_release);
+  return 0;
+}
+
+uint64_t TrustedProxiesVersion() {
+  return g_version.load(std::memory_order_acquire);
+}
+
+std::shared_ptr<const PrefixSet> GetTrustedProxies() {
+  std::lock_guard<std::mutex> lock(g_mutex);
+  return g_trusted;
+}
@@ -0,0 +1,46 @@
+/**
+ * @file trusted_proxies.h
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-27
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+
+#include "prefix_set.h"
+
+// 不受信任地址的连接如何处理，见 --untrusted
+enum UntrustedPolicy {
+  // 读取头部前关闭
+  UNTRUSTED_REJECT,
+  // 不解析头部，原样转发给后端，只用于转发模式
+  UNTRUSTED_PASSTHROUGH,
+};
+
+/**
+ * @brief 从 path 加载受信任代理列表，成功后替换当前列表，失败时当前列表不变
+ *
+ * @param line 格式错误时写入出错的行号
+ * @return int 0 成功；-1 无法打开文件；-2 第 *line 行格式错误
+ */
+int LoadTrustedProxies(const char* path, int* line);
+
+/**
+ * @brief 当前列表的版本，每次加载成功加一，读者据此判断是否需要换用新列表
+ */
+uint64_t TrustedProxiesVersion();
+
+/**
+ * @brief 当前列表，未加载时为空
+ *
+ * 加锁复制，只应在版本变化时调用；返回的列表只读，可在任意线程无锁查询。
+ */
+std::shared_ptr<const PrefixSet> GetTrustedProxies();
@@ -0,0 +1,761 @@
+/**
+ * @file loadgen.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-25
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "proxyproto.h"
+
+enum ConnKind {
+  kNormal,
+  // sends one byte every Options::slow_interval_ms
+  kSlow,
+  // connects and never sends, waits for the server to give up
+  kIdle,
+};
+
+enum ConnError {
+  kErrConnect,
+  kErrReset,
+  kErrTimeout,
+  // the server closed before the whole header was sent
+  kErrEarlyClose,
+  kErrOther,
+  kNumErrors,
+};
+
+static const char* const kErrorNames[kNumErrors] = {
+    "connect", "reset", "timeout", "early-close", "other"};
+
+struct Options {
+  std::string host;
+  int port;
+  int threads;
+  // connections in flight across all threads
+  int connections;
+  // new connections per second across all threads, 0 for as fast as the
+  // in-flight limit allows
+  double rate;
+  // start on schedule whatever is in flight, latency counts from the
+  // scheduled time
+  bool open_loop;
+  double duration;
+  // 1, 2 or 0 for both
+  int version;
+  // writes per header and the pause between them
+  int split;
+  int split_delay_ms;
+  int slow_percent;
+  int slow_interval_ms;
+  int idle_percent;
+  int timeout_ms;
+  // sampled for its RSS when set
+  int server_pid;
+  double interval;
+
+  Options()
+      : host("127.0.0.1"),
+        port(0),
+        threads(1),
+        connections(100),
+        rate(0),
+        open_loop(false),
+        duration(10),
+        version(0),
+        split(1),
+        split_delay_ms(0),
+        slow_percent(0),
+        slow_interval_ms(100),
+        idle_percent(0),
+        timeout_ms(10000),
+        server_pid(0),
+        interval(1) {}
+};
+
+static uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/* Counters of one worker, written by it alone and read by the reporter like
+ * the reactor metrics of the server.
+ */
+struct WorkerStats {
+  Counter started;
+  Counter completed;
+  // idle connections the server closed
+  Counter idle_closed;
+  // open-loop starts skipped for lack of a free slot
+  Counter dropped;
+  Counter errors[kNumErrors];
+  std::atomic<int64_t> inflight;
+  // start to close of completed connections, in nanoseconds
+  Histogram latency;
+
+  WorkerStats() : inflight(0) {}
+};
+
+class Worker {
+  struct Conn {
+    int fd;
+    uint32_t gen;
+    int kind;
+    bool connected;
+    // latency counts from here
+    uint64_t start_ns;
+    const std::string* header;
+    size_t sent;
+    // writes done of Options::split
+    int chunk;
+  };
+
+  struct Timer {
+    uint64_t at;
+    uint32_t index;
+    uint32_t gen;
+    // a send of the next chunk, otherwise the connection timeout
+    bool send;
+
+    bool operator>(const Timer& other) const { return at > other.at; }
+  };
+
+ public:
+  Worker(const Options& opts, const struct sockaddr_storage& addr,
+         socklen_t addrlen, const std::vector<std::string>& headers, int id)
+      : opts_(opts),
+        addr_(addr),
+        addrlen_(addrlen),
+        headers_(headers),
+        epoll_fd_(-1),
+        rng_(static_cast<unsigned>(id) + 1) {
+    // the in-flight limit is split evenly, the first threads take the rest
+    int cap = opts.connections / opts.threads +
+              (id < opts.connections % opts.threads ? 1 : 0);
+    conns_.resize(std::max(cap, 1));
+    for (size_t i = conns_.size(); i > 0; --i) {
+      conns_[i - 1].fd = -1;
+      conns_[i - 1].gen = 0;
+      free_.push_back(static_cast<uint32_t>(i - 1));
+    }
+  }
+
+  ~Worker() {
+    if (epoll_fd_ != -1) close(epoll_fd_);
+  }
+
+  Worker(const Worker&) = delete;
+  Worker& operator=(const Worker&) = delete;
+
+  const WorkerStats& stats() const { return stats_; }
+
+  void Run(const std::atomic<bool>& stop) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ == -1) {
+      fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+      return;
+    }
+
+    double rate = opts_.rate / opts_.threads;
+    uint64_t period = rate > 0 ? static_cast<uint64_t>(1e9 / rate) : 0;
+    uint64_t next_start = NowNs();
+    struct epoll_event events[256];
+    while (!stop.load(std::memory_order_relaxed)) {
+      uint64_t now = NowNs();
+      if (period == 0) {
+        // a failed start leaves its slot free, the next round retries it
+        // after the wait below rather than spinning on EMFILE and the like
+        while (!free_.empty() && !stop.load(std::memory_order_relaxed)) {
+          if (!Start(now, now)) break;
+        }
+      } else {
+        // closed loop does not save up starts while all slots are busy
+        if (!opts_.open_loop && next_start + 1000000000ULL < now) {
+          next_start = now;
+        }
+        while (next_start <= now) {
+          if (!free_.empty()) {
+            Start(opts_.open_loop ? next_start : now, now);
+          } else if (opts_.open_loop) {
+            stats_.dropped.Add();
+          } else {
+            break;
+          }
+          next_start += period;
+        }
+      }
+
+      uint64_t wake = now + 100000000ULL;
+      if (period != 0 && (opts_.open_loop || !free_.empty())) {
+        wake = std::min(wake, next_start);
+      }
+      if (!timers_.empty()) wake = std::min(wake, timers_.top().at);
+      int timeout = wake > now ? static_cast<int>((wake - now + 999999) / 1000000)
+                               : 0;
+
+      int n = epoll_wait(epoll_fd_, events, 256, timeout);
+      for (int i = 0; i < n; ++i) {
+        uint32_t index = static_cast<uint32_t>(events[i].data.u64 >> 32);
+        uint32_t gen = static_cast<uint32_t>(events[i].data.u64);
+        if (conns_[index].fd != -1 && conns_[index].gen == gen) {
+          OnEvent(index, events[i].events);
+        }
+      }
+
+      now = NowNs();
+      while (!timers_.empty() && timers_.top().at <= now) {
+        Timer timer = timers_.top();
+        timers_.pop();
+        Conn* c = &conns_[timer.index];
+        if (c->fd == -1 || c->gen != timer.gen) continue;
+        if (timer.send) {
+          Send(timer.index);
+        } else {
+          Finish(timer.index, kErrTimeout);
+        }
+      }
+    }
+
+    // unfinished at the end of the run, neither completed nor failed
+    for (Conn& c : conns_) {
+      if (c.fd != -1) {
+        close(c.fd);
+        c.fd = -1;
+      }
+    }
+  }
+
+ private:
+  // false when socket() or connect() failed, counted as a connect error
+  bool Start(uint64_t start_ns, uint64_t now) {
+    uint32_t index = free_.back();
+    Conn* c = &conns_[index];
+    stats_.started.Add();
+
+    int fd = socket(addr_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    0);
+    if (fd == -1) {
+      stats_.errors[kErrConnect].Add();
+      return false;
+    }
+    // each chunk of a split header goes out in a segment of its own
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, reinterpret_cast<const struct sockaddr*>(&addr_),
+                addrlen_) == -1 &&
+        errno != EINPROGRESS) {
+      close(fd);
+      stats_.errors[kErrConnect].Add();
+      return false;
+    }
+
+    free_.pop_back();
+    unsigned roll = rng_() % 100;
+    c->fd = fd;
+    c->kind = roll < static_cast<unsigned>(opts_.idle_percent) ? kIdle
+              : roll < static_cast<unsigned>(opts_.idle_percent +
+                                             opts_.slow_percent)
+                  ? kSlow
+                  : kNormal;
+    c->connected = false;
+    c->start_ns = start_ns;
+    c->header = &headers_[rng_() % headers_.size()];
+    c->sent = 0;
+    c->chunk = 0;
+    stats_.inflight.fetch_add(1, std::memory_order_relaxed);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    event.data.u64 = static_cast<uint64_t>(index) << 32 | c->gen;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+    Timer timer = {now + opts_.timeout_ms * 1000000ULL, index, c->gen, false};
+    timers_.push(timer);
+    return true;
+  }
+
+  void OnEvent(uint32_t index, uint32_t events) {
+    Conn* c = &conns_[index];
+    if (!c->connected) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err != 0) {
+        Finish(index, kErrConnect);
+        return;
+      }
+      if (!(events & EPOLLOUT)) return;
+      c->connected = true;
+      struct epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = EPOLLIN | EPOLLRDHUP;
+      event.data.u64 = static_cast<uint64_t>(index) << 32 | c->gen;
+      epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c->fd, &event);
+      Send(index);
+      if (c->fd == -1) return;
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      char buf[4096];
+      for (;;) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n > 0) continue;
+        if (n == 0) {
+          Finish(index, c->kind == kIdle || c->sent == c->header->size()
+                            ? -1
+                            : kErrEarlyClose);
+        } else if (errno == EINTR) {
+          continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          Finish(index, errno == ECONNRESET ? kErrReset : kErrOther);
+        }
+        return;
+      }
+    }
+  }
+
+  // writes the next chunk, and the ones after it while they are not delayed
+  void Send(uint32_t index) {
+    Conn* c = &conns_[index];
+    size_t size = c->header->size();
+    while (c->kind != kIdle && c->sent < size) {
+      size_t end = c->kind == kSlow ? c->sent + 1
+                                    : size * (c->chunk + 1) / opts_.split;
+      ssize_t n = send(c->fd, c->header->data() + c->sent, end - c->sent,
+                       MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        Schedule(index, 1);
+        return;
+      }
+      if (n < 0) {
+        Finish(index, errno == ECONNRESET || errno == EPIPE ? kErrReset
+                                                             : kErrOther);
+        return;
+      }
+      c->sent += n;
+      if (c->sent < end) continue;
+
+      ++c->chunk;
+      int delay = c->kind == kSlow ? opts_.slow_interval_ms
+                                   : opts_.split_delay_ms;
+      if (c->sent < size && delay > 0) {
+        Schedule(index, delay);
+        return;
+      }
+    }
+  }
+
+  void Schedule(uint32_t index, int delay_ms) {
+    Timer timer = {NowNs() + delay_ms * 1000000ULL, index, conns_[index].gen,
+                   true};
+    timers_.push(timer);
+  }
+
+  // error is a ConnError, or -1 for a connection the server closed normally
+  void Finish(uint32_t index, int error) {
+    Conn* c = &conns_[index];
+    if (error >= 0) {
+      stats_.errors[error].Add();
+    } else if (c->kind == kIdle) {
+      stats_.idle_closed.Add();
+    } else {
+      stats_.completed.Add();
+      stats_.latency.Record(NowNs() - c->start_ns);
+    }
+
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->fd, nullptr);
+    close(c->fd);
+    c->fd = -1;
+    // timers and events of this connection are stale from now on
+    ++c->gen;
+    free_.push_back(index);
+    stats_.inflight.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  const Options& opts_;
+  const struct sockaddr_storage& addr_;
+  socklen_t addrlen_;
+  const std::vector<std::string>& headers_;
+  int epoll_fd_;
+  std::mt19937 rng_;
+  std::vector<Conn> conns_;
+  // indexes of unused conns_
+  std::vector<uint32_t> free_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+  WorkerStats stats_;
+};
+
+static std::vector<std::string> MakeHeaders(int version) {
+  std::vector<std::string> headers;
+  std::mt19937 rng(1);
+  char buf[256];
+  for (int i = 0; i < 64; ++i) {
+    bool ipv6 = i % 4 >= 2;
+    InetAddress addr[2];
+    for (InetAddress& a : addr) {
+      if (ipv6) {
+        struct sockaddr_in6 addr6;
+        memset(&addr6, 0, sizeof(addr6));
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_addr.s6_addr[0] = 0x20;
+        addr6.sin6_addr.s6_addr[1] = 0x01;
+        for (int j = 2; j < 16; ++j) {
+          addr6.sin6_addr.s6_addr[j] = static_cast<uint8_t>(rng());
+        }
+        addr6.sin6_port = static_cast<uint16_t>(rng());
+        a.set_addr6(addr6);
+      } else {
+        struct sockaddr_in addr4;
+        memset(&addr4, 0, sizeof(addr4));
+        addr4.sin_family = AF_INET;
+        addr4.sin_addr.s_addr = static_cast<uint32_t>(rng());
+        addr4.sin_port = static_cast<uint16_t>(rng());
+        a.set_addr4(addr4);
+      }
+    }
+    int v = version != 0 ? version : 1 + i % 2;
+    int n = v == 1 ? EncodeProxyProtoV1(addr[0], addr[1], buf, sizeof(buf))
+                   : EncodeProxyProtoV2(addr[0], addr[1], PROXYPROTO_CMD_PROXY,
+                                        PROXYPROTO_TRANSPORT_STREAM, nullptr,
+                                        0, 0, buf, sizeof(buf));
+    if (n > 0) headers.push_back(std::string(buf, n));
+  }
+  return headers;
+}
+
+static double ReadRssMb(int pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  FILE* fp = fopen(path, "r");
+  if (fp == nullptr) return -1;
+  char line[256];
+  double mb = -1;
+  while (fgets(line, sizeof(line), fp) != nullptr) {
+    if (strncmp(line, "VmRSS:", 6) == 0) {
+      mb = atof(line + 6) / 1024;
+      break;
+    }
+  }
+  fclose(fp);
+  return mb;
+}
+
+// the records of cur that are not in prev
+static HistogramSnapshot Subtract(const HistogramSnapshot& cur,
+                                  const HistogramSnapshot& prev) {
+  HistogramSnapshot diff;
+  for (int i = 0; i < Histogram::kNumBuckets; ++i) {
+    diff.buckets[i] = cur.buckets[i] - prev.buckets[i];
+  }
+  diff.count = cur.count - prev.count;
+  diff.sum = cur.sum - prev.sum;
+  return diff;
+}
+
+struct Totals {
+  uint64_t started;
+  uint64_t completed;
+  uint64_t idle_closed;
+  uint64_t dropped;
+  uint64_t errors[kNumErrors];
+  int64_t inflight;
+  HistogramSnapshot latency;
+
+  Totals() : started(0), completed(0), idle_closed(0), dropped(0), inflight(0) {
+    std::fill(errors, errors + kNumErrors, 0);
+  }
+};
+
+static Totals Collect(const std::vector<std::unique_ptr<Worker>>& workers) {
+  Totals t;
+  for (const std::unique_ptr<Worker>& w : workers) {
+    const WorkerStats& s = w->stats();
+    t.started += s.started.Get();
+    t.completed += s.completed.Get();
+    t.idle_closed += s.idle_closed.Get();
+    t.dropped += s.dropped.Get();
+    for (int i = 0; i < kNumErrors; ++i) {
+      t.errors[i] += s.errors[i].Get();
+    }
+    t.inflight += s.inflight.load(std::memory_order_relaxed);
+    t.latency.Merge(s.latency);
+  }
+  return t;
+}
+
+static uint64_t SumErrors(const Totals& t) {
+  uint64_t n = 0;
+  for (int i = 0; i < kNumErrors; ++i) n += t.errors[i];
+  return n;
+}
+
+static int ShowHelp(const char* prog) {
+  static struct {
+    const char* option;
+    const char* desc;
+  } info[] = {
+      {"--port=PORT", "server port"},
+      {"--host=ADDR", "server address, default 127.0.0.1"},
+      {"--threads=N", "client threads, default 1"},
+      {"--connections=N", "connections in flight, default 100"},
+      {"--rate=N", "new connections a second, default as fast as possible"},
+      {"--open-loop", "start on schedule whatever is in flight, needs --rate"},
+      {"--duration=SEC", "run for SEC seconds, default 10"},
+      {"--version=V", "1, 2 or mixed headers, default mixed"},
+      {"--split=N", "send each header in N writes, default 1"},
+      {"--split-delay=MS", "pause between the writes of a header"},
+      {"--slow=PERCENT", "clients sending one byte at a time"},
+      {"--slow-interval=MS", "pause between the bytes of slow clients"},
+      {"--idle=PERCENT", "clients that connect and never send"},
+      {"--timeout=MS", "give up on a connection after MS, default 10000"},
+      {"--server-pid=PID", "report the RSS of PID"},
+      {"--interval=SEC", "seconds between progress lines, default 1"},
+  };
+  int size = sizeof(info) / sizeof(info[0]);
+  int maxlen = 0;
+  for (int i = 0; i < size; ++i) {
+    maxlen = std::max(maxlen, static_cast<int>(strlen(info[i].option)));
+  }
+  fprintf(stdout, "Usage: %s --port=PORT [OPTION]...\n\n", prog);
+  for (int i = 0; i < size; ++i) {
+    fprintf(stdout, "  %-*s  %s\n", maxlen, info[i].option, info[i].desc);
+  }
+  return 1;
+}
+
+static int ParseOptions(int argc, char** argv, Options* opts) {
+  enum {
+    kHost = 1,
+    kPort,
+    kThreads,
+    kConnections,
+    kRate,
+    kOpenLoop,
+    kDuration,
+    kVersion,
+    kSplit,
+    kSplitDelay,
+    kSlow,
+    kSlowInterval,
+    kIdle,
+    kTimeout,
+    kServerPid,
+    kInterval,
+  };
+  static struct option long_options[] = {
+      {"host", required_argument, nullptr, kHost},
+      {"port", required_argument, nullptr, kPort},
+      {"threads", required_argument, nullptr, kThreads},
+      {"connections", required_argument, nullptr, kConnections},
+      {"rate", required_argument, nullptr, kRate},
+      {"open-loop", no_argument, nullptr, kOpenLoop},
+      {"duration", required_argument, nullptr, kDuration},
+      {"version", required_argument, nullptr, kVersion},
+      {"split", required_argument, nullptr, kSplit},
+      {"split-delay", required_argument, nullptr, kSplitDelay},
+      {"slow", required_argument, nullptr, kSlow},
+      {"slow-interval", required_argument, nullptr, kSlowInterval},
+      {"idle", required_argument, nullptr, kIdle},
+      {"timeout", required_argument, nullptr, kTimeout},
+      {"server-pid", required_argument, nullptr, kServerPid},
+      {"interval", required_argument, nullptr, kInterval},
+      {nullptr, 0, nullptr, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (opt) {
+      case kHost:
+        opts->host = optarg;
+        break;
+      case kPort:
+        opts->port = atoi(optarg);
+        break;
+      case kThreads:
+        opts->threads = atoi(optarg);
+        break;
+      case kConnections:
+        opts->connections = atoi(optarg);
+        break;
+      case kRate:
+        opts->rate = atof(optarg);
+        break;
+      case kOpenLoop:
+        opts->open_loop = true;
+        break;
+      case kDuration:
+        opts->duration = atof(optarg);
+        break;
+      case kVersion:
+        if (strcmp(optarg, "mixed") == 0) {
+          opts->version = 0;
+        } else {
+          opts->version = atoi(optarg);
+          if (opts->version != 1 && opts->version != 2) return -1;
+        }
+        break;
+      case kSplit:
+        opts->split = atoi(optarg);
+        break;
+      case kSplitDelay:
+        opts->split_delay_ms = atoi(optarg);
+        break;
+      case kSlow:
+        opts->slow_percent = atoi(optarg);
+        break;
+      case kSlowInterval:
+        opts->slow_interval_ms = atoi(optarg);
+        break;
+      case kIdle:
+        opts->idle_percent = atoi(optarg);
+        break;
+      case kTimeout:
+        opts->timeout_ms = atoi(optarg);
+        break;
+      case kServerPid:
+        opts->server_pid = atoi(optarg);
+        break;
+      case kInterval:
+        opts->interval = atof(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if (optind != argc || opts->port <= 0 || opts->port > 65535 ||
+      opts->threads <= 0 || opts->connections < opts->threads ||
+      opts->rate < 0 || (opts->open_loop && opts->rate == 0) ||
+      opts->duration <= 0 || opts->split <= 0 || opts->split_delay_ms < 0 ||
+      opts->slow_percent < 0 || opts->idle_percent < 0 ||
+      opts->slow_percent + opts->idle_percent > 100 ||
+      opts->slow_interval_ms < 0 || opts->timeout_ms <= 0 ||
+      opts->interval <= 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  Options opts;
+  if (ParseOptions(argc, argv, &opts) != 0) {
+    return ShowHelp(argv[0]);
+  }
+
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  memset(&addr, 0, sizeof(addr));
+  struct sockaddr_in* addr4 = reinterpret_cast<struct sockaddr_in*>(&addr);
+  struct sockaddr_in6* addr6 = reinterpret_cast<struct sockaddr_in6*>(&addr);
+  if (inet_pton(AF_INET, opts.host.c_str(), &addr4->sin_addr) == 1) {
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = htons(static_cast<uint16_t>(opts.port));
+    addrlen = sizeof(*addr4);
+  } else if (inet_pton(AF_INET6, opts.host.c_str(), &addr6->sin6_addr) == 1) {
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port = htons(static_cast<uint16_t>(opts.port));
+    addrlen = sizeof(*addr6);
+  } else {
+    fprintf(stderr, "bad address %s\n", opts.host.c_str());
+    return 1;
+  }
+
+  std::vector<std::string> headers = MakeHeaders(opts.version);
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (int i = 0; i < opts.threads; ++i) {
+    workers.emplace_back(new Worker(opts, addr, addrlen, headers, i));
+  }
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> threads;
+  for (auto& w : workers) {
+    Worker* worker = w.get();
+    threads.emplace_back([worker, &stop]() { worker->Run(stop); });
+  }
+
+  fprintf(stdout, "%8s %10s %9s %11s %8s %9s %9s %9s %9s\n", "time",
+          "conns/s", "inflight", "completed", "errors", "p50(ms)", "p99(ms)",
+          "p999(ms)", "rss(MB)");
+  uint64_t begin = NowNs();
+  uint64_t end = begin + static_cast<uint64_t>(opts.duration * 1e9);
+  uint64_t last = begin;
+  Totals prev = Collect(workers);
+  while (NowNs() < end) {
+    uint64_t next = std::min(
+        last + static_cast<uint64_t>(opts.interval * 1e9), end);
+    uint64_t now = NowNs();
+    if (next > now) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+    }
+    now = NowNs();
+    Totals cur = Collect(workers);
+    HistogramSnapshot latency = Subtract(cur.latency, prev.latency);
+    char rss[16] = "-";
+    if (opts.server_pid > 0) {
+      double mb = ReadRssMb(opts.server_pid);
+      if (mb >= 0) snprintf(rss, sizeof(rss), "%.1f", mb);
+    }
+    fprintf(stdout, "%8.1f %10.0f %9" PRId64 " %11" PRIu64 " %8" PRIu64
+            " %9.3f %9.3f %9.3f %9s\n",
+            (now - begin) / 1e9,
+            (cur.completed - prev.completed) * 1e9 / (now - last),
+            cur.inflight, cur.completed, SumErrors(cur) - SumErrors(prev),
+            latency.ValueAt(0.5) / 1e6, latency.ValueAt(0.99) / 1e6,
+            latency.ValueAt(0.999) / 1e6, rss);
+    fflush(stdout);
+    prev = cur;
+    last = now;
+  }
+
+  stop.store(true);
+  for (std::thread& t : threads) {
+    t.join();
+  }
+
+  Totals t = Collect(workers);
+  double seconds = (NowNs() - begin) / 1e9;
+  fprintf(stdout,
+          "\n%" PRIu64 " started, %" PRIu64 " completed in %.1fs, "
+          "%.0f conns/s\n",
+          t.started, t.completed, seconds, t.completed / seconds);
+  fprintf(stdout, "latency p50 %.3fms p99 %.3fms p999 %.3fms max %.3fms\n",
+          t.latency.ValueAt(0.5) / 1e6, t.latency.ValueAt(0.99) / 1e6,
+          t.latency.ValueAt(0.999) / 1e6, t.latency.ValueAt(1) / 1e6);
+  fprintf(stdout, "errors");
+  for (int i = 0; i < kNumErrors; ++i) {
+    fprintf(stdout, " %s %" PRIu64, kErrorNames[i], t.errors[i]);
+  }
+  fprintf(stdout, ", idle closed %" PRIu64 ", dropped %" PRIu64 "\n",
+          t.idle_closed, t.dropped);
+  return 0;
+}
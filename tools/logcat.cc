@@ -0,0 +1,278 @@
+/**
+ * @file logcat.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-18
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "binlog.h"
+
+static const char* g_log_level_string[] = {"D", "I", "W", "E"};
+
+struct Site {
+  int level;
+  uint32_t line;
+  std::string file;
+  std::string func;
+  std::string fmt;
+};
+
+struct Arg {
+  char type;
+  int64_t i;
+  uint64_t u;
+  double f;
+  // strings and rendered addresses
+  std::string s;
+};
+
+static const char* GetBasename(const char* path) {
+  const char* p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+/* Same text as InetAddress::ToAddrPort(). */
+static std::string FormatAddr(int family, const uint8_t* addr,
+                              const uint8_t* port) {
+  char buf[INET6_ADDRSTRLEN + 8];
+  inet_ntop(family, addr, buf, sizeof(buf));
+  uint16_t p;
+  memcpy(&p, port, 2);
+  snprintf(buf + strlen(buf), 8, ":%u", ntohs(p));
+  return buf;
+}
+
+/* Decodes the arguments in [p, end), returns false on a truncated one. */
+static bool ParseArgs(const uint8_t* p, const uint8_t* end,
+                      std::vector<Arg>* args) {
+  args->clear();
+  while (p < end) {
+    Arg arg;
+    arg.type = static_cast<char>(*p++);
+    arg.i = 0;
+    arg.u = 0;
+    arg.f = 0;
+    switch (arg.type) {
+      case BINLOG_ARG_INT:
+      case BINLOG_ARG_UINT:
+      case BINLOG_ARG_POINTER:
+      case BINLOG_ARG_DOUBLE:
+        if (end - p < 8) return false;
+        memcpy(&arg.u, p, 8);
+        memcpy(&arg.i, p, 8);
+        memcpy(&arg.f, p, 8);
+        p += 8;
+        break;
+      case BINLOG_ARG_STRING: {
+        if (end - p < 2) return false;
+        uint16_t len;
+        memcpy(&len, p, 2);
+        if (end - p < 2 + len) return false;
+        arg.s.assign(reinterpret_cast<const char*>(p + 2), len);
+        p += 2 + len;
+      } break;
+      case BINLOG_ARG_IPV4:
+        if (end - p < 6) return false;
+        arg.s = FormatAddr(AF_INET, p, p + 4);
+        arg.type = BINLOG_ARG_STRING;
+        p += 6;
+        break;
+      case BINLOG_ARG_IPV6:
+        if (end - p < 18) return false;
+        arg.s = FormatAddr(AF_INET6, p, p + 16);
+        arg.type = BINLOG_ARG_STRING;
+        p += 18;
+        break;
+      case 0:
+        // padding up to the record alignment
+        return true;
+      default:
+        return false;
+    }
+    args->push_back(arg);
+  }
+  return true;
+}
+
+/* printf() again with each conversion of fmt fed from args. Length
+ * modifiers are replaced by the width the argument was stored with.
+ */
+static void Render(const std::string& fmt, const std::vector<Arg>& args,
+                   std::string* out) {
+  char buf[256];
+  size_t next = 0;
+  for (size_t i = 0; i < fmt.size(); ++i) {
+    if (fmt[i] != '%') {
+      out->push_back(fmt[i]);
+      continue;
+    }
+    if (i + 1 < fmt.size() && fmt[i + 1] == '%') {
+      out->push_back('%');
+      ++i;
+      continue;
+    }
+
+    std::string spec = "%";
+    size_t j = i + 1;
+    while (j < fmt.size() && strchr("-+ #0123456789.", fmt[j])) {
+      spec.push_back(fmt[j++]);
+    }
+    while (j < fmt.size() && strchr("hlLqjzt", fmt[j])) ++j;
+    if (j == fmt.size()) break;
+    char conv = fmt[j];
+    i = j;
+
+    if (next == args.size()) {
+      out->append("<missing>");
+      continue;
+    }
+    const Arg& arg = args[next++];
+    if (arg.type == BINLOG_ARG_STRING) {
+      snprintf(buf, sizeof(buf), (spec + "s").c_str(), arg.s.c_str());
+    } else if (arg.type == BINLOG_ARG_DOUBLE) {
+      snprintf(buf, sizeof(buf), (spec + conv).c_str(), arg.f);
+    } else if (conv == 'c') {
+      snprintf(buf, sizeof(buf), (spec + "c").c_str(),
+               static_cast<int>(arg.i));
+    } else if (conv == 'p' || arg.type == BINLOG_ARG_POINTER) {
+      snprintf(buf, sizeof(buf), "0x%llx",
+               static_cast<unsigned long long>(arg.u));
+    } else if (strchr("di", conv)) {
+      snprintf(buf, sizeof(buf), (spec + "lld").c_str(),
+               static_cast<long long>(arg.i));
+    } else if (strchr("ouxX", conv)) {
+      snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(),
+               static_cast<unsigned long long>(arg.u));
+    } else {
+      snprintf(buf, sizeof(buf), "<%%%c?>", conv);
+    }
+    out->append(buf);
+  }
+}
+
+int main(int argc, char** argv) {
+  bool verbose = false;
+  const char* path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if (path == nullptr && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      path = nullptr;
+      break;
+    }
+  }
+  if (path == nullptr) {
+    fprintf(stdout, "Usage: %s [-v] FILE\n", argv[0]);
+    return 1;
+  }
+
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr) {
+    fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  std::vector<uint8_t> data;
+  uint8_t chunk[65536];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(file);
+
+  if (data.size() < kBinLogHeaderSize ||
+      memcmp(data.data(), kBinLogMagic, sizeof(kBinLogMagic)) != 0) {
+    fprintf(stderr, "%s: not a binary log\n", path);
+    return 1;
+  }
+
+  std::unordered_map<uint32_t, Site> sites;
+  std::vector<Arg> args;
+  std::string line;
+  size_t off = kBinLogHeaderSize;
+  while (off + sizeof(BinLogRecord) <= data.size()) {
+    BinLogRecord rec;
+    memcpy(&rec, &data[off], sizeof(rec));
+    // zero filled space that no record was committed to
+    if (rec.size == 0) break;
+    if (rec.size < sizeof(rec) || off + rec.size > data.size()) {
+      fprintf(stderr, "%s: bad record at offset %zu\n", path, off);
+      return 1;
+    }
+
+    const uint8_t* p = &data[off] + sizeof(rec);
+    const uint8_t* end = &data[off] + rec.size;
+    off += rec.size;
+
+    if (rec.site & kBinLogSiteFlag) {
+      // level, line and three NUL terminated strings
+      if (end - p < 5) continue;
+      Site site;
+      site.level = p[0];
+      memcpy(&site.line, p + 1, 4);
+      const char* s = reinterpret_cast<const char*>(p + 5);
+      const char* e = reinterpret_cast<const char*>(end);
+      std::string* fields[] = {&site.file, &site.func, &site.fmt};
+      for (std::string* field : fields) {
+        size_t len = strnlen(s, e - s);
+        field->assign(s, len);
+        s += std::min(len + 1, static_cast<size_t>(e - s));
+      }
+      sites[rec.site & ~kBinLogSiteFlag] = site;
+      continue;
+    }
+
+    auto it = sites.find(rec.site);
+    if (it == sites.end()) {
+      fprintf(stderr, "%s: unknown site %u at offset %zu\n", path, rec.site,
+              off - rec.size);
+      continue;
+    }
+    const Site& site = it->second;
+
+    char timebuf[32];
+    time_t sec = static_cast<time_t>(rec.time / 1000000000);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &tm);
+    const char* level = site.level >= 0 && site.level <= 3
+                            ? g_log_level_string[site.level]
+                            : "U";
+
+    line.clear();
+    char prefix[512];
+    if (verbose) {
+      snprintf(prefix, sizeof(prefix), "%s.%06u [%s:%u:%s] [%s] ", timebuf,
+               static_cast<unsigned>(rec.time % 1000000000 / 1000),
+               GetBasename(site.file.c_str()), site.line, site.func.c_str(),
+               level);
+    } else {
+      snprintf(prefix, sizeof(prefix), "%s [%s] ", timebuf, level);
+    }
+    line.append(prefix);
+    if (!ParseArgs(p, end, &args)) {
+      line.append("<bad arguments> ");
+    }
+    Render(site.fmt, args, &line);
+    line.push_back('\n');
+    fwrite(line.data(), 1, line.size(), stdout);
+  }
+  return 0;
+}
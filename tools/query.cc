@@ -0,0 +1,446 @@
+/**
+ * @file query.cc
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-30
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+/* Scans the segment files of --record-dir. Each filter runs over one column
+ * of a block of records at a time and only narrows a byte mask, loops simple
+ * enough for the compiler to vectorize; rows are looked at one by one only
+ * to print those left in the mask. The 64-bit compares of the address and
+ * time filters need SSE4, so the filters are built a second time for AVX2
+ * and picked at run time.
+ */
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <endian.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "inet_address.h"
+#include "record_file.h"
+
+// records filtered at a time, the mask stays in L1
+static const uint32_t kBlock = 4096;
+
+// an address with its top len bits significant, words as in the segments
+struct Prefix {
+  bool set;
+  uint64_t mask[2];
+  uint64_t net[2];
+};
+
+struct Query {
+  Prefix src;
+  Prefix dst;
+  // [since, until) in CLOCK_REALTIME nanoseconds
+  uint64_t since;
+  uint64_t until;
+  bool errors_only;
+  bool count_only;
+};
+
+struct Totals {
+  uint64_t segments;
+  uint64_t skipped;
+  uint64_t scanned;
+  uint64_t matched;
+};
+
+// 10.0.0.0/8, 2001:db8::/32 or a single address
+static bool ParsePrefix(const char* text, Prefix* prefix) {
+  const char* slash = strchr(text, '/');
+  std::string addr = slash != nullptr ? std::string(text, slash) : text;
+  uint64_t words[2];
+  int max_len;
+  struct in_addr in;
+  struct in6_addr in6;
+  if (inet_pton(AF_INET, addr.c_str(), &in) == 1) {
+    words[0] = 0;
+    words[1] = 0xFFFF00000000ULL | ntohl(in.s_addr);
+    max_len = 32;
+  } else if (inet_pton(AF_INET6, addr.c_str(), &in6) == 1) {
+    memcpy(words, in6.s6_addr, 16);
+    words[0] = be64toh(words[0]);
+    words[1] = be64toh(words[1]);
+    max_len = 128;
+  } else {
+    return false;
+  }
+
+  int len = max_len;
+  if (slash != nullptr) {
+    char* end = nullptr;
+    long value = strtol(slash + 1, &end, 10);
+    if (end == slash + 1 || *end != '\0' || value < 0 || value > max_len) {
+      return false;
+    }
+    len = static_cast<int>(value);
+  }
+  // IPv4 prefixes cover the mapped addresses the segments store
+  if (max_len == 32) len += 96;
+
+  prefix->set = true;
+  prefix->mask[0] = len >= 64 ? ~0ULL : len == 0 ? 0 : ~0ULL << (64 - len);
+  prefix->mask[1] = len >= 128 ? ~0ULL : len <= 64 ? 0 : ~0ULL << (128 - len);
+  prefix->net[0] = words[0] & prefix->mask[0];
+  prefix->net[1] = words[1] & prefix->mask[1];
+  return true;
+}
+
+// seconds since the epoch, fractions allowed, or local time as in
+// 2022-07-30T12:00:00 or 2022-07-30
+static bool ParseTime(const char* text, uint64_t* ns) {
+  char* end = nullptr;
+  double seconds = strtod(text, &end);
+  if (end != text && *end == '\0') {
+    if (seconds < 0) return false;
+    *ns = static_cast<uint64_t>(seconds * 1e9);
+    return true;
+  }
+  static const char* const kFormats[] = {"%Y-%m-%dT%H:%M:%S",
+                                         "%Y-%m-%d %H:%M:%S", "%Y-%m-%d"};
+  for (const char* format : kFormats) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* rest = strptime(text, format, &tm);
+    if (rest != nullptr && *rest == '\0') {
+      tm.tm_isdst = -1;
+      time_t t = mktime(&tm);
+      if (t < 0) return false;
+      *ns = static_cast<uint64_t>(t) * 1000000000;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void ListSegments(const char* path, std::vector<std::string>* paths) {
+  DIR* dir = opendir(path);
+  if (dir == nullptr) {
+    // a file, or an error for RecordSegment::Open() to report
+    paths->push_back(path);
+    return;
+  }
+  while (struct dirent* entry = readdir(dir)) {
+    size_t len = strlen(entry->d_name);
+    if (len > 4 && strcmp(entry->d_name + len - 4, ".seg") == 0) {
+      paths->push_back(std::string(path) + "/" + entry->d_name);
+    }
+  }
+  closedir(dir);
+}
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+static ALWAYS_INLINE void MatchTime(const uint64_t* t, uint32_t n,
+                                    uint64_t since, uint64_t until,
+                                    uint8_t* keep) {
+  for (uint32_t i = 0; i < n; ++i) {
+    keep[i] = (t[i] >= since) & (t[i] < until);
+  }
+}
+
+static ALWAYS_INLINE void MatchPrefix(const uint64_t* hi, const uint64_t* lo,
+                                      uint32_t n, const Prefix& prefix,
+                                      uint8_t* keep) {
+  uint64_t mask0 = prefix.mask[0], mask1 = prefix.mask[1];
+  uint64_t net0 = prefix.net[0], net1 = prefix.net[1];
+  for (uint32_t i = 0; i < n; ++i) {
+    keep[i] &= ((hi[i] & mask0) == net0) & ((lo[i] & mask1) == net1);
+  }
+}
+
+static ALWAYS_INLINE void MatchErrors(const int8_t* error, uint32_t n,
+                                      uint8_t* keep) {
+  for (uint32_t i = 0; i < n; ++i) {
+    keep[i] &= error[i] != 0;
+  }
+}
+
+static ALWAYS_INLINE uint32_t CountKept(const uint8_t* keep, uint32_t n) {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    count += keep[i];
+  }
+  return count;
+}
+
+// runs the filters of q over records [begin, begin + n), returns the number
+// left in keep
+static ALWAYS_INLINE uint32_t FilterBlock(const RecordSegment& seg,
+                                          const Query& q, bool all_in_range,
+                                          uint32_t begin, uint32_t n,
+                                          uint8_t* keep) {
+  if (all_in_range) {
+    memset(keep, 1, n);
+  } else {
+    MatchTime(seg.column<uint64_t>(RECORD_TIME) + begin, n, q.since, q.until,
+              keep);
+  }
+  if (q.src.set) {
+    MatchPrefix(seg.column<uint64_t>(RECORD_SRC_HI) + begin,
+                seg.column<uint64_t>(RECORD_SRC_LO) + begin, n, q.src, keep);
+  }
+  if (q.dst.set) {
+    MatchPrefix(seg.column<uint64_t>(RECORD_DST_HI) + begin,
+                seg.column<uint64_t>(RECORD_DST_LO) + begin, n, q.dst, keep);
+  }
+  if (q.errors_only) {
+    MatchErrors(seg.column<int8_t>(RECORD_ERROR) + begin, n, keep);
+  }
+  return CountKept(keep, n);
+}
+
+typedef uint32_t (*FilterBlockFn)(const RecordSegment& seg, const Query& q,
+                                  bool all_in_range, uint32_t begin,
+                                  uint32_t n, uint8_t* keep);
+
+static uint32_t FilterBlockDefault(const RecordSegment& seg, const Query& q,
+                                   bool all_in_range, uint32_t begin,
+                                   uint32_t n, uint8_t* keep) {
+  return FilterBlock(seg, q, all_in_range, begin, n, keep);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define QUERY_X86
+__attribute__((target("avx2"))) static uint32_t FilterBlockAvx2(
+    const RecordSegment& seg, const Query& q, bool all_in_range,
+    uint32_t begin, uint32_t n, uint8_t* keep) {
+  return FilterBlock(seg, q, all_in_range, begin, n, keep);
+}
+#endif
+
+static FilterBlockFn SelectFilterBlock() {
+#ifdef QUERY_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return FilterBlockAvx2;
+#endif
+  return FilterBlockDefault;
+}
+
+static char* FormatEndpoint(uint8_t family, uint64_t hi, uint64_t lo,
+                            uint16_t port, char* p) {
+  if (family == AF_INET) {
+    struct in_addr in;
+    in.s_addr = htonl(static_cast<uint32_t>(lo));
+    p = FormatIpv4(in, p);
+  } else if (family == AF_INET6) {
+    uint64_t words[2] = {htobe64(hi), htobe64(lo)};
+    struct in6_addr in6;
+    memcpy(in6.s6_addr, words, 16);
+    *p++ = '[';
+    p = FormatIpv6(in6, p, true);
+    *p++ = ']';
+  } else {
+    const char* text = family == AF_UNIX ? "unix" : "-";
+    size_t len = strlen(text);
+    memcpy(p, text, len);
+    return p + len;
+  }
+  *p++ = ':';
+  return FormatU16(port, p);
+}
+
+class Printer {
+ public:
+  Printer() : second_(-1) { when_[0] = '\0'; }
+
+  void Print(const RecordSegment& seg, uint32_t i) {
+    uint64_t time_ns = seg.column<uint64_t>(RECORD_TIME)[i];
+    time_t sec = static_cast<time_t>(time_ns / 1000000000);
+    if (sec != second_) {
+      struct tm tm;
+      localtime_r(&sec, &tm);
+      strftime(when_, sizeof(when_), "%Y-%m-%d %H:%M:%S", &tm);
+      second_ = sec;
+    }
+
+    char line[2 * InetAddress::kTextSize + 128];
+    int n = snprintf(line, sizeof(line), "%s.%06u r%u ", when_,
+                     static_cast<unsigned>(time_ns % 1000000000 / 1000),
+                     seg.header().reactor);
+    char* p = line + n;
+    int8_t error = seg.column<int8_t>(RECORD_ERROR)[i];
+    if (error != 0) {
+      p += snprintf(p, 16, "err %d", error);
+    } else {
+      uint8_t family = seg.column<uint8_t>(RECORD_FAMILY)[i];
+      *p++ = 'v';
+      *p++ = static_cast<char>('0' + seg.column<uint8_t>(RECORD_VERSION)[i]);
+      memcpy(p, " src ", 5);
+      p = FormatEndpoint(family, seg.column<uint64_t>(RECORD_SRC_HI)[i],
+                         seg.column<uint64_t>(RECORD_SRC_LO)[i],
+                         seg.column<uint16_t>(RECORD_SRC_PORT)[i], p + 5);
+      memcpy(p, " dst ", 5);
+      p = FormatEndpoint(family, seg.column<uint64_t>(RECORD_DST_HI)[i],
+                         seg.column<uint64_t>(RECORD_DST_LO)[i],
+                         seg.column<uint16_t>(RECORD_DST_PORT)[i], p + 5);
+    }
+    *p++ = '\n';
+    fwrite(line, 1, static_cast<size_t>(p - line), stdout);
+  }
+
+ private:
+  time_t second_;
+  char when_[32];
+};
+
+static void Scan(const RecordSegment& seg, const Query& q,
+                 FilterBlockFn filter, Printer* printer, Totals* totals) {
+  const RecordSegmentHeader& h = seg.header();
+  uint32_t count = seg.count();
+  uint64_t min_ns = __atomic_load_n(&h.min_ns, __ATOMIC_RELAXED);
+  uint64_t max_ns = __atomic_load_n(&h.max_ns, __ATOMIC_RELAXED);
+  if (count == 0 || max_ns < q.since || min_ns >= q.until) {
+    ++totals->skipped;
+    return;
+  }
+  // a segment wholly within the range needs no time filter
+  bool all_in_range = min_ns >= q.since && max_ns < q.until;
+
+  uint8_t keep[kBlock];
+  for (uint32_t begin = 0; begin < count; begin += kBlock) {
+    uint32_t n = std::min(kBlock, count - begin);
+    uint32_t matched = filter(seg, q, all_in_range, begin, n, keep);
+    totals->matched += matched;
+    if (!q.count_only && matched != 0) {
+      for (uint32_t i = 0; i < n; ++i) {
+        if (keep[i]) printer->Print(seg, begin + i);
+      }
+    }
+  }
+  totals->scanned += count;
+}
+
+static int ShowHelp(const char* prog) {
+  static struct {
+    const char* option;
+    const char* desc;
+  } info[] = {
+      {"--src=CIDR", "source address of the header within CIDR"},
+      {"--dst=CIDR", "destination address of the header within CIDR"},
+      {"--since=TIME", "at or after TIME, seconds or 2022-07-30T12:00:00"},
+      {"--until=TIME", "before TIME"},
+      {"--errors", "only connections whose header was rejected"},
+      {"--count", "print the number of matches only"},
+  };
+  int size = sizeof(info) / sizeof(info[0]);
+  int maxlen = 0;
+  for (int i = 0; i < size; ++i) {
+    maxlen = std::max(maxlen, static_cast<int>(strlen(info[i].option)));
+  }
+  fprintf(stdout, "Usage: %s [OPTION]... DIR|FILE...\n\n", prog);
+  for (int i = 0; i < size; ++i) {
+    fprintf(stdout, "  %-*s  %s\n", maxlen, info[i].option, info[i].desc);
+  }
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  enum {
+    kSrc = 1,
+    kDst,
+    kSince,
+    kUntil,
+    kErrors,
+    kCount,
+  };
+  static struct option long_options[] = {
+      {"src", required_argument, nullptr, kSrc},
+      {"dst", required_argument, nullptr, kDst},
+      {"since", required_argument, nullptr, kSince},
+      {"until", required_argument, nullptr, kUntil},
+      {"errors", no_argument, nullptr, kErrors},
+      {"count", no_argument, nullptr, kCount},
+      {nullptr, 0, nullptr, 0}};
+
+  Query q;
+  memset(&q, 0, sizeof(q));
+  q.until = UINT64_MAX;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    bool ok = true;
+    switch (opt) {
+      case kSrc:
+        ok = ParsePrefix(optarg, &q.src);
+        break;
+      case kDst:
+        ok = ParsePrefix(optarg, &q.dst);
+        break;
+      case kSince:
+        ok = ParseTime(optarg, &q.since);
+        break;
+      case kUntil:
+        ok = ParseTime(optarg, &q.until);
+        break;
+      case kErrors:
+        q.errors_only = true;
+        break;
+      case kCount:
+        q.count_only = true;
+        break;
+      default:
+        ok = false;
+    }
+    if (!ok) return ShowHelp(argv[0]);
+  }
+  if (optind == argc) return ShowHelp(argv[0]);
+
+  std::vector<std::string> paths;
+  for (int i = optind; i < argc; ++i) {
+    ListSegments(argv[i], &paths);
+  }
+  // names start with the creation time, reactors interleave
+  std::sort(paths.begin(), paths.end());
+
+  auto start = std::chrono::steady_clock::now();
+  FilterBlockFn filter = SelectFilterBlock();
+  Printer printer;
+  Totals totals;
+  memset(&totals, 0, sizeof(totals));
+  int status = 0;
+  for (const std::string& path : paths) {
+    RecordSegment seg;
+    int err = seg.Open(path.c_str());
+    if (err != 0) {
+      fprintf(stderr, "open %s: %s\n", path.c_str(), strerror(-err));
+      status = 1;
+      continue;
+    }
+    ++totals.segments;
+    Scan(seg, q, filter, &printer, &totals);
+  }
+  if (q.count_only) {
+    printf("%" PRIu64 "\n", totals.matched);
+  }
+  fflush(stdout);
+
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  fprintf(stderr,
+          "%" PRIu64 " of %" PRIu64 " records matched, %" PRIu64
+          " segments (%" PRIu64 " skipped by time), %.3f s\n",
+          totals.matched, totals.scanned, totals.segments, totals.skipped,
+          elapsed);
+  return status;
+}
@@ -0,0 +1,131 @@
+/**
+ * @file ringtail.c
+ * @author fangjun.zhang (fjzhang_@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-07-29
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+/* Follows the rings of --export-ring and prints one line per connection.
+ * Written in C against proxyproto_ring.h alone, as a consumer would be.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "proxyproto_ring.h"
+
+#define MAX_RINGS 256
+
+static const char* FormatAddr(const struct pp_ring_addr* addr, char* buf,
+                              size_t size) {
+  if (addr->family == AF_UNSPEC) return "-";
+  if (addr->family == AF_UNIX) return "unix";
+  if (inet_ntop(addr->family, addr->addr, buf, (socklen_t)size) == NULL) {
+    return "?";
+  }
+  size_t len = strlen(buf);
+  snprintf(buf + len, size - len, ":%u", ntohs(addr->port));
+  return buf;
+}
+
+static void PrintRecord(const struct pp_ring_record* r) {
+  static const char* const kTransports[] = {"unspec", "stream", "dgram"};
+  time_t sec = (time_t)(r->time_ns / 1000000000);
+  struct tm tm;
+  char when[32];
+  localtime_r(&sec, &tm);
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+  char peer[64], src[64], dst[64];
+  printf("%s.%06u reactor#%u fd %d port %u v%u %s %s peer %s src %s dst %s",
+         when, (unsigned)(r->time_ns % 1000000000 / 1000), r->reactor, r->fd,
+         r->local_port, r->version, r->command ? "proxy" : "local",
+         r->transport < 3 ? kTransports[r->transport] : "?",
+         FormatAddr(&r->peer, peer, sizeof(peer)),
+         FormatAddr(&r->src, src, sizeof(src)),
+         FormatAddr(&r->dst, dst, sizeof(dst)));
+  if (r->tlv_len > 0) {
+    printf(" tlv %u crc32c %08x", r->tlv_len, r->tlv_crc32c);
+  }
+  printf("\n");
+}
+
+int main(int argc, char** argv) {
+  int all = 0;
+  long limit = -1;
+  const char* name = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-a") == 0) {
+      all = 1;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      limit = atol(argv[++i]);
+    } else if (name == NULL && argv[i][0] != '-') {
+      name = argv[i];
+    } else {
+      name = NULL;
+      break;
+    }
+  }
+  if (name == NULL) {
+    fprintf(stdout, "Usage: %s [-a] [-n COUNT] NAME\n", argv[0]);
+    fprintf(stdout, "  -a        start at the oldest record kept\n");
+    fprintf(stdout, "  -n COUNT  exit after COUNT records\n");
+    return 1;
+  }
+
+  char path[256];
+  snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+  struct pp_ring_map map;
+  int err = pp_ring_open(path, &map);
+  if (err != 0) {
+    fprintf(stderr, "open %s: %s\n", path, strerror(-err));
+    return 1;
+  }
+
+  uint32_t num_rings = map.header->num_rings;
+  if (num_rings > MAX_RINGS) num_rings = MAX_RINGS;
+  uint64_t cursors[MAX_RINGS];
+  uint64_t lost[MAX_RINGS];
+  for (uint32_t i = 0; i < num_rings; ++i) {
+    cursors[i] = all ? 0 : pp_ring_tail(&map, i);
+    lost[i] = 0;
+  }
+
+  long count = 0;
+  while (limit < 0 || count < limit) {
+    int idle = 1;
+    for (uint32_t i = 0; i < num_rings && count != limit; ++i) {
+      struct pp_ring_record record;
+      uint64_t before = lost[i];
+      if (pp_ring_read(&map, i, &cursors[i], &record, &lost[i])) {
+        PrintRecord(&record);
+        ++count;
+        idle = 0;
+      }
+      if (lost[i] != before) {
+        fprintf(stderr, "reactor#%u lost %" PRIu64 " records\n", i,
+                lost[i] - before);
+      }
+    }
+    if (idle) {
+      if (__atomic_load_n(&map.header->closed, __ATOMIC_ACQUIRE)) break;
+      fflush(stdout);
+      struct timespec ts = {0, 1000000};
+      nanosleep(&ts, NULL);
+    }
+  }
+  fflush(stdout);
+  pp_ring_close(&map);
+  return 0;
+}